@@ -1,5 +1,7 @@
 #include <regex>
 #include <mutex>
+#include <atomic>
+#include <functional>
 #include <vector>
 #include <string>
 #include <thread>
@@ -17,6 +19,8 @@
 #include <sys/inotify.h>
 #include <grpcpp/grpcpp.h>
 #include <utime.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 
 #include "src/dfs-utils.h"
 #include "src/dfslibx-clientnode-p2.h"
@@ -32,6 +36,7 @@ using grpc::Channel;
 using grpc::StatusCode;
 using grpc::ClientWriter;
 using grpc::ClientReader;
+using grpc::ClientReaderWriter;
 using grpc::ClientContext;
 
 extern dfs_log_level_e DFS_LOG_LEVEL;
@@ -46,10 +51,197 @@ extern dfs_log_level_e DFS_LOG_LEVEL;
 using FileRequestType = dfs_service::CallBackRequest;
 using FileListResponseType = dfs_service::FilesList;
 
+// Polls for the progress of an interrupted store while the server winds down its streams
+constexpr int DFS_TRANSFER_POLLS = 20;
+constexpr std::chrono::milliseconds DFS_TRANSFER_POLL_INTERVAL(100);
+
+/**
+ * Whether a transfer failed by running out of time or connectivity, rather than on its data
+ *
+ * @param code
+ * @return bool
+ */
+static bool dfs_resumable(StatusCode code) {
+    return code == StatusCode::DEADLINE_EXCEEDED || code == StatusCode::UNAVAILABLE;
+}
+
+// Least time between progress reports of a sync round
+constexpr std::chrono::seconds DFS_SYNC_PROGRESS_INTERVAL(1);
+
+/**
+ * Runs the steps of a sync plan on a bounded pool of worker threads.
+ *
+ * Workers take the next step of the plan as they finish one, so a few large
+ * transfers don't hold back the rest. Progress is reported at most once per
+ * DFS_SYNC_PROGRESS_INTERVAL and the throughput of the round at its end.
+ */
+class DFSSyncExecutor {
+
+private:
+    size_t workers;
+
+    std::mutex progress_mutex;
+    size_t done_steps = 0;
+    std::int64_t done_bytes = 0;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point last_report;
+
+    /**
+     * Record a finished step and report the progress if it is due
+     *
+     * @param bytes
+     * @param total_steps
+     */
+    void Finished(std::int64_t bytes, size_t total_steps) {
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        done_steps++;
+        done_bytes += bytes;
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_report >= DFS_SYNC_PROGRESS_INTERVAL) {
+            last_report = now;
+            dfs_log(LL_SYSINFO) << "Synchronized " << done_steps << " of " << total_steps << " steps, "
+                                << done_bytes << " bytes";
+        }
+    }
+
+public:
+    explicit DFSSyncExecutor(int workers) : workers(static_cast<size_t>(std::max(1, workers))) {}
+
+    /**
+     * Run every step of the plan and wait for them to finish
+     *
+     * @param plan
+     * @param execute - runs a step and returns the bytes it transferred
+     */
+    void Run(const std::vector<DFSSyncOp>& plan, const std::function<std::int64_t(const DFSSyncOp&)>& execute) {
+        if (plan.empty()) return;
+        start = last_report = std::chrono::steady_clock::now();
+
+        std::atomic<size_t> next(0);
+        auto work = [&]() {
+            for (size_t i = next++; i < plan.size(); i = next++) {
+                Finished(execute(plan[i]), plan.size());
+            }
+        };
+
+        // The calling thread is one of the workers
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < std::min(workers, plan.size()); i++) {
+            threads.emplace_back(work);
+        }
+        work();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        dfs_log(LL_SYSINFO) << "Synchronized " << done_steps << " steps, " << done_bytes << " bytes in "
+                            << std::fixed << std::setprecision(3) << seconds << " s ("
+                            << std::setprecision(1) << (seconds > 0 ? done_bytes / seconds / (1 << 20) : 0.0)
+                            << " MiB/s)";
+    }
+};
+
+DFSFileFilter::DFSFileFilter() {
+    SetExtensions(DFS_DEFAULT_EXTENSIONS);
+}
+
+void DFSFileFilter::SetExtensions(const std::string &list) {
+    extensions.clear();
+    std::stringstream stream(list);
+    std::string extension;
+    while (std::getline(stream, extension, ',')) {
+        if (!extension.empty() && extension[0] == '.') {
+            extension.erase(0, 1);
+        }
+        if (!extension.empty()) {
+            extensions.insert(extension);
+        }
+    }
+}
+
+void DFSFileFilter::AddInclude(const std::string &glob) {
+    includes.push_back(glob);
+}
+
+void DFSFileFilter::AddExclude(const std::string &glob) {
+    excludes.push_back(glob);
+}
+
+bool DFSFileFilter::Matches(const std::string &filename) const {
+    for (const auto& glob : excludes) {
+        if (fnmatch(glob.c_str(), filename.c_str(), FNM_PERIOD) == 0) {
+            return false;
+        }
+    }
+    if (extensions.empty()) {
+        return true;
+    }
+
+    // The suffix after the last dot is looked up in place, as a C string
+    size_t dot = filename.find_last_of('.');
+    if (dot != std::string::npos && extensions.find(filename.c_str() + dot + 1) != extensions.end()) {
+        return true;
+    }
+    for (const auto& glob : includes) {
+        if (fnmatch(glob.c_str(), filename.c_str(), FNM_PERIOD) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 DFSClientNodeP2::DFSClientNodeP2() : DFSClientNode() {}
 DFSClientNodeP2::~DFSClientNodeP2() {}
 
+void DFSClientNodeP2::SetMaxChunkSize(size_t max_chunk_size) {
+    this->max_chunk_size = std::min(max_chunk_size, DFS_MAX_CHUNK_SIZE);
+}
+
+void DFSClientNodeP2::SetCompression(dfs_service::CompressionType compression) {
+    this->compression = compression;
+}
+
+void DFSClientNodeP2::SetParallelStreams(int parallel_streams) {
+    this->parallel_streams = std::max(1, parallel_streams);
+}
+
+void DFSClientNodeP2::SetSyncWorkers(int sync_workers) {
+    this->sync_workers = std::max(1, sync_workers);
+}
+
+void DFSClientNodeP2::SetFileFilter(const DFSFileFilter& file_filter) {
+    this->file_filter = file_filter;
+}
+
+const DFSFileFilter& DFSClientNodeP2::FileFilter() const {
+    return file_filter;
+}
+
+std::mutex& DFSClientNodeP2::FileMutex(const std::string &filename) {
+    return file_mutexes[std::hash<std::string>()(filename) % file_mutexes.size()];
+}
+
+bool DFSClientNodeP2::ChangePending(const std::string &filename) {
+    std::lock_guard<std::mutex> lock(changes_mutex);
+    return changes.count(filename) || changes_in_flight.count(filename);
+}
+
+bool DFSClientNodeP2::DeferSync(const std::string &filename) {
+    std::lock_guard<std::mutex> lock(changes_mutex);
+    if (!changes.count(filename) && !changes_in_flight.count(filename)) {
+        return false;
+    }
+    sync_deferred.insert(filename);
+    return true;
+}
+
 grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::string &filename) {
+    return RequestWriteAccess(filename, nullptr);
+}
+
+grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::string &filename,
+                                                     dfs_service::WriteLockResponse* lock_response) {
 
     //
     // STUDENT INSTRUCTION:
@@ -89,10 +281,26 @@ grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::string &filename
         return status.error_code();
     }
     std::cout << "Successfully acquired write lock on file name: " << filename << std::endl;
+    if (lock_response != nullptr) {
+        lock_response->Swap(&response);
+    }
     return StatusCode::OK;
 
 }
 
+DFSMetadataIndex& DFSClientNodeP2::Metadata() {
+    std::call_once(metadata_once, [this]{
+        metadata.reset(new DFSMetadataIndex(mount_path));
+        metadata->Load();
+    });
+    return *metadata;
+}
+
+std::uint32_t DFSClientNodeP2::LocalCrc(const std::string &filename, dfs_service::ChecksumType type) {
+    FileMetadata file;
+    return Metadata().Get(filename, &file, type) ? file.Crc(type) : 0;
+}
+
 grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename) {
 
     //
@@ -121,55 +329,277 @@ grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename) {
     //
     std::cout << "-----------------------------------------------------------" << std::endl;
     std::cout << "Sending Request of storing file: " << filename << std::endl;
+    std::lock_guard<std::mutex> file_lock(FileMutex(filename));
 
     // Try to open client local file
     const std::string filepath = WrapPath(filename);
-    std::ifstream file(filepath, std::ifstream::in | std::ifstream::binary);
-    if (!file) {
+    struct stat file_stat;
+    if (lstat(filepath.c_str(), &file_stat) != 0) {
         std::cerr << "Local file does not exist." << std::endl;
         return StatusCode::NOT_FOUND;
     }
 
-    // Initiate gRPC objects
-    dfs_service::StoreResponse response;
-    grpc::ClientContext context;
-    dfs_service::StoreChunk chunk;
-
     // Gather file info for server-side validation
-    chunk.set_filename(filename);
-    chunk.set_crc(dfs_file_checksum(filepath, &crc_table));
-    struct stat file_stat;
-    lstat(filepath.c_str(), &file_stat);
-    chunk.set_mtime(file_stat.st_mtime);
-
-    // Initiate file buffer for stream transfer
-    char buffer[CHUNK_SIZE]; // 64 KB chunks
+    const dfs_service::ChecksumType store_checksum = checksum_type;
+    dfs_service::StoreChunk header;
+    header.set_filename(filename);
+    header.set_client_id(client_id);
+    header.set_checksum(store_checksum);
+    header.set_mtime(file_stat.st_mtime);
+
+    // A large file is either compared with the server's copy through the trees,
+    // or, if there is no copy, can't be a duplicate and is checksummed while it
+    // is sent instead of in a separate pass
+    const bool large = file_stat.st_size >= DFS_DELTA_MIN_SIZE;
+    dfs_service::FileTree root;
+    DFSMerkleTree local;
+    StatusCode treeStatus = large ? GetTreeNodes(filename, 0, {}, &root) : StatusCode::UNIMPLEMENTED;
+    if (treeStatus == StatusCode::NOT_FOUND) {
+        header.set_crc_trailer(true);
+    } else {
+        header.set_crc(LocalCrc(filename, store_checksum));
+    }
+    if (treeStatus == StatusCode::OK) {
+        // The index knows the checksum of an unchanged file, e.g. one just fetched,
+        // so the local tree is only loaded, or built, once the file differs
+        if (store_checksum == dfs_service::CHECKSUM_CRC32C && header.crc() == root.crc()) {
+            std::cout << "Failed to store file with error status code: " << StatusCode::ALREADY_EXISTS << std::endl;
+            std::cout << "Error message: Exact same file exists on server." << std::endl;
+            return StatusCode::ALREADY_EXISTS;
+        }
+        if (!Metadata().GetTree(filename, &local)) {
+            treeStatus = StatusCode::UNIMPLEMENTED;
+        }
+    }
 
     // Try to acquire write lock of target file
-    StatusCode writeLockStatus = RequestWriteAccess(filename);
+    dfs_service::WriteLockResponse lock;
+    StatusCode writeLockStatus = RequestWriteAccess(filename, &lock);
     if (writeLockStatus != StatusCode::OK) {
         return writeLockStatus;
     }
+    const dfs_service::CompressionType store_compression =
+        lock.compression() == compression ? compression : dfs_service::COMPRESSION_NONE;
+
+    // A large file the server has no copy of is sent in ranges, over several streams and resumably
+    if (treeStatus == StatusCode::NOT_FOUND && lock.ranged_stores() && store_checksum == dfs_service::CHECKSUM_CRC32C) {
+        StatusCode rangedStatus = StoreRanges(header, file_stat.st_size, store_compression);
+        if (rangedStatus != StatusCode::UNIMPLEMENTED) {
+            return rangedStatus;
+        }
+    }
+
+    // Send only the differences if the server has a large enough copy of the file
+    if (large && treeStatus != StatusCode::NOT_FOUND) {
+        bool sent_delta = true;
+        StatusCode deltaStatus = StatusCode::OK;
+        std::vector<std::int64_t> changed_blocks;
+        dfs_service::FileSignature signature;
+        if (treeStatus == StatusCode::OK && DiffTree(filename, local, root, &changed_blocks) == StatusCode::OK) {
+            // Changed in place: the trees tell exactly which blocks differ
+            std::cout << "Sending " << changed_blocks.size() << " changed blocks." << std::endl;
+            deltaStatus = StoreStream(header, DFS_TREE_BLOCK_SIZE, [&](const std::function<bool(DeltaOp&)>& emit) {
+                return dfs_tree_delta_encode(filepath, DFS_TREE_BLOCK_SIZE, changed_blocks, emit);
+            }, store_compression);
+        } else if (GetSignature(filename, dfs_delta_block_size(file_stat.st_size), &signature) == StatusCode::OK &&
+                   signature.file_size() >= DFS_DELTA_MIN_SIZE) {
+            deltaStatus = StoreStream(header, signature.block_size(), [&](const std::function<bool(DeltaOp&)>& emit) {
+                return dfs_delta_encode(filepath, signature, emit);
+            }, store_compression);
+        } else {
+            sent_delta = false;
+        }
+
+        if (sent_delta) {
+            if (deltaStatus != StatusCode::DATA_LOSS) {
+                return deltaStatus;
+            }
+
+            // The server couldn't apply the delta, fall back to a full transfer
+            std::cout << "Delta store failed, sending the whole file." << std::endl;
+            writeLockStatus = RequestWriteAccess(filename);
+            if (writeLockStatus != StatusCode::OK) {
+                return writeLockStatus;
+            }
+        }
+    }
+
+    return StoreStream(header, 0, nullptr, store_compression);
+}
+
+grpc::StatusCode DFSClientNodeP2::GetSignature(const std::string &filename, std::uint32_t block_size,
+                                               dfs_service::FileSignature* signature) {
+    grpc::ClientContext context;
+    dfs_service::SignatureRequest request;
+    request.set_filename(filename);
+    request.set_block_size(block_size);
+    request.set_checksum(checksum_type);
+
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout));
+    Status status = service_stub->GetFileSignature(&context, request, signature);
+    if (!status.ok()) {
+        dfs_log(LL_DEBUG2) << "No signature for " << filename << ": " << status.error_message();
+        return status.error_code();
+    }
+    return StatusCode::OK;
+}
+
+grpc::StatusCode DFSClientNodeP2::GetTreeNodes(const std::string &filename, std::uint32_t level,
+                                               const std::vector<std::int64_t>& nodes, dfs_service::FileTree* tree) {
+    grpc::ClientContext context;
+    dfs_service::FileTreeRequest request;
+    request.set_filename(filename);
+    request.set_level(level);
+    for (std::int64_t node : nodes) {
+        request.add_nodes(node);
+    }
+
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout));
+    Status status = service_stub->GetFileTree(&context, request, tree);
+    if (!status.ok()) {
+        dfs_log(LL_DEBUG2) << "No tree for " << filename << ": " << status.error_message();
+        return status.error_code();
+    }
+    return StatusCode::OK;
+}
+
+grpc::StatusCode DFSClientNodeP2::DiffTree(const std::string &filename, const DFSMerkleTree& local,
+                                           const dfs_service::FileTree& root,
+                                           std::vector<std::int64_t>* changed_blocks) {
+    changed_blocks->clear();
+
+    // The trees only line up if both copies have the same size
+    if (root.file_size() != local.FileSize() || root.block_size() != DFS_TREE_BLOCK_SIZE ||
+        root.fanout() != DFS_TREE_FANOUT || root.depth() != local.Depth() || root.hashes_size() != 1) {
+        return StatusCode::FAILED_PRECONDITION;
+    }
+
+    std::vector<std::int64_t> differing;
+    if (root.hashes(0) != local.Level(local.Depth() - 1)[0]) {
+        differing.push_back(0);
+    }
+
+    // Descend one level per round trip, only into the nodes that differ
+    for (std::uint32_t level = local.Depth() - 1; level > 0 && !differing.empty(); level--) {
+        const std::vector<std::uint32_t>& children = local.Level(level - 1);
+        std::vector<std::int64_t> nodes;
+        for (std::int64_t parent : differing) {
+            const std::int64_t end = std::min<std::int64_t>((parent + 1) * DFS_TREE_FANOUT, children.size());
+            for (std::int64_t child = parent * DFS_TREE_FANOUT; child < end; child++) {
+                nodes.push_back(child);
+            }
+        }
+        if (nodes.size() > DFS_TREE_MAX_NODES) {
+            return StatusCode::FAILED_PRECONDITION;
+        }
+
+        dfs_service::FileTree tree;
+        StatusCode status = GetTreeNodes(filename, level - 1, nodes, &tree);
+        if (status != StatusCode::OK) {
+            return status;
+        }
+        if (tree.hashes_size() != static_cast<int>(nodes.size())) {
+            return StatusCode::FAILED_PRECONDITION;
+        }
+        differing.clear();
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (tree.hashes(i) != children[nodes[i]]) {
+                differing.push_back(nodes[i]);
+            }
+        }
+    }
+
+    changed_blocks->swap(differing);
+    return StatusCode::OK;
+}
+
+grpc::StatusCode DFSClientNodeP2::StoreStream(const dfs_service::StoreChunk &header, std::uint32_t block_size,
+                                              const DeltaEncodeFunction& encode,
+                                              dfs_service::CompressionType compression) {
+    const std::string filepath = WrapPath(header.filename());
+
+    // Initiate gRPC objects
+    dfs_service::StoreResponse response;
+    grpc::ClientContext context;
+    dfs_service::StoreChunk chunk(header);
+    DFSChunkCompressor compressor(compression);
+    std::uint32_t raw_size = 0;
 
     // Start to store file
     context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout));
     std::unique_ptr<ClientWriter<dfs_service::StoreChunk> > writer = service_stub->StoreFile(&context, &response);
 
-    // Repeatedly read the file and copy into stream message
-    while (!file.eof()) {
-        file.read(buffer, CHUNK_SIZE);
-        size_t bytesRead = file.gcount();
-        if (bytesRead == 0) {
-            break;
+    if (encode) {
+        // Send the file as delta operations against the server's copy
+        chunk.set_delta(true);
+        chunk.set_block_size(block_size);
+        bool write_ok = true;
+        size_t chunks_sent = 0;
+        bool encoded = encode([&](DeltaOp& op) {
+            chunk.set_block_index(op.block_index);
+            chunk.set_block_count(op.block_count);
+            chunk.mutable_data()->swap(op.literal);
+            chunk.set_compression(compressor.Compress(chunk.mutable_data(), &raw_size));
+            chunk.set_raw_size(raw_size);
+            write_ok = writer->Write(chunk);
+            chunks_sent++;
+            return write_ok;
+        });
+        if (!write_ok) {
+            std::cerr << "Write error." << std::endl;
+        } else if (!encoded) {
+            std::cerr << "File read error." << std::endl;
+            context.TryCancel();
+        } else if (chunks_sent == 0) {
+            writer->Write(chunk);
         }
+        std::cout << "Sent delta in " << chunks_sent << " chunks." << std::endl;
+    } else {
+        // File data is read straight into the chunk message
+        off_t offset = header.offset();
+        const std::int64_t end = header.length() > 0 ? offset + header.length() : std::numeric_limits<std::int64_t>::max();
+        int fd = open(filepath.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, offset, header.length(), POSIX_FADV_SEQUENTIAL);
+        }
+
+        // Repeatedly read the file into the stream message,
+        // at least one chunk is sent so empty files are stored too
+        DFSStreamingCrc crc(header.checksum());
+        DFSChunkSizer sizer(max_chunk_size);
+        size_t chunk_size;
+        ssize_t bytesRead;
+        do {
+            chunk_size = std::min<std::int64_t>(sizer.Size(), end - offset);
+            chunk.set_offset(header.ranges() > 0 ? offset : 0);
+            bytesRead = fd < 0 ? -1 : dfs_read_chunk(fd, offset, chunk_size, chunk.mutable_data());
+            if (bytesRead < 0) {
+                std::cerr << "File read error." << std::endl;
+                context.TryCancel();
+                break;
+            }
+            offset += bytesRead;
 
-        // Copy read file into chunk message
-        chunk.set_data(buffer, bytesRead);
+            // The last chunk carries the checksum of everything read
+            if (header.crc_trailer()) {
+                crc.Update(chunk.data().data(), bytesRead);
+                if (bytesRead < static_cast<ssize_t>(chunk_size) || offset >= end) {
+                    chunk.set_crc(crc.Value());
+                }
+            }
 
-        // Send out current chunk
-        if (!writer->Write(chunk)) {
-            std::cerr << "Write error." << std::endl;
-            break;
+            // Send out current chunk
+            chunk.set_compression(compressor.Compress(chunk.mutable_data(), &raw_size));
+            chunk.set_raw_size(raw_size);
+            if (!writer->Write(chunk)) {
+                std::cerr << "Write error." << std::endl;
+                break;
+            }
+            sizer.Sent(bytesRead);
+        } while (bytesRead == static_cast<ssize_t>(chunk_size) && offset < end);
+
+        if (fd >= 0) {
+            close(fd);
         }
     }
 
@@ -183,11 +613,137 @@ grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename) {
         std::cout << "Error message: " << status.error_message() << std::endl;
         return status.error_code();
     }
+    if (header.ranges() == 0) {
+        std::cout << "Successfully stored file." << std::endl;
+    }
+    return StatusCode::OK;
+}
+
+grpc::StatusCode DFSClientNodeP2::StoreRanges(const dfs_service::StoreChunk &header, std::int64_t file_size,
+                                              dfs_service::CompressionType compression) {
+    const std::string filepath = WrapPath(header.filename());
+    std::vector<std::pair<std::int64_t, std::int64_t>> pending = dfs_file_ranges(file_size, parallel_streams);
+    if (pending.empty()) {
+        return StatusCode::UNIMPLEMENTED;
+    }
+    if (pending.size() > 1) {
+        std::cout << "Sending " << header.filename() << " in " << pending.size() << " ranges." << std::endl;
+    }
+
+    dfs_service::StoreChunk range_header(header);
+    range_header.set_ranges(static_cast<std::uint32_t>(pending.size()));
+    range_header.set_transfer_id(client_id + "-" + std::to_string(transfer_sequence++));
+    range_header.set_file_size(file_size);
+
+    // Every range is its own stream, the server commits the file once all arrived.
+    // Interrupted ranges are resumed from the pieces the server kept of them.
+    DFSRangeCrcs stored;
+    std::int64_t stored_bytes = 0;
+    while (true) {
+        std::vector<StatusCode> results(pending.size(), StatusCode::OK);
+        std::vector<std::thread> streams;
+        for (size_t i = 0; i < pending.size(); i++) {
+            streams.emplace_back([&, i]{
+                dfs_service::StoreChunk chunk(range_header);
+                chunk.set_offset(pending[i].first);
+                chunk.set_length(pending[i].second);
+                results[i] = StoreStream(chunk, 0, nullptr, compression);
+            });
+        }
+        for (std::thread& stream : streams) {
+            stream.join();
+        }
+
+        StatusCode result = StatusCode::OK;
+        for (StatusCode range_result : results) {
+            if (range_result != StatusCode::OK && (result == StatusCode::OK || dfs_resumable(result))) {
+                result = range_result;
+            }
+        }
+        if (result == StatusCode::OK) {
+            break;
+        }
+        if (!dfs_resumable(result)) {
+            return result;
+        }
+
+        dfs_service::TransferStatus progress;
+        if (GetTransfer(range_header.transfer_id(), &progress) != StatusCode::OK) {
+            return result;
+        }
+        DFSRangeCrcs pieces;
+        std::int64_t bytes = 0;
+        for (const dfs_service::TransferPiece& piece : progress.pieces()) {
+            pieces[piece.offset()] = std::make_pair(piece.crc(), piece.length());
+            bytes += piece.length();
+        }
+        if (bytes <= stored_bytes) {
+            return result;
+        }
+
+        // Pieces of interrupted ranges were never checked against the local file
+        int fd = open(filepath.c_str(), O_RDONLY);
+        bool unchanged = fd >= 0;
+        for (auto it = pieces.begin(); unchanged && it != pieces.end(); ++it) {
+            std::uint32_t crc = 0;
+            auto known = stored.find(it->first);
+            if (known == stored.end() || known->second != it->second) {
+                unchanged = dfs_range_crc(fd, it->first, it->second.second, &crc) && crc == it->second.first;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!unchanged) {
+            std::cerr << "Local file changed while it was stored." << std::endl;
+            return StatusCode::DATA_LOSS;
+        }
+
+        stored.swap(pieces);
+        stored_bytes = bytes;
+        pending = dfs_missing_ranges(stored, file_size);
+        StatusCode writeLockStatus = RequestWriteAccess(header.filename());
+        if (writeLockStatus != StatusCode::OK) {
+            return writeLockStatus;
+        }
+        range_header.set_resume(true);
+        std::cout << "Resuming store of " << header.filename() << ", " << file_size - stored_bytes
+                  << " bytes left." << std::endl;
+    }
+
     std::cout << "Successfully stored file." << std::endl;
     return StatusCode::OK;
 }
 
+grpc::StatusCode DFSClientNodeP2::GetTransfer(const std::string &transfer_id, dfs_service::TransferStatus* progress) {
+    // The server may still be winding down the streams the client gave up on
+    for (int attempt = 0; ; attempt++) {
+        grpc::ClientContext context;
+        dfs_service::TransferRequest request;
+        request.set_transfer_id(transfer_id);
+
+        progress->Clear();
+        context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout));
+        Status status = service_stub->GetTransfer(&context, request, progress);
+        if (!status.ok()) {
+            dfs_log(LL_DEBUG2) << "No progress of transfer " << transfer_id << ": " << status.error_message();
+            return status.error_code();
+        }
+        if (progress->active_ranges() == 0) {
+            return StatusCode::OK;
+        }
+        if (attempt == DFS_TRANSFER_POLLS) {
+            return StatusCode::UNAVAILABLE;
+        }
+        std::this_thread::sleep_for(DFS_TRANSFER_POLL_INTERVAL);
+    }
+}
+
 grpc::StatusCode DFSClientNodeP2::Fetch(const std::string &filename) {
+    return Fetch(filename, -1);
+}
+
+grpc::StatusCode DFSClientNodeP2::Fetch(const std::string &filename, std::int64_t size_hint) {
 
     //
     // STUDENT INSTRUCTION:
@@ -212,6 +768,198 @@ grpc::StatusCode DFSClientNodeP2::Fetch(const std::string &filename) {
     //
     std::cout << "-----------------------------------------------------------" << std::endl;
     std::cout << "Sending Request of fetching file: " << filename << std::endl;
+    std::lock_guard<std::mutex> file_lock(FileMutex(filename));
+
+    // A large file without a local copy is fetched in ranges, over several streams and resumably.
+    // Files known to be too small for ranges go straight to a single stream, without asking for their size.
+    StatusCode fetchStatus = StatusCode::UNIMPLEMENTED;
+    struct stat file_stat;
+    if (checksum_type == dfs_service::CHECKSUM_CRC32C && (size_hint < 0 || size_hint >= DFS_PARALLEL_MIN_RANGE) &&
+        lstat(WrapPath(filename).c_str(), &file_stat) != 0) {
+        fetchStatus = FetchRanges(filename);
+        if (fetchStatus == StatusCode::DATA_LOSS || fetchStatus == StatusCode::OUT_OF_RANGE) {
+            std::cout << "Ranged fetch failed, fetching over a single stream." << std::endl;
+            fetchStatus = StatusCode::UNIMPLEMENTED;
+        }
+    }
+    if (fetchStatus != StatusCode::UNIMPLEMENTED) {
+        return fetchStatus;
+    }
+
+    fetchStatus = FetchStream(filename, true);
+    if (fetchStatus == StatusCode::DATA_LOSS) {
+        // The delta couldn't be applied to the local copy, fall back to a full transfer
+        std::cout << "Delta fetch failed, fetching the whole file." << std::endl;
+        fetchStatus = FetchStream(filename, false);
+    }
+    return fetchStatus;
+}
+
+grpc::StatusCode DFSClientNodeP2::FetchRanges(const std::string &filename) {
+    // The server's copy decides the ranges, and its checksum verifies the assembled file
+    grpc::ClientContext context;
+    dfs_service::GetFileStatusRequest request;
+    dfs_service::FileStatus file_status;
+    request.set_filename(filename);
+    request.set_checksum(dfs_service::CHECKSUM_CRC32C);
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout));
+    Status status = service_stub->GetFileStatus(&context, request, &file_status);
+    if (!status.ok()) {
+        return status.error_code() == StatusCode::NOT_FOUND ? StatusCode::NOT_FOUND : StatusCode::UNIMPLEMENTED;
+    }
+
+    const std::int64_t file_size = file_status.filesize();
+    std::vector<std::pair<std::int64_t, std::int64_t>> pending = dfs_file_ranges(file_size, parallel_streams);
+    if (pending.empty()) {
+        return StatusCode::UNIMPLEMENTED;
+    }
+    if (pending.size() > 1) {
+        std::cout << "Fetching " << filename << " in " << pending.size() << " ranges." << std::endl;
+    }
+
+    // Ranges are written into place in a hidden file, which replaces the local copy once complete
+    const std::string filepath = WrapPath(filename);
+    const std::string outpath = WrapPath(dfs_hidden_path(filename, ".dfs-fetch"));
+    dfs_make_directories(mount_path, dfs_parent_path(filename));
+    int fd = open(outpath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, file_size) != 0) {
+        std::cerr << "Failed to initiate local fd." << std::endl;
+        if (fd >= 0) {
+            close(fd);
+            remove(outpath.c_str());
+        }
+        return StatusCode::CANCELLED;
+    }
+
+    // Interrupted ranges keep what arrived, the missing ranges are fetched again while that makes progress
+    DFSRangeCrcs pieces;
+    std::int64_t fetched = 0;
+    StatusCode result;
+    while (true) {
+        std::vector<StatusCode> results(pending.size(), StatusCode::OK);
+        std::vector<std::pair<std::uint32_t, std::int64_t>> received(pending.size());
+        std::vector<std::thread> streams;
+        for (size_t i = 0; i < pending.size(); i++) {
+            streams.emplace_back([&, i]{
+                results[i] = FetchRange(filename, fd, pending[i].first, pending[i].second, file_status.mtime(),
+                                        &received[i]);
+            });
+        }
+        for (std::thread& stream : streams) {
+            stream.join();
+        }
+
+        result = StatusCode::OK;
+        std::int64_t bytes = fetched;
+        for (size_t i = 0; i < pending.size(); i++) {
+            if (received[i].second > 0) {
+                pieces[pending[i].first] = received[i];
+                bytes += received[i].second;
+            }
+            if (results[i] != StatusCode::OK && (result == StatusCode::OK || dfs_resumable(result))) {
+                result = results[i];
+            }
+        }
+        if (result == StatusCode::OK || !dfs_resumable(result) || bytes == fetched) {
+            break;
+        }
+        fetched = bytes;
+        pending = dfs_missing_ranges(pieces, file_size);
+        std::cout << "Resuming fetch of " << filename << ", " << file_size - fetched << " bytes left." << std::endl;
+    }
+    close(fd);
+
+    std::uint32_t file_crc = 0;
+    if (result == StatusCode::OK && (!dfs_ranges_crc(pieces, file_size, &file_crc) || file_crc != file_status.crc())) {
+        std::cerr << "Fetched file does not match the server's checksum." << std::endl;
+        result = StatusCode::DATA_LOSS;
+    }
+    if (result == StatusCode::OK && rename(outpath.c_str(), filepath.c_str()) != 0) {
+        std::cerr << "Failed to replace local file." << std::endl;
+        result = StatusCode::CANCELLED;
+    }
+    if (result != StatusCode::OK) {
+        remove(outpath.c_str());
+        return result;
+    }
+
+    // Set mtime to match with server
+    struct utimbuf new_times;
+    new_times.actime = file_status.mtime();
+    new_times.modtime = file_status.mtime();
+    utime(filepath.c_str(), &new_times);
+    Metadata().Update(filename, file_crc);
+
+    std::cout << "Successfully fetched file." << std::endl;
+    return StatusCode::OK;
+}
+
+grpc::StatusCode DFSClientNodeP2::FetchRange(const std::string &filename, int fd, std::int64_t offset,
+                                             std::int64_t length, std::int64_t mtime,
+                                             std::pair<std::uint32_t, std::int64_t>* piece) {
+    grpc::ClientContext context;
+    dfs_service::FetchRequest request;
+    dfs_service::FetchChunk chunk;
+    request.set_filename(filename);
+    request.set_checksum(dfs_service::CHECKSUM_CRC32C);
+    request.set_max_chunk_size(static_cast<std::uint32_t>(max_chunk_size));
+    request.set_compression(compression);
+    request.set_offset(offset);
+    request.set_length(length);
+
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout));
+    std::unique_ptr<ClientReader<dfs_service::FetchChunk> > reader = service_stub->FetchFile(&context, request);
+
+    // Chunks must continue the range in order and come from the same copy of the file
+    DFSStreamingCrc range_crc(dfs_service::CHECKSUM_CRC32C);
+    std::int64_t received = 0;
+    bool trailer = false;
+    std::uint32_t server_crc = 0;
+    StatusCode result = StatusCode::OK;
+    while (reader->Read(&chunk)) {
+        if (!dfs_decompress_chunk(chunk.compression(), chunk.raw_size(), chunk.mutable_data()) || chunk.delta() ||
+            chunk.mtime() != mtime || chunk.offset() != offset + received ||
+            received + static_cast<std::int64_t>(chunk.data().size()) > length) {
+            result = StatusCode::DATA_LOSS;
+        } else if (!dfs_write_chunk(fd, chunk.offset(), chunk.data())) {
+            std::cerr << "Failed to write file." << std::endl;
+            result = StatusCode::CANCELLED;
+        }
+        if (result != StatusCode::OK) {
+            context.TryCancel();
+            break;
+        }
+        range_crc.Update(chunk.data().data(), chunk.data().size());
+        received += chunk.data().size();
+        if (chunk.crc_trailer()) {
+            trailer = true;
+            server_crc = chunk.crc();
+        }
+    }
+
+    Status status = reader->Finish();
+    *piece = std::make_pair(0, 0);
+    if (result != StatusCode::OK) {
+        return result;
+    }
+    if (!status.ok()) {
+        std::cout << "Failed to fetch range with error status code: " << status.error_code() << std::endl;
+        std::cout << "Error message: " << status.error_message() << std::endl;
+        // What was written so far is kept for resuming the range
+        if (dfs_resumable(status.error_code())) {
+            *piece = std::make_pair(range_crc.Value(), received);
+        }
+        return status.error_code();
+    }
+    if (!trailer || received != length || range_crc.Value() != server_crc) {
+        std::cerr << "Fetched range does not match the server's checksum." << std::endl;
+        return StatusCode::DATA_LOSS;
+    }
+    *piece = std::make_pair(range_crc.Value(), received);
+    return StatusCode::OK;
+}
+
+grpc::StatusCode DFSClientNodeP2::FetchStream(const std::string &filename, bool use_delta) {
 
     // Initialize grpc objects
     grpc::ClientContext context;
@@ -219,13 +967,23 @@ grpc::StatusCode DFSClientNodeP2::Fetch(const std::string &filename) {
     dfs_service::FetchChunk chunk;
 
     // Gather file info for server-side validation
+    const dfs_service::ChecksumType fetch_checksum = checksum_type;
     request.set_filename(filename);
+    request.set_checksum(fetch_checksum);
+    request.set_max_chunk_size(static_cast<std::uint32_t>(max_chunk_size));
+    request.set_compression(compression);
     const std::string filepath = WrapPath(filename);
     struct stat file_stat;
     if (lstat(filepath.c_str(), &file_stat) == 0) {
         // File exists
-        request.set_crc(dfs_file_checksum(filepath, &crc_table));
+        request.set_crc(LocalCrc(filename, fetch_checksum));
         request.set_mtime(file_stat.st_mtime);
+
+        // Ask for the differences against the local copy only
+        if (use_delta && file_stat.st_size >= DFS_DELTA_MIN_SIZE) {
+            dfs_file_signature(filepath, dfs_delta_block_size(file_stat.st_size), fetch_checksum,
+                               request.mutable_signature());
+        }
     }
 
     // Send out fetch request
@@ -243,9 +1001,21 @@ grpc::StatusCode DFSClientNodeP2::Fetch(const std::string &filename) {
         return status.error_code();
     }
 
+    // Delta transfers are assembled next to the local copy, which they reference
+    const bool delta = chunk.delta();
+    const std::string outpath = delta ? WrapPath(dfs_hidden_path(filename, ".dfs-delta")) : filepath;
+    dfs_make_directories(mount_path, dfs_parent_path(filename));
+    std::uint32_t server_crc = chunk.crc();
+    bool verify = delta;
+    DFSStreamingCrc crc(request.checksum());
+    std::ifstream basis;
+    if (delta) {
+        basis.open(filepath, std::ifstream::in | std::ifstream::binary);
+    }
+
     // Got first chunk - now open file for writing
-    std::cout << "Storing file at: " << filepath << std::endl;
-    std::fstream file(filepath, std::ios::out | std::ios::trunc | std::ios::binary);
+    std::cout << "Storing file at: " << outpath << std::endl;
+    std::fstream file(outpath, std::ios::out | std::ios::trunc | std::ios::binary);
     if (!file.is_open()) {
         std::cerr << "Failed to initiate local fd." << std::endl;
         return StatusCode::CANCELLED;
@@ -253,21 +1023,34 @@ grpc::StatusCode DFSClientNodeP2::Fetch(const std::string &filename) {
 
     int64_t server_mtime = chunk.mtime();
 
-    // Write first chunk
-    if (!file.write(chunk.data().data(), chunk.data().size())) {
-        std::cerr << "Failed to write file." << std::endl;
-        file.close();
-        return StatusCode::CANCELLED;
-    }
-
-    // Continue receiving remaining chunks
-    while (reader->Read(&chunk)) {
+    // Write every chunk, copying referenced blocks of the local copy in delta mode,
+    // and checksum what was written to verify it against the server's checksum
+    do {
+        if (!dfs_decompress_chunk(chunk.compression(), chunk.raw_size(), chunk.mutable_data())) {
+            std::cerr << "Failed to decompress chunk." << std::endl;
+            file.close();
+            context.TryCancel();
+            break;
+        }
+        if (delta && chunk.block_count() > 0 &&
+            !dfs_delta_copy_blocks(basis, request.signature().block_size(),
+                                   chunk.block_index(), chunk.block_count(), file, &crc)) {
+            std::cerr << "Failed to copy blocks." << std::endl;
+            file.close();
+            context.TryCancel();
+            break;
+        }
         if (!file.write(chunk.data().data(), chunk.data().size())) {
             std::cerr << "Failed to write file." << std::endl;
             file.close();
             return StatusCode::CANCELLED;
         }
-    }
+        crc.Update(chunk.data().data(), chunk.data().size());
+        if (chunk.crc_trailer()) {
+            server_crc = chunk.crc();
+            verify = true;
+        }
+    } while (reader->Read(&chunk));
 
     Status status = reader->Finish();
     file.close();
@@ -276,15 +1059,40 @@ grpc::StatusCode DFSClientNodeP2::Fetch(const std::string &filename) {
     if (!status.ok()) {
         std::cout << "Failed to fetch file with error status code: " << status.error_code() << std::endl;
         std::cout << "Error message: " << status.error_message() << std::endl;
+        if (delta) {
+            remove(outpath.c_str());
+        }
         return status.error_code();
     }
 
+    if (verify && crc.Value() != server_crc) {
+        std::cerr << "Fetched file does not match the server's checksum." << std::endl;
+        if (delta) {
+            remove(outpath.c_str());
+        }
+        return StatusCode::DATA_LOSS;
+    }
+
+    // Only replace the local copy once the delta result matched the server's file
+    if (delta) {
+        if (rename(outpath.c_str(), filepath.c_str()) != 0) {
+            std::cerr << "Failed to replace local file." << std::endl;
+            remove(outpath.c_str());
+            return StatusCode::CANCELLED;
+        }
+    }
+
     // Set mtime to match with server
     struct utimbuf new_times;
     new_times.actime = server_mtime;
     new_times.modtime = server_mtime;
     utime(filepath.c_str(), &new_times);
 
+    // The checksum was computed while writing, no need to read the file again
+    if (request.checksum() == dfs_service::CHECKSUM_CRC32C) {
+        Metadata().Update(filename, crc.Value());
+    }
+
     std::cout << "Successfully fetched file." << std::endl;
     return StatusCode::OK;
 }
@@ -312,12 +1120,15 @@ grpc::StatusCode DFSClientNodeP2::Delete(const std::string &filename) {
     //
     std::cout << "-----------------------------------------------------------" << std::endl;
     std::cout << "Sending Request of deleting file: " << filename << std::endl;
+    std::lock_guard<std::mutex> file_lock(FileMutex(filename));
+    Metadata().Erase(filename);
 
     // Initialize grpc objects
     grpc::ClientContext context;
     dfs_service::DeleteRequest request;
     dfs_service::DeleteResponse response;
     request.set_filename(filename);
+    request.set_client_id(client_id);
 
     // Try to acquire write lock of target file
     StatusCode writeLockStatus = RequestWriteAccess(filename);
@@ -365,6 +1176,7 @@ grpc::StatusCode DFSClientNodeP2::List(std::map<std::string,int>* file_map, bool
     grpc::ClientContext context;
     dfs_service::ListFilesRequest request;
     dfs_service::FilesList files_list;
+    request.set_checksum(checksum_type);
 
     // Send out gRPC request
     context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout));
@@ -428,6 +1240,7 @@ grpc::StatusCode DFSClientNodeP2::Stat(const std::string &filename, void* file_s
     grpc::ClientContext context;
     dfs_service::GetFileStatusRequest request;
     request.set_filename(filename);
+    request.set_checksum(checksum_type);
 
     // Declare pointer and local storage in case *file_status is not explicitly entered
     dfs_service::FileStatus local_response;
@@ -482,6 +1295,214 @@ void DFSClientNodeP2::InotifyWatcherCallback(std::function<void()> callback) {
 
 }
 
+void DFSClientNodeP2::QueueChange(const std::string &filename, DFSChange change) {
+    std::lock_guard<std::mutex> lock(changes_mutex);
+    if ((change == DFS_CHANGE_DELETE || change == DFS_CHANGE_RMDIR) && sync_removals.erase(filename)) {
+        return;
+    }
+    auto inserted = changes.emplace(filename, DFSPendingChange());
+    DFSPendingChange& pending = inserted.first->second;
+    if (inserted.second) {
+        pending.created = change == DFS_CHANGE_CREATE || change == DFS_CHANGE_MKDIR;
+    }
+
+    // Only the last change decides what is done, an open file waits for it to go quiet
+    pending.deleted = change == DFS_CHANGE_DELETE || change == DFS_CHANGE_RMDIR;
+    pending.directory = change == DFS_CHANGE_MKDIR || change == DFS_CHANGE_RMDIR;
+    bool open = change == DFS_CHANGE_CREATE || change == DFS_CHANGE_WRITE;
+    pending.due = std::chrono::steady_clock::now() + (open ? DFS_CHANGE_QUIET_PERIOD : DFS_CHANGE_SETTLE_DELAY);
+    changes_cv.notify_one();
+}
+
+void DFSClientNodeP2::HandleChanges() {
+    std::unique_lock<std::mutex> lock(changes_mutex);
+    while (!Unmounting()) {
+        auto now = std::chrono::steady_clock::now();
+        auto next = now + DFS_CHANGE_QUIET_PERIOD;
+        std::vector<std::pair<std::string, DFSPendingChange>> ready;
+        for (auto it = changes.begin(); it != changes.end();) {
+            if (it->second.due <= now) {
+                ready.emplace_back(*it);
+                changes_in_flight.insert(it->first);
+                it = changes.erase(it);
+            } else {
+                next = std::min(next, it->second.due);
+                ++it;
+            }
+        }
+        if (ready.empty()) {
+            changes_cv.wait_until(lock, next);
+            continue;
+        }
+
+        // Transfers run without the queue lock, so the watcher keeps merging changes meanwhile.
+        // The ready changes are ordered by path, so directories are made parents first
+        // before the files in them are stored, and removed children first afterwards.
+        lock.unlock();
+        for (const auto& change : ready) {
+            if (change.second.directory && !change.second.deleted) {
+                MakeDirectory(change.first);
+            }
+        }
+        std::set<std::string> rejected;
+        for (const auto& change : ready) {
+            if (change.second.directory) {
+                continue;
+            }
+            if (!change.second.deleted) {
+                if (Store(change.first) != StatusCode::OK) {
+                    rejected.insert(change.first);
+                }
+            } else if (!change.second.created) {
+                Delete(change.first);
+            } else {
+                dfs_log(LL_DEBUG2) << "Skipping " << change.first << ", deleted right after it was created";
+            }
+        }
+        for (auto it = ready.rbegin(); it != ready.rend(); ++it) {
+            if (it->second.directory && it->second.deleted && !it->second.created) {
+                RemoveDirectory(it->first);
+            }
+        }
+        lock.lock();
+
+        // A store that was rejected, e.g. because the server's copy is newer, leaves the
+        // file to synchronization, which may have skipped the server's copy meanwhile
+        std::vector<std::string> refetch;
+        for (const auto& change : ready) {
+            changes_in_flight.erase(change.first);
+            if (!changes.count(change.first) && sync_deferred.erase(change.first) && rejected.count(change.first)) {
+                refetch.push_back(change.first);
+            }
+        }
+        if (!refetch.empty()) {
+            lock.unlock();
+            for (const std::string& filename : refetch) {
+                Fetch(filename);
+            }
+            lock.lock();
+        }
+    }
+}
+
+grpc::StatusCode DFSClientNodeP2::MakeDirectory(const std::string &path) {
+    std::cout << "-----------------------------------------------------------" << std::endl;
+    std::cout << "Sending Request of making directory: " << path << std::endl;
+
+    grpc::ClientContext context;
+    dfs_service::DirectoryRequest request;
+    dfs_service::DirectoryResponse response;
+    request.set_path(path);
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout));
+    Status status = service_stub->MakeDirectory(&context, request, &response);
+    if (!status.ok()) {
+        std::cout << "Failed to make directory, error status code: " << status.error_code() << std::endl;
+        std::cout << "Error message: " << status.error_message() << std::endl;
+        return status.error_code();
+    }
+    std::cout << "Successfully made directory." << std::endl;
+    return StatusCode::OK;
+}
+
+grpc::StatusCode DFSClientNodeP2::RemoveDirectory(const std::string &path) {
+    std::cout << "-----------------------------------------------------------" << std::endl;
+    std::cout << "Sending Request of removing directory: " << path << std::endl;
+
+    for (const std::string& filename : Metadata().Entries(path)) {
+        struct stat file_stat;
+        if (lstat(WrapPath(filename).c_str(), &file_stat) != 0) {
+            Delete(filename);
+        }
+    }
+
+    grpc::ClientContext context;
+    dfs_service::DirectoryRequest request;
+    dfs_service::DirectoryResponse response;
+    request.set_path(path);
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout));
+    Status status = service_stub->RemoveDirectory(&context, request, &response);
+    if (!status.ok()) {
+        std::cout << "Failed to remove directory, error status code: " << status.error_code() << std::endl;
+        std::cout << "Error message: " << status.error_message() << std::endl;
+        return status.error_code();
+    }
+    std::cout << "Successfully removed directory." << std::endl;
+    return StatusCode::OK;
+}
+
+int DFSClientNodeP2::WatchMount(int fd, std::uint32_t event_flags) {
+    {
+        std::lock_guard<std::mutex> lock(watches_mutex);
+        watch_fd = fd;
+        watch_flags = event_flags;
+    }
+    return AddWatches("", nullptr, nullptr);
+}
+
+int DFSClientNodeP2::AddWatches(const std::string &directory, std::vector<std::string>* files,
+                                std::vector<std::string>* directories) {
+    const std::string prefix = directory.empty() ? "" : directory + "/";
+    std::vector<std::string> found_files;
+    std::vector<std::string> found_directories;
+    if (!dfs_list_tree(WrapPath(prefix), &found_files, &found_directories)) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(watches_mutex);
+    found_directories.insert(found_directories.begin(), "");
+    int directory_wd = -1;
+    for (const std::string& found : found_directories) {
+        const std::string path = found.empty() ? directory : prefix + found;
+        // A directory moved within the mount keeps its watch, which is updated to the new path
+        int wd = inotify_add_watch(watch_fd, WrapPath(path).c_str(), watch_flags | IN_ONLYDIR);
+        if (wd < 0) {
+            dfs_log(LL_ERROR) << "Failed to watch " << WrapPath(path) << ": " << strerror(errno)
+                              << (errno == ENOSPC ? ", raise fs.inotify.max_user_watches" : "");
+            continue;
+        }
+        watches[wd] = path;
+        if (found.empty()) {
+            directory_wd = wd;
+        } else if (directories) {
+            directories->push_back(path);
+        }
+    }
+    if (files) {
+        for (const std::string& found : found_files) {
+            files->push_back(prefix + found);
+        }
+    }
+    return directory_wd;
+}
+
+void DFSClientNodeP2::WatchDirectory(const std::string &directory) {
+    std::vector<std::string> files;
+    std::vector<std::string> directories;
+    AddWatches(directory, &files, &directories);
+    for (const std::string& subdirectory : directories) {
+        QueueChange(subdirectory, DFS_CHANGE_MKDIR);
+    }
+    for (const std::string& filename : files) {
+        if (file_filter.Matches(filename)) {
+            QueueChange(filename, DFS_CHANGE_CLOSE);
+        }
+    }
+}
+
+std::string DFSClientNodeP2::WatchedPath(int wd, const char* name) {
+    std::lock_guard<std::mutex> lock(watches_mutex);
+    auto found = watches.find(wd);
+    if (found == watches.end()) {
+        return "";
+    }
+    return found->second.empty() ? std::string(name) : found->second + "/" + name;
+}
+
+void DFSClientNodeP2::Unwatch(int wd) {
+    std::lock_guard<std::mutex> lock(watches_mutex);
+    watches.erase(wd);
+}
+
 //
 // STUDENT INSTRUCTION:
 //
@@ -516,6 +1537,7 @@ void DFSClientNodeP2::HandleCallbackList() {
 
     // Block until the next result is available in the completion queue.
     while (completion_queue.Next(&tag, &ok)) {
+        std::vector<DFSSyncOp> plan;
         {
             //
             // STUDENT INSTRUCTION:
@@ -550,54 +1572,22 @@ void DFSClientNodeP2::HandleCallbackList() {
                 // Do nothing?
                 //
 
-                // Get client-side files list
-                DIR* dir = opendir(mount_path.c_str());
-                if (!dir) {
-                    dfs_log(LL_ERROR) << "Failed to open dir";
-                }
-                std::map<std::string, int64_t> client_files;
-                struct dirent* entry;
-                while ((entry = readdir(dir)) != nullptr) {
-                    if (entry->d_type == DT_REG) {
-                        std::string filename = entry->d_name;
-                        std::string filepath = WrapPath(filename);
-
-                        struct stat file_stat;
-                        if (lstat(filepath.c_str(), &file_stat) == 0) {
-                            client_files[filename] = file_stat.st_mtime;
-                        }
-                    }
+                const FileListResponseType& reply = call_data->reply;
+
+                // Servers answer with the requested checksum if they support it
+                if (reply.checksum() != checksum_type) {
+                    dfs_log(LL_SYSINFO) << "Server does not support checksum " << checksum_type.load()
+                                        << ", using " << reply.checksum();
+                    checksum_type = reply.checksum();
                 }
-                closedir(dir);
-
-                // Check every file existing on server
-                auto server_files = call_data->reply.file();
-                for (const auto& file : server_files) {
-                    // Server file not exist on client, fetch
-                    if (!client_files.count(file.filename())){
-                        Fetch(file.filename());
-                    }
-                    // Both file exist, same -> skip, not same -> compare mtime
-                    else if (dfs_file_checksum(WrapPath(file.filename()), &crc_table) != file.crc()) {
-                        if (client_files[file.filename()] < file.mtime()) {
-                            // Server file newer
-                            Fetch(file.filename());
-                        }
-                        else if (client_files[file.filename()] > file.mtime()) {
-                            // Client file newer
-                            Store(file.filename());
-                        }
-                    }
-
-                    // Current server file exists on client and operated on, remove from client list
-                    client_files.erase(file.filename());
+                if (reply.snapshot()) {
+                    SynchronizeSnapshot(reply, &plan);
+                } else {
+                    SynchronizeChanges(reply, &plan);
                 }
 
-                // Remaining client files should be deleted to synchronize with server file list
-                for (const auto& file : client_files) {
-                    std::string filepath = WrapPath(file.first);
-                    remove(filepath.c_str());
-                }
+                // Request only the changes after this listing next time
+                callback_sequence = reply.sequence();
 
             } else {
                 dfs_log(LL_ERROR) << "Status was not ok. Will try again in " << DFS_RESET_TIMEOUT << " milliseconds.";
@@ -615,6 +1605,14 @@ void DFSClientNodeP2::HandleCallbackList() {
 
         }
 
+        // The transfers run without the client mutex, the watcher only waits on the files in use
+        if (!plan.empty()) {
+            ExecutePlan(plan);
+
+            // Keep the checksums of this round for the next start of the client
+            Metadata().Save();
+        }
+
 
         // Start the process over and wait for the next callback response
         dfs_log(LL_DEBUG3) << "Calling InitCallbackList";
@@ -632,7 +1630,326 @@ void DFSClientNodeP2::HandleCallbackList() {
  * give you a chance to focus more on the project's requirements.
  */
 void DFSClientNodeP2::InitCallbackList() {
-    CallbackList<FileRequestType, FileListResponseType>();
+    FileRequestType request;
+    request.set_name("");
+    request.set_sequence(callback_sequence);
+    request.set_checksum(checksum_type);
+    CallbackList<FileRequestType, FileListResponseType>(request);
+}
+
+void DFSClientNodeP2::SynchronizeFile(const dfs_service::FileStatus& file,
+                                      std::vector<dfs_service::BatchRequest>* batch,
+                                      std::vector<DFSSyncOp>* plan) {
+    const std::string filepath = WrapPath(file.filename());
+
+    // The server learns of local changes once they are stored
+    if (DeferSync(file.filename())) {
+        dfs_log(LL_DEBUG2) << "Skipping " << file.filename() << ", local change pending";
+        return;
+    }
+
+    if (file.directory()) {
+        if (file.deleted()) {
+            plan->push_back({DFSSyncOp::RMDIR, file.filename()});
+        } else {
+            dfs_make_directories(mount_path, file.filename());
+        }
+        return;
+    }
+
+    struct stat file_stat;
+    if (lstat(filepath.c_str(), &file_stat) != 0) {
+        // Server file not exist on client, fetch (unless it was deleted)
+        if (file.deleted()) {
+            return;
+        }
+        if (file.filesize() <= DFS_BATCH_MAX_FILE_SIZE) {
+            dfs_service::BatchRequest request;
+            request.set_client_id(client_id);
+            request.mutable_fetch()->set_filename(file.filename());
+            request.mutable_fetch()->set_checksum(file.checksum());
+            batch->push_back(request);
+        } else {
+            plan->push_back({DFSSyncOp::FETCH, file.filename(), file.filesize()});
+        }
+        return;
+    }
+
+    if (file.deleted()) {
+        // File deleted on server, delete local copy
+        plan->push_back({DFSSyncOp::REMOVE, file.filename()});
+        return;
+    }
+
+    // Both file exist, same -> skip, not same -> compare mtime.
+    // Only files that changed since they were last indexed are read.
+    const std::uint32_t crc = LocalCrc(file.filename(), file.checksum());
+    if (crc != file.crc()) {
+        if (file_stat.st_mtime < file.mtime()) {
+            // Server file newer
+            if (file.filesize() <= DFS_BATCH_MAX_FILE_SIZE) {
+                dfs_service::BatchRequest request;
+                request.set_client_id(client_id);
+                request.mutable_fetch()->set_filename(file.filename());
+                request.mutable_fetch()->set_crc(crc);
+                request.mutable_fetch()->set_checksum(file.checksum());
+                request.mutable_fetch()->set_mtime(file_stat.st_mtime);
+                batch->push_back(request);
+            } else {
+                plan->push_back({DFSSyncOp::FETCH, file.filename(), file.filesize()});
+            }
+        }
+        else if (file_stat.st_mtime > file.mtime()) {
+            // Client file newer
+            if (file_stat.st_size <= DFS_BATCH_MAX_FILE_SIZE) {
+                dfs_service::BatchRequest request;
+                request.set_client_id(client_id);
+                request.mutable_store()->set_filename(file.filename());
+                request.mutable_store()->set_crc(crc);
+                request.mutable_store()->set_checksum(file.checksum());
+                request.mutable_store()->set_mtime(file_stat.st_mtime);
+                batch->push_back(request);
+            } else {
+                plan->push_back({DFSSyncOp::STORE, file.filename(), file_stat.st_size});
+            }
+        }
+    }
+}
+
+void DFSClientNodeP2::SynchronizeBatch(const std::vector<dfs_service::BatchRequest>& batch,
+                                       std::vector<DFSSyncOp>* plan) {
+    for (size_t begin = 0; begin < batch.size(); begin += DFS_BATCH_MAX_FILES) {
+        DFSSyncOp op{DFSSyncOp::BATCH};
+        op.batch.assign(batch.begin() + begin, batch.begin() + std::min(batch.size(), begin + DFS_BATCH_MAX_FILES));
+        plan->push_back(std::move(op));
+    }
+}
+
+void DFSClientNodeP2::ExecutePlan(std::vector<DFSSyncOp>& plan) {
+    dfs_log(LL_DEBUG2) << "Executing " << plan.size() << " sync steps on up to " << sync_workers << " workers";
+
+    // Directories are removed once the files in them are, deepest first
+    auto removals = std::stable_partition(plan.begin(), plan.end(), [](const DFSSyncOp& op) {
+        return op.kind != DFSSyncOp::RMDIR;
+    });
+    std::vector<DFSSyncOp> directories(std::make_move_iterator(removals), std::make_move_iterator(plan.end()));
+    plan.erase(removals, plan.end());
+
+    // Large transfers first, so they don't end up trailing the round on a single worker
+    std::stable_sort(plan.begin(), plan.end(), [](const DFSSyncOp& a, const DFSSyncOp& b) {
+        return a.bytes > b.bytes;
+    });
+    DFSSyncExecutor executor(sync_workers);
+    executor.Run(plan, [this](const DFSSyncOp& op) { return ExecuteOp(op); });
+
+    std::sort(directories.begin(), directories.end(), [](const DFSSyncOp& a, const DFSSyncOp& b) {
+        return a.filename > b.filename;
+    });
+    for (const DFSSyncOp& op : directories) {
+        ExecuteOp(op);
+    }
+}
+
+std::int64_t DFSClientNodeP2::ExecuteOp(const DFSSyncOp& op) {
+    std::int64_t bytes = 0;
+    switch (op.kind) {
+        case DFSSyncOp::FETCH:
+            return Fetch(op.filename, op.bytes) == StatusCode::OK ? op.bytes : 0;
+        case DFSSyncOp::STORE: {
+            StatusCode stored = Store(op.filename);
+            if (stored == StatusCode::RESOURCE_EXHAUSTED) {
+                // Another client holds the lock, the store is retried like a local change
+                QueueChange(op.filename, DFS_CHANGE_CLOSE);
+            }
+            return stored == StatusCode::OK ? op.bytes : 0;
+        }
+        case DFSSyncOp::REMOVE: {
+            std::lock_guard<std::mutex> file_lock(FileMutex(op.filename));
+            {
+                std::lock_guard<std::mutex> lock(changes_mutex);
+                sync_removals.insert(op.filename);
+            }
+            if (remove(WrapPath(op.filename).c_str()) != 0) {
+                std::lock_guard<std::mutex> lock(changes_mutex);
+                sync_removals.erase(op.filename);
+            }
+            Metadata().Erase(op.filename);
+            return 0;
+        }
+        case DFSSyncOp::BATCH:
+            SyncBatch(op.batch, 0, op.batch.size(), &bytes);
+            return bytes;
+        case DFSSyncOp::RMDIR: {
+            // Directories still holding files, e.g. ones that are not synchronized, are left in place
+            std::lock_guard<std::mutex> lock(changes_mutex);
+            sync_removals.insert(op.filename);
+            if (rmdir(WrapPath(op.filename).c_str()) != 0) {
+                sync_removals.erase(op.filename);
+            }
+            return 0;
+        }
+    }
+    return 0;
+}
+
+grpc::StatusCode DFSClientNodeP2::SyncBatch(const std::vector<dfs_service::BatchRequest>& batch,
+                                            size_t begin, size_t end, std::int64_t* bytes) {
+    std::cout << "-----------------------------------------------------------" << std::endl;
+    std::cout << "Sending batch of " << (end - begin) << " file operations." << std::endl;
+
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout));
+    std::unique_ptr<ClientReaderWriter<dfs_service::BatchRequest, dfs_service::BatchResponse>> stream =
+        service_stub->SyncBatch(&context);
+
+    // Requests are written from a separate thread, so the stream is never idle
+    // waiting for the response to each file
+    std::int64_t sent = 0, received = 0;
+    std::thread writer([&]() {
+        for (size_t i = begin; i < end; i++) {
+            dfs_service::BatchRequest request = batch[i];
+            if (request.has_store()) {
+                // Read the file just before sending it, so the batch is never held in memory
+                int fd = open(WrapPath(request.store().filename()).c_str(), O_RDONLY);
+                if (fd < 0) continue;
+                ssize_t bytesRead = dfs_read_chunk(fd, 0, DFS_BATCH_MAX_FILE_SIZE + 1,
+                                                   request.mutable_store()->mutable_data());
+                close(fd);
+                if (bytesRead < 0 || bytesRead > DFS_BATCH_MAX_FILE_SIZE) continue;
+                sent += bytesRead;
+            }
+            if (!stream->Write(request)) break;
+        }
+        stream->WritesDone();
+    });
+
+    std::set<std::string> handled;
+    dfs_service::BatchResponse response;
+    while (stream->Read(&response)) {
+        // Files too large for a batch are left to the single file methods
+        if (response.code() == StatusCode::OUT_OF_RANGE) {
+            continue;
+        }
+        handled.insert(response.filename());
+        if (response.code() != StatusCode::OK) {
+            std::cout << "Batch operation on " << response.filename() << " failed with error status code: "
+                      << response.code() << std::endl;
+            std::cout << "Error message: " << response.message() << std::endl;
+            // A store losing the lock to another client is retried like a local change
+            if (response.code() == StatusCode::RESOURCE_EXHAUSTED) {
+                QueueChange(response.filename(), DFS_CHANGE_CLOSE);
+            }
+            continue;
+        }
+        if (!response.has_chunk()) {
+            std::cout << "Successfully stored file: " << response.filename() << std::endl;
+            continue;
+        }
+
+        // Only data matching the server's checksum replaces the local copy,
+        // anything else is fetched again through the single file methods
+        const dfs_service::FetchChunk& chunk = response.chunk();
+        DFSStreamingCrc crc(chunk.checksum());
+        crc.Update(chunk.data().data(), chunk.data().size());
+        if (crc.Value() != chunk.crc()) {
+            std::cerr << "Fetched file does not match the server's checksum: " << response.filename() << std::endl;
+            handled.erase(response.filename());
+            continue;
+        }
+
+        // Write the fetched file to a hidden file with the server's mtime, which replaces the local copy once complete
+        const std::string filepath = WrapPath(response.filename());
+        const std::string outpath = WrapPath(dfs_hidden_path(response.filename(), ".dfs-fetch"));
+        std::lock_guard<std::mutex> file_lock(FileMutex(response.filename()));
+        dfs_make_directories(mount_path, dfs_parent_path(response.filename()));
+        std::ofstream file(outpath, std::ios::out | std::ios::trunc | std::ios::binary);
+        file.write(chunk.data().data(), chunk.data().size());
+        file.close();
+        struct utimbuf new_times;
+        new_times.actime = chunk.mtime();
+        new_times.modtime = chunk.mtime();
+        if (!file || utime(outpath.c_str(), &new_times) != 0 || rename(outpath.c_str(), filepath.c_str()) != 0) {
+            std::cerr << "Failed to write file." << std::endl;
+            remove(outpath.c_str());
+            handled.erase(response.filename());
+            continue;
+        }
+        received += chunk.data().size();
+        if (chunk.checksum() == dfs_service::CHECKSUM_CRC32C) {
+            Metadata().Update(response.filename(), chunk.crc());
+        } else {
+            Metadata().Refresh(response.filename());
+        }
+        std::cout << "Successfully fetched file: " << response.filename() << std::endl;
+    }
+    writer.join();
+    *bytes = sent + received;
+
+    Status status = stream->Finish();
+    if (!status.ok()) {
+        std::cout << "Batch failed with error status code: " << status.error_code() << std::endl;
+        std::cout << "Error message: " << status.error_message() << std::endl;
+    }
+
+    // Operations without a final outcome go through the single file methods
+    for (size_t i = begin; i < end; i++) {
+        const dfs_service::BatchRequest& request = batch[i];
+        if (request.has_store() && !handled.count(request.store().filename())) {
+            Store(request.store().filename());
+        } else if (request.has_fetch() && !handled.count(request.fetch().filename())) {
+            Fetch(request.fetch().filename());
+        }
+    }
+    return status.error_code();
+}
+
+void DFSClientNodeP2::SynchronizeChanges(const FileListResponseType& reply, std::vector<DFSSyncOp>* plan) {
+    dfs_log(LL_DEBUG2) << "Synchronizing " << reply.file_size() << " changed files";
+    std::vector<dfs_service::BatchRequest> batch;
+    for (const auto& file : reply.file()) {
+        SynchronizeFile(file, &batch, plan);
+    }
+    SynchronizeBatch(batch, plan);
+}
+
+void DFSClientNodeP2::SynchronizeSnapshot(const FileListResponseType& reply, std::vector<DFSSyncOp>* plan) {
+    dfs_log(LL_DEBUG2) << "Synchronizing snapshot of " << reply.file_size() << " files";
+
+    // Get client-side files list, hidden files are never synchronized
+    std::vector<std::string> files;
+    std::vector<std::string> directories;
+    if (!dfs_list_tree(mount_path, &files, &directories)) {
+        dfs_log(LL_ERROR) << "Failed to open dir";
+        return;
+    }
+    std::set<std::string> client_files(files.begin(), files.end());
+    std::set<std::string> client_directories(directories.begin(), directories.end());
+
+    // Check every file existing on server
+    std::vector<dfs_service::BatchRequest> batch;
+    for (const auto& file : reply.file()) {
+        SynchronizeFile(file, &batch, plan);
+
+        // Current server file exists on client and operated on, remove from client list
+        if (file.directory()) {
+            client_directories.erase(file.filename());
+        } else {
+            client_files.erase(file.filename());
+        }
+    }
+    SynchronizeBatch(batch, plan);
+
+    // Remaining client files should be deleted to synchronize with server file list
+    for (const auto& filename : client_files) {
+        if (!ChangePending(filename)) {
+            plan->push_back({DFSSyncOp::REMOVE, filename});
+        }
+    }
+    for (const auto& directory : client_directories) {
+        if (!ChangePending(directory)) {
+            plan->push_back({DFSSyncOp::RMDIR, directory});
+        }
+    }
 }
 
 //
@@ -8,12 +8,115 @@
 #include <limits.h>
 #include <chrono>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <array>
+#include <condition_variable>
 
 #include <grpcpp/grpcpp.h>
 
 #include "src/dfslibx-clientnode-p2.h"
 #include "proto-src/dfs-service.grpc.pb.h"
 
+// Number of mutexes the files of a mount are spread over, see DFSClientNodeP2::FileMutex
+constexpr size_t DFS_FILE_MUTEXES = 64;
+
+// Quiet period after the last write to a file that is still open, before it is stored
+constexpr std::chrono::milliseconds DFS_CHANGE_QUIET_PERIOD(1000);
+// Delay before a closed or deleted file is handed on, coalescing bursts of saves
+constexpr std::chrono::milliseconds DFS_CHANGE_SETTLE_DELAY(100);
+
+// Extensions of the files synchronized by default
+constexpr const char* DFS_DEFAULT_EXTENSIONS = "jpg,png,gif,txt,xlsx,docx,md,psd";
+
+/**
+ * Decides which files of a mount the watcher synchronizes.
+ *
+ * Built once when mounting, so each event costs a lookup of its extension
+ * in a set and an fnmatch per configured glob, without allocating.
+ * A file is accepted if its extension is listed or it matches an include
+ * glob, and it matches no exclude glob.
+ */
+class DFSFileFilter {
+
+private:
+    /** Accepted extensions, without the dot **/
+    std::set<std::string, std::less<>> extensions;
+
+    std::vector<std::string> includes;
+    std::vector<std::string> excludes;
+
+public:
+    DFSFileFilter();
+
+    /**
+     * Replace the accepted extensions, accepting every file if the list is empty
+     *
+     * @param list - comma separated extensions, e.g. "jpg,png"
+     */
+    void SetExtensions(const std::string& list);
+
+    /**
+     * Also accept files matching a glob
+     *
+     * @param glob
+     */
+    void AddInclude(const std::string& glob);
+
+    /**
+     * Reject files matching a glob, whatever their extension
+     *
+     * @param glob
+     */
+    void AddExclude(const std::string& glob);
+
+    /**
+     * @param filename - name of the file within the mount
+     * @return whether the file is synchronized
+     */
+    bool Matches(const std::string& filename) const;
+};
+
+/** Local change to a file of the mount, as reported by the watcher **/
+enum DFSChange {
+    /** The file was created **/
+    DFS_CHANGE_CREATE,
+    /** The file was written to and may still be open **/
+    DFS_CHANGE_WRITE,
+    /** The file was closed after writing or moved into the mount **/
+    DFS_CHANGE_CLOSE,
+    /** The file was deleted or moved out of the mount **/
+    DFS_CHANGE_DELETE,
+    /** A directory was created or moved into the mount **/
+    DFS_CHANGE_MKDIR,
+    /** A directory was deleted or moved out of the mount **/
+    DFS_CHANGE_RMDIR
+};
+
+/** Net effect of the changes to a file that are waiting to be handed on **/
+struct DFSPendingChange {
+    /** The first change was the creation of the file, so deleting it again leaves nothing to do **/
+    bool created = false;
+    /** The file is deleted, otherwise stored **/
+    bool deleted = false;
+    /** The path is a directory, which is removed or made instead **/
+    bool directory = false;
+    /** Time the change is handed on, unless the file changes again **/
+    std::chrono::steady_clock::time_point due;
+};
+
+/** A single step of reconciling the mount with a server listing **/
+struct DFSSyncOp {
+    /** RMDIR steps run after all others, deepest directories first **/
+    enum Kind { FETCH, STORE, REMOVE, BATCH, RMDIR };
+    Kind kind;
+    std::string filename;
+    /** Size of the file a FETCH or STORE step transfers, larger steps are started first **/
+    std::int64_t bytes = 0;
+    /** Small file operations sent together by a BATCH step **/
+    std::vector<dfs_service::BatchRequest> batch;
+};
+
 class DFSClientNodeP2 : public DFSClientNode {
 
 public:
@@ -37,6 +140,46 @@ public:
      */
     ~DFSClientNodeP2();
 
+    /**
+     * Set the largest transfer chunk, chunk sizes adapt below it
+     *
+     * @param max_chunk_size
+     */
+    void SetMaxChunkSize(size_t max_chunk_size);
+
+    /**
+     * Set the compression used for transfer chunks when the server supports it
+     *
+     * @param compression
+     */
+    void SetCompression(dfs_service::CompressionType compression);
+
+    /**
+     * Set the most streams a large file is transferred over
+     *
+     * @param parallel_streams
+     */
+    void SetParallelStreams(int parallel_streams);
+
+    /**
+     * Set the most files synchronized in parallel by a mount
+     *
+     * @param sync_workers
+     */
+    void SetSyncWorkers(int sync_workers);
+
+    /**
+     * Set the files the watcher synchronizes
+     *
+     * @param file_filter
+     */
+    void SetFileFilter(const DFSFileFilter& file_filter);
+
+    /**
+     * @return the files the watcher synchronizes
+     */
+    const DFSFileFilter& FileFilter() const;
+
     /**
      * Request write access to the server
      *
@@ -45,6 +188,15 @@ public:
      */
     grpc::StatusCode RequestWriteAccess(const std::string& filename) override ;
 
+    /**
+     * Request write access to the server
+     *
+     * @param filename
+     * @param response - set to the server's reply, which tells what the following store may use
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode RequestWriteAccess(const std::string& filename, dfs_service::WriteLockResponse* response);
+
     /**
      * Store a file from the mount path on to the RPC server
      *
@@ -61,6 +213,16 @@ public:
      */
     grpc::StatusCode Fetch(const std::string& filename) override ;
 
+    /**
+     * Fetch a file whose size is known from a listing, which skips asking
+     * the server for it when the file is too small for a ranged fetch
+     *
+     * @param filename
+     * @param size_hint - size of the server's copy, negative if unknown
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode Fetch(const std::string& filename, std::int64_t size_hint);
+
     /**
      * Delete a file from the RPC server
      *
@@ -137,15 +299,362 @@ public:
      */
     void InotifyWatcherCallback(std::function<void()> callback) override;
 
+    /**
+     * Queue a local change to a file.
+     *
+     * Changes are merged per file and handed on by HandleChanges once the
+     * file is closed or has been quiet for DFS_CHANGE_QUIET_PERIOD.
+     *
+     * @param filename
+     * @param change
+     */
+    void QueueChange(const std::string& filename, DFSChange change);
+
+    /**
+     * Store or delete the files whose queued changes are due, until the client unmounts
+     */
+    void HandleChanges();
+
+    /**
+     * Create a directory on the server, along with its missing parents
+     *
+     * @param path
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode MakeDirectory(const std::string& path);
+
+    /**
+     * Remove a directory from the server.
+     *
+     * Indexed files of the directory that are gone locally are deleted first,
+     * as a directory moved out of the mount reports no deletions for them.
+     *
+     * @param path
+     * @return grpc::StatusCode, FAILED_PRECONDITION if files remain in the directory
+     */
+    grpc::StatusCode RemoveDirectory(const std::string& path);
+
+    /**
+     * Watch the mount and every directory below it
+     *
+     * @param fd - inotify instance
+     * @param event_flags
+     * @return watch descriptor of the mount, -1 on failure
+     */
+    int WatchMount(int fd, std::uint32_t event_flags);
+
+    /**
+     * Watch a directory that appeared in the mount, along with its subdirectories.
+     *
+     * What the directory already holds was created before the watches,
+     * so it is queued as changed.
+     *
+     * @param directory
+     */
+    void WatchDirectory(const std::string& directory);
+
+    /**
+     * @param wd
+     * @param name - entry of the watched directory
+     * @return path of the entry within the mount, "" if the directory is no longer watched
+     */
+    std::string WatchedPath(int wd, const char* name);
+
+    /**
+     * Forget a watch the kernel removed, e.g. of a deleted directory
+     *
+     * @param wd
+     */
+    void Unwatch(int wd);
+
     //
     // STUDENT INSTRUCTION:
     //
     // You may add any additional declarations of methods or variables that you need here.
     //
 
+    /**
+     * Plan the synchronization of a single file against its server status.
+     *
+     * Small files are queued on the batch instead of getting a step of their own.
+     *
+     * @param file
+     * @param batch
+     * @param plan
+     */
+    void SynchronizeFile(const dfs_service::FileStatus& file, std::vector<dfs_service::BatchRequest>* batch,
+                         std::vector<DFSSyncOp>* plan);
+
+    /**
+     * Plan the queued small files as BATCH steps of at most DFS_BATCH_MAX_FILES
+     *
+     * @param batch
+     * @param plan
+     */
+    void SynchronizeBatch(const std::vector<dfs_service::BatchRequest>& batch, std::vector<DFSSyncOp>* plan);
+
+    /**
+     * Send a range of batch operations over a single SyncBatch stream.
+     *
+     * Operations the batch could not complete are retried through
+     * the single file Store and Fetch methods.
+     *
+     * @param batch
+     * @param begin
+     * @param end
+     * @param bytes - set to the file data sent and received by the stream
+     * @return grpc::StatusCode of the stream
+     */
+    grpc::StatusCode SyncBatch(const std::vector<dfs_service::BatchRequest>& batch, size_t begin, size_t end,
+                               std::int64_t* bytes);
+
+    /**
+     * Plan the synchronization of the files changed in an incremental listing
+     *
+     * @param reply
+     * @param plan
+     */
+    void SynchronizeChanges(const dfs_service::FilesList& reply, std::vector<DFSSyncOp>* plan);
+
+    /**
+     * Plan the synchronization of the whole mount against a full listing
+     *
+     * @param reply
+     * @param plan
+     */
+    void SynchronizeSnapshot(const dfs_service::FilesList& reply, std::vector<DFSSyncOp>* plan);
+
+    /**
+     * Run the steps of a plan on up to sync_workers threads.
+     *
+     * Called without the client mutex, so local changes are handled while
+     * the transfers run; the steps lock the files they work on instead.
+     *
+     * @param plan
+     */
+    void ExecutePlan(std::vector<DFSSyncOp>& plan);
+
+    /**
+     * Run a single step of a plan
+     *
+     * @param op
+     * @return std::int64_t bytes transferred by the step
+     */
+    std::int64_t ExecuteOp(const DFSSyncOp& op);
+
+    /**
+     * Mutex serializing the operations on a file, shared with the files that hash alike
+     *
+     * @param filename
+     * @return std::mutex&
+     */
+    std::mutex& FileMutex(const std::string& filename);
+
+    /**
+     * Whether a local change to the file is queued or being handed on, in which case it wins over the server listing
+     *
+     * @param filename
+     * @return bool
+     */
+    bool ChangePending(const std::string& filename);
+
+    /**
+     * ChangePending, remembering that the server's copy was skipped, so it is
+     * fetched if the local change is not stored after all
+     *
+     * @param filename
+     * @return bool
+     */
+    bool DeferSync(const std::string& filename);
+
+    /**
+     * Add watches for a directory of the mount and its subdirectories, in a single pass over the tree
+     *
+     * @param directory - "" for the mount itself
+     * @param files - set to the files found, may be nullptr
+     * @param directories - set to the subdirectories found, may be nullptr
+     * @return watch descriptor of the directory, -1 on failure
+     */
+    int AddWatches(const std::string& directory, std::vector<std::string>* files,
+                   std::vector<std::string>* directories);
+
+    /**
+     * Request the block signatures of the server's copy of a file
+     *
+     * @param filename
+     * @param block_size
+     * @param signature
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode GetSignature(const std::string& filename, std::uint32_t block_size,
+                                  dfs_service::FileSignature* signature);
+
+    /**
+     * Request nodes of the Merkle tree of the server's copy of a file
+     *
+     * @param filename
+     * @param level
+     * @param nodes - indexes within the level, none requests the root
+     * @param tree
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode GetTreeNodes(const std::string& filename, std::uint32_t level,
+                                  const std::vector<std::int64_t>& nodes, dfs_service::FileTree* tree);
+
+    /**
+     * Compare the Merkle tree of a local file with the server's copy,
+     * one round trip per tree level.
+     *
+     * @param filename
+     * @param local - tree of the local file
+     * @param root - root of the server's tree
+     * @param changed_blocks - ascending indexes of the blocks that differ
+     * @return grpc::StatusCode - FAILED_PRECONDITION if the trees can't be
+     *         compared or too many blocks changed
+     */
+    grpc::StatusCode DiffTree(const std::string& filename, const DFSMerkleTree& local,
+                              const dfs_service::FileTree& root, std::vector<std::int64_t>* changed_blocks);
+
+    /** Produces the delta operations of a store, passing each to the given emitter **/
+    typedef std::function<bool(const std::function<bool(DeltaOp&)>&)> DeltaEncodeFunction;
+
+    /**
+     * Stream a file to the server, either in full or as a delta
+     * against the server's copy.
+     *
+     * @param header - file info sent with every chunk
+     * @param block_size - block size of the delta operations
+     * @param encode - the delta encoder, or nullptr for a full transfer
+     * @param compression - compression the server accepts
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode StoreStream(const dfs_service::StoreChunk& header, std::uint32_t block_size,
+                                 const DeltaEncodeFunction& encode, dfs_service::CompressionType compression);
+
+    /**
+     * Store a large file the server has no copy of over one or more ranged streams,
+     * resuming the ranges that were interrupted for as long as that makes progress
+     *
+     * @param header - file info sent with every chunk
+     * @param file_size
+     * @param compression - compression the server accepts
+     * @return grpc::StatusCode - UNIMPLEMENTED if the file is too small for ranges
+     */
+    grpc::StatusCode StoreRanges(const dfs_service::StoreChunk& header, std::int64_t file_size,
+                                 dfs_service::CompressionType compression);
+
+    /**
+     * Get the pieces the server kept of an interrupted ranged store
+     *
+     * @param transfer_id
+     * @param progress
+     * @return grpc::StatusCode - NOT_FOUND if the server dropped the store
+     */
+    grpc::StatusCode GetTransfer(const std::string& transfer_id, dfs_service::TransferStatus* progress);
+
+    /**
+     * Fetch a large file the client has no copy of over one or more ranged streams,
+     * resuming the ranges that were interrupted for as long as that makes progress
+     *
+     * @param filename
+     * @return grpc::StatusCode - UNIMPLEMENTED if the file is too small for ranges
+     */
+    grpc::StatusCode FetchRanges(const std::string& filename);
+
+    /**
+     * Fetch one range of a file into the assembled file
+     *
+     * @param filename
+     * @param fd - the assembled file
+     * @param offset
+     * @param length
+     * @param mtime - modification time every chunk must carry, so all ranges come from the same copy
+     * @param piece - set to the checksum and length of the data written, also if the stream was interrupted
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode FetchRange(const std::string& filename, int fd, std::int64_t offset, std::int64_t length,
+                                std::int64_t mtime, std::pair<std::uint32_t, std::int64_t>* piece);
+
+    /**
+     * Stream a file from the server, optionally as a delta against the local copy
+     *
+     * @param filename
+     * @param use_delta
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode FetchStream(const std::string& filename, bool use_delta);
+
+    /**
+     * Metadata index of the mount, loaded from the mount on first use
+     *
+     * @return DFSMetadataIndex&
+     */
+    DFSMetadataIndex& Metadata();
+
+    /**
+     * Checksum of a local file, only recomputed if it changed since it was last indexed
+     *
+     * @param filename
+     * @param type
+     * @return checksum, 0 if the file does not exist
+     */
+    std::uint32_t LocalCrc(const std::string& filename, dfs_service::ChecksumType type);
+
 private:
     /** Mutex for client threads synchronization **/
     std::mutex client_mutex;
+
+    /** Journal sequence number of the last listing received from the server **/
+    std::int64_t callback_sequence = 0;
+
+    /**
+     * Checksum algorithm of crc fields, downgraded if the server only knows the legacy one.
+     * Read by every transfer while a callback may downgrade it, so operations read it once.
+     */
+    std::atomic<dfs_service::ChecksumType> checksum_type{dfs_service::CHECKSUM_CRC32C};
+
+    /** Largest chunk sent or accepted **/
+    size_t max_chunk_size = DFS_MAX_CHUNK_SIZE;
+
+    /** Compression used for transfer chunks if the server supports it **/
+    dfs_service::CompressionType compression = dfs_service::COMPRESSION_DEFLATE;
+
+    /** Most streams a large file is transferred over **/
+    int parallel_streams = 4;
+
+    /** Makes the transfer ids of ranged stores unique **/
+    std::atomic<std::int64_t> transfer_sequence{0};
+
+    /** Most files synchronized in parallel **/
+    int sync_workers = 4;
+
+    /** Files the watcher synchronizes **/
+    DFSFileFilter file_filter;
+
+    /** Per-file mutexes, keep the sync steps and local change handling of a file in order **/
+    std::array<std::mutex, DFS_FILE_MUTEXES> file_mutexes;
+
+    /** Local changes waiting for their files to settle **/
+    std::mutex changes_mutex;
+    std::condition_variable changes_cv;
+    std::map<std::string, DFSPendingChange> changes;
+    std::set<std::string> changes_in_flight;
+
+    /** Files and directories removed by synchronization, whose deletion events are not handed back to the server **/
+    std::set<std::string> sync_removals;
+
+    /** Files whose server copy was skipped by synchronization while a local change was pending **/
+    std::set<std::string> sync_deferred;
+
+    /** Inotify watches of the mount's directories, by watch descriptor, "" for the mount itself **/
+    std::mutex watches_mutex;
+    int watch_fd = -1;
+    std::uint32_t watch_flags = 0;
+    std::map<int, std::string> watches;
+
+    /** Metadata index of the mount, avoids rehashing unchanged files on every sync round **/
+    std::unique_ptr<DFSMetadataIndex> metadata;
+    std::once_flag metadata_once;
 };
 
 #endif
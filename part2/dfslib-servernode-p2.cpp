@@ -1,8 +1,16 @@
 #include <map>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <unordered_map>
 #include <mutex>
+#include <memory>
+#include <condition_variable>
 #include <shared_mutex>
 #include <chrono>
+#include <limits>
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <thread>
 #include <errno.h>
@@ -10,12 +18,18 @@
 #include <fstream>
 #include <getopt.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <grpcpp/grpcpp.h>
 
 #include "proto-src/dfs-service.grpc.pb.h"
 #include "src/dfslibx-call-data.h"
 #include "src/dfslibx-service-runner.h"
+#include "src/dfslibx-io-uring.h"
 #include "dfslib-shared-p2.h"
 #include "dfslib-servernode-p2.h"
 
@@ -42,6 +56,146 @@ using FileListResponseType = dfs_service::FilesList;
 
 extern dfs_log_level_e DFS_LOG_LEVEL;
 
+// Quiet period after the last modification before a synchronization round is broadcast
+constexpr std::chrono::milliseconds DFS_SYNC_QUIET_PERIOD(50);
+
+// Upper bound on how long a burst of modifications may delay a broadcast
+constexpr std::chrono::milliseconds DFS_SYNC_MAX_DELAY(500);
+
+// Number of change journal entries kept for incremental listings
+constexpr size_t DFS_JOURNAL_CAPACITY = 8192;
+
+/**
+ * A single change recorded in the server's change journal
+ */
+struct JournalEntry {
+    std::int64_t sequence;
+    dfs_service::FileStatus file;
+};
+
+// Number of independently locked shards of the write lock table
+constexpr size_t DFS_LOCK_SHARDS = 64;
+
+// Duration of a write lock lease before it may be taken over by another client
+constexpr std::chrono::milliseconds DFS_LOCK_LEASE(10000);
+
+/**
+ * Write lock table: filename -> client_id, with lease deadlines.
+ *
+ * Files are spread over shards with their own mutex, so lock requests for
+ * unrelated files don't serialize. A lease that runs out is treated as free,
+ * which stops a crashed client from holding on to a file forever.
+ */
+class DFSLockTable {
+
+private:
+
+    struct Lease {
+        std::string client_id;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, Lease> leases;
+    };
+
+    std::array<Shard, DFS_LOCK_SHARDS> shards;
+
+    Shard& ShardOf(const std::string& filename) {
+        return shards[std::hash<std::string>()(filename) % DFS_LOCK_SHARDS];
+    }
+
+public:
+
+    /**
+     * Grant or renew the lease of a file for a client
+     *
+     * @param filename
+     * @param client_id
+     * @return false if another client holds an unexpired lease
+     */
+    bool Acquire(const std::string& filename, const std::string& client_id) {
+        Shard& shard = ShardOf(filename);
+        const auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Lease& lease = shard.leases[filename];
+        if (!lease.client_id.empty() && lease.client_id != client_id && lease.deadline > now) {
+            return false;
+        }
+        lease.client_id = client_id;
+        lease.deadline = now + DFS_LOCK_LEASE;
+        return true;
+    }
+
+    /**
+     * Check that a client holds the unexpired lease of a file
+     *
+     * @param filename
+     * @param client_id
+     * @return bool
+     */
+    bool Holds(const std::string& filename, const std::string& client_id) {
+        Shard& shard = ShardOf(filename);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto lease = shard.leases.find(filename);
+        return lease != shard.leases.end() && !client_id.empty() && lease->second.client_id == client_id &&
+            lease->second.deadline > std::chrono::steady_clock::now();
+    }
+
+    /**
+     * Extend the current lease of a file, e.g. while a store makes progress
+     *
+     * @param filename
+     * @param client_id - the lease is only extended if this client holds it
+     */
+    void Extend(const std::string& filename, const std::string& client_id) {
+        Shard& shard = ShardOf(filename);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto lease = shard.leases.find(filename);
+        if (lease != shard.leases.end() && lease->second.client_id == client_id) {
+            lease->second.deadline = std::chrono::steady_clock::now() + DFS_LOCK_LEASE;
+        }
+    }
+
+    /**
+     * Release the lease of a file
+     *
+     * @param filename
+     * @param client_id - the lease is only released if this client holds it
+     */
+    void Release(const std::string& filename, const std::string& client_id) {
+        Shard& shard = ShardOf(filename);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto lease = shard.leases.find(filename);
+        if (lease != shard.leases.end() && lease->second.client_id == client_id) {
+            shard.leases.erase(lease);
+        }
+    }
+
+    /**
+     * Drop every expired lease
+     *
+     * @return number of leases dropped
+     */
+    size_t Reap() {
+        const auto now = std::chrono::steady_clock::now();
+        size_t reaped = 0;
+        for (Shard& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (auto it = shard.leases.begin(); it != shard.leases.end();) {
+                if (it->second.deadline <= now) {
+                    it = shard.leases.erase(it);
+                    reaped++;
+                } else {
+                    ++it;
+                }
+            }
+        }
+        return reaped;
+    }
+};
+
 //
 // STUDENT INSTRUCTION:
 //
@@ -66,15 +220,161 @@ extern dfs_log_level_e DFS_LOG_LEVEL;
 //
 //      - Hint: as the crc checksum is a simple integer, you can pass it around inside your message types.
 //
+// Suffix of the temporary files stores are written to before they are renamed into place
+#define DFS_STORE_TEMP_SUFFIX ".dfs-store-"
+
+/**
+ * Group commit of stored files.
+ *
+ * Stores that arrive while a commit is running are committed together by
+ * the next one: a single syncfs of the mount makes the data of the whole
+ * group durable, then every file is renamed into place, and a second syncfs
+ * makes the renames durable, whichever directories of the mount they are in.
+ */
+class DFSSyncGroup {
+
+private:
+
+    struct Commit {
+        /** Renames the file into place **/
+        std::function<bool()> apply;
+        /** Called with the outcome once the commit is durable **/
+        std::function<void(bool)> done;
+    };
+
+    FileDescriptor mount_fd;
+
+    std::mutex mutex;
+
+    std::condition_variable pending_cv;
+
+    std::vector<Commit> pending;
+
+    /** Set on destruction, the committer finishes the pending commits and exits **/
+    bool stopping = false;
+
+    std::thread committer;
+
+    void Run() {
+        std::vector<Commit> group;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                pending_cv.wait(lock, [this]{ return stopping || !pending.empty(); });
+                if (pending.empty()) {
+                    return;
+                }
+                group.swap(pending);
+            }
+
+            const bool synced = syncfs(mount_fd) == 0;
+            std::vector<bool> results;
+            for (Commit& commit : group) {
+                results.push_back(synced && commit.apply());
+            }
+            const bool renamed = syncfs(mount_fd) == 0;
+            dfs_log(LL_DEBUG2) << "Committed a group of " << group.size() << " files";
+
+            for (size_t i = 0; i < group.size(); i++) {
+                group[i].done(results[i] && renamed);
+            }
+            group.clear();
+        }
+    }
+
+public:
+
+    explicit DFSSyncGroup(const std::string& mount_path) :
+        mount_fd(open(mount_path.c_str(), O_RDONLY | O_DIRECTORY)) {
+        committer = std::thread(&DFSSyncGroup::Run, this);
+    }
+
+    ~DFSSyncGroup() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        pending_cv.notify_one();
+        committer.join();
+        if (mount_fd >= 0) {
+            close(mount_fd);
+        }
+    }
+
+    /**
+     * Queue a file for the next group commit
+     *
+     * @param apply - renames the file into place, called on the committer thread
+     * @param done - called with the outcome on the committer thread
+     */
+    void Submit(std::function<bool()> apply, std::function<void(bool)> done) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(Commit{std::move(apply), std::move(done)});
+        pending_cv.notify_one();
+    }
+};
+
+// Most streams a ranged store may be split into
+constexpr std::uint32_t DFS_MAX_RANGES = 64;
+
+// How long the pieces of an interrupted ranged store are kept for the client to resume it
+constexpr std::chrono::minutes DFS_TRANSFER_TTL(10);
+
+/**
+ * A store sent as several ranged streams.
+ *
+ * Every range is written straight into a shared temporary file and the
+ * range completing the file commits it. A range whose stream ends early
+ * keeps the piece that arrived, so the client can resume the store by
+ * sending only the missing ranges. If a range fails or the transfer is
+ * idle for DFS_TRANSFER_TTL, the temporary file is dropped along with
+ * the last reference.
+ */
+struct DFSRangedStore {
+    std::mutex mutex;
+    std::string transfer_id;
+    std::string filename;
+    std::string temppath;
+    FileDescriptor fd = -1;
+    std::int64_t file_size = 0;
+    std::int64_t mtime = 0;
+    std::uint32_t ranges = 0;
+    /** Range streams currently writing into the file **/
+    std::uint32_t active = 0;
+    bool failed = false;
+    bool committing = false;
+    bool committed = false;
+    /** Checksum and length of each piece written so far by offset **/
+    DFSRangeCrcs range_crcs;
+    std::chrono::steady_clock::time_point updated;
+
+    ~DFSRangedStore() {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!committed && !temppath.empty()) {
+            std::remove(temppath.c_str());
+        }
+    }
+
+};
+
 class DFSServiceImpl final :
-    public DFSService::WithAsyncMethod_CallbackList<DFSService::Service>,
+    public DFSService::AsyncService,
         public DFSCallDataManager<FileRequestType , FileListResponseType> {
 
 private:
 
+    /** Unary rpc methods are served from the completion queue by their sync handlers **/
+    template <typename RequestT, typename ResponseT>
+    using UnaryCallData = DFSUnaryCallData<DFSServiceImpl, RequestT, ResponseT>;
+
     /** The runner service used to start the service and manage asynchronicity **/
     DFSServiceRunner<FileRequestType, FileListResponseType> runner;
 
+    /** Runs the unary handlers that read files, stopped before the runner goes away **/
+    DFSHandlerPool handler_pool{std::max(2u, std::thread::hardware_concurrency())};
+
     /** The mount path for the server **/
     std::string mount_path;
 
@@ -95,41 +395,236 @@ private:
         return this->mount_path + filepath;
     }
 
-    /** CRC Table kept in memory for faster calculations **/
-    CRC::Table<std::uint32_t, 32> crc_table;
+    /** Metadata index of the mount, avoids recomputing checksums per request **/
+    DFSMetadataIndex metadata;
+
+    /** Durability of stored files **/
+    DFSFsyncPolicy fsync_policy;
 
-    /** Mutex for write locks **/
-    std::mutex lock_mutex;
+    /** Largest chunk sent to clients, the chunk size adapts below it **/
+    size_t max_chunk_size;
+
+    /** Compression offered for chunks in both directions **/
+    dfs_service::CompressionType compression;
+
+    /** Group committer, only used with DFS_FSYNC_GROUP **/
+    std::unique_ptr<DFSSyncGroup> sync_group;
+
+    /** Makes the names of temporary files unique **/
+    std::atomic<std::uint64_t> temp_sequence{0};
 
     /** Mutex for synchronization_flag **/
     std::mutex synchronization_flag_mutex;
 
+    /** Signalled whenever synchronization_flag is raised **/
+    std::condition_variable synchronization_cv;
+
     /** Flag for modification of files **/
     bool synchronization_flag = false;
 
-    /** Write lock table: filename -> client_id **/
-    std::map<std::string, std::string> file_locks;
+    /** Time of the most recent modification, used to coalesce bursts **/
+    std::chrono::steady_clock::time_point last_modification;
+
+    /** Watcher thread for modifications made directly on the mount path **/
+    std::thread mount_watcher;
+
+    /** Write lock table with lease expiry **/
+    DFSLockTable file_locks;
+
+    /** Reaper thread for expired write lock leases **/
+    std::thread lock_reaper;
+
+    /** Set on destruction to stop the watcher and reaper threads **/
+    std::mutex shutdown_mutex;
+    std::condition_variable shutdown_cv;
+    bool shutting_down = false;
+
+    /** Wakes the mount watcher from waiting for inotify events on shutdown **/
+    FileDescriptor shutdown_fd = -1;
+
+    /** Mutex for the change journal **/
+    std::mutex journal_mutex;
+
+    /** Sequence number of the most recent journal entry **/
+    std::int64_t journal_sequence = 0;
+
+    /** Change journal, ordered by sequence number **/
+    std::deque<JournalEntry> journal;
+
+    /** File listing as of journal_sequence **/
+    std::map<std::string, dfs_service::FileStatus> journal_files;
+
+    /** Listings built for the current round: (client sequence, checksum) -> reply, shared by all queued clients **/
+    std::map<std::pair<std::int64_t, int>, std::shared_ptr<const FileListResponseType>> round_listings;
+
+    /** Ranged stores in progress by transfer id **/
+    std::mutex ranged_mutex;
+    std::map<std::string, std::shared_ptr<DFSRangedStore>> ranged_stores;
 
 public:
 
-    DFSServiceImpl(const std::string& mount_path, const std::string& server_address, int num_async_threads):
-        mount_path(mount_path), crc_table(CRC::CRC_32()) {
+    DFSServiceImpl(const std::string& mount_path, const std::string& server_address, int num_async_threads,
+                   int num_preposted_calls, DFSFsyncPolicy fsync_policy, DFSIoBackend io_backend, int io_depth,
+                   size_t max_chunk_size, dfs_service::CompressionType compression):
+        mount_path(mount_path), metadata(mount_path), fsync_policy(fsync_policy), max_chunk_size(max_chunk_size),
+        compression(compression), shutdown_fd(eventfd(0, EFD_CLOEXEC)) {
+
+        // Transfers fall back to blocking reads and writes without io_uring support
+        if (io_backend == DFS_IO_URING) {
+            if (DFSUring::Enable(static_cast<unsigned>(std::max(io_depth, 1)))) {
+                dfs_log(LL_SYSINFO) << "Using io_uring for transfers with queue depth " << io_depth;
+            } else {
+                dfs_log(LL_ERROR) << "io_uring is not available, using blocking file I/O";
+            }
+        }
+
+        if (fsync_policy == DFS_FSYNC_GROUP) {
+            this->sync_group.reset(new DFSSyncGroup(mount_path));
+        }
+        this->RemoveTempFiles();
+
+        // Seed the journal from the startup time so that sequence numbers seen from a
+        // previous server instance always fall off the journal and force a snapshot
+        this->journal_sequence = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        this->metadata.Load();
+        this->UpdateJournal();
 
         this->runner.SetService(this);
         this->runner.SetAddress(server_address);
         this->runner.SetNumThreads(num_async_threads);
+        this->runner.SetNumPrepostedCalls(num_preposted_calls);
+        this->runner.SetMaxMessageSize(DFS_MAX_MESSAGE_SIZE);
+        this->runner.SetFlowControlWindow(DFS_FLOW_CONTROL_WINDOW);
         this->runner.SetQueuedRequestsCallback([&]{ this->ProcessQueuedRequests(); });
+        this->runner.SetAsyncCallsCallback([&](grpc::ServerCompletionQueue* cq){ this->RequestAsyncCalls(cq); });
 
     }
 
     ~DFSServiceImpl() {
         this->runner.Shutdown();
+
+        // Both threads use the service, so they are stopped before it goes away
+        {
+            std::lock_guard<std::mutex> lock(this->shutdown_mutex);
+            this->shutting_down = true;
+        }
+        this->shutdown_cv.notify_all();
+        if (this->shutdown_fd >= 0) {
+            std::uint64_t wake = 1;
+            if (write(this->shutdown_fd, &wake, sizeof(wake)) != sizeof(wake)) {
+                dfs_log(LL_ERROR) << "Failed to wake the mount watcher: " << strerror(errno);
+            }
+        }
+        if (this->mount_watcher.joinable()) {
+            this->mount_watcher.join();
+        }
+        if (this->lock_reaper.joinable()) {
+            this->lock_reaper.join();
+        }
+        if (this->shutdown_fd >= 0) {
+            close(this->shutdown_fd);
+        }
     }
 
     void Run() {
+        this->mount_watcher = std::thread(&DFSServiceImpl::WatchMountPath, this);
+        this->lock_reaper = std::thread(&DFSServiceImpl::ReapWriteLocks, this);
         this->runner.Run();
     }
 
+    /**
+     * Flag the file list as modified and wake up the queue thread
+     */
+    void RequestSynchronization() {
+        {
+            std::lock_guard<std::mutex> lock(synchronization_flag_mutex);
+            synchronization_flag = true;
+            last_modification = std::chrono::steady_clock::now();
+        }
+        synchronization_cv.notify_one();
+    }
+
+    /**
+     * Watch the mount path for files changed outside of the rpc methods
+     * (e.g. copied onto the server directly) and trigger a synchronization.
+     */
+    void WatchMountPath() {
+        const FileDescriptor fd = inotify_init();
+        if (fd < 0) {
+            dfs_log(LL_ERROR) << "Failed to start mount watcher: " << strerror(errno);
+            return;
+        }
+        uint event_flags = IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE;
+        // Watched directories by watch descriptor, relative to the mount path with a trailing '/'
+        std::map<int, std::string> watches;
+        auto watch_tree = [&](const std::string& directory) {
+            std::vector<std::string> directories{""};
+            dfs_list_tree(WrapPath(directory), nullptr, &directories);
+            for (const std::string& subdirectory : directories) {
+                const std::string path = directory + (subdirectory.empty() ? "" : subdirectory + "/");
+                int wd = inotify_add_watch(fd, WrapPath(path).c_str(), event_flags | IN_ONLYDIR);
+                if (wd < 0) {
+                    dfs_log(LL_ERROR) << "Failed to watch " << WrapPath(path) << ": " << strerror(errno);
+                    continue;
+                }
+                watches[wd] = path;
+            }
+        };
+        watch_tree("");
+        if (watches.empty()) {
+            close(fd);
+            return;
+        }
+
+        alignas(inotify_event) char events_buffer[DFS_I_BUFFER_SIZE];
+        while (true) {
+            // Wait for events, or for the service to shut down
+            struct pollfd fds[2] = {{fd, POLLIN, 0}, {shutdown_fd, POLLIN, 0}};
+            if (poll(fds, shutdown_fd >= 0 ? 2 : 1, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (fds[1].revents & POLLIN) {
+                break;
+            }
+            ssize_t len = read(fd, events_buffer, DFS_I_BUFFER_SIZE);
+            if (len <= 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+
+            bool modified = false;
+            for (ssize_t index = 0; index < len;) {
+                inotify_event* event = reinterpret_cast<inotify_event*>(&events_buffer[index]);
+                index += DFS_I_EVENT_SIZE + event->len;
+                if (event->mask & IN_IGNORED) {
+                    watches.erase(event->wd);
+                    continue;
+                }
+
+                // Hidden files are temporary or internal to the server, and
+                // files are only complete once they are closed
+                if (event->len == 0 || event->name[0] == '.' || !watches.count(event->wd) ||
+                    (event->mask & (IN_CREATE | IN_ISDIR)) == IN_CREATE) {
+                    continue;
+                }
+                modified = true;
+
+                // Directories appearing in the mount are watched along with their contents
+                if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    watch_tree(watches[event->wd] + event->name + "/");
+                }
+            }
+
+            if (modified) {
+                dfs_log(LL_DEBUG2) << "Mount path modified, requesting synchronization";
+                RequestSynchronization();
+            }
+        }
+        close(fd);
+    }
+
     /**
      * Request callback for asynchronous requests
      *
@@ -180,37 +675,145 @@ public:
         // is aware of. The client will then need to make the appropriate calls based on those changes.
         //
 
-        // Invoke dirent.h to list all files on mount_path
-        DIR* dir = opendir(mount_path.c_str());
-        if (!dir) {
-            std::cerr << "Directory does not exist." << std::endl;
-            return;
+        // Every queued client with the same sequence shares one listing per round
+        std::shared_ptr<const FileListResponseType> listing;
+        {
+            std::lock_guard<std::mutex> lock(journal_mutex);
+            const auto key = std::make_pair(request->sequence(), static_cast<int>(request->checksum()));
+            auto cached = round_listings.find(key);
+            if (cached != round_listings.end()) {
+                listing = cached->second;
+            } else {
+                listing = BuildListing(request->sequence(), request->checksum());
+                round_listings[key] = listing;
+            }
         }
+        response->CopyFrom(*listing);
+    }
 
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != nullptr) {
-            std::string filename = entry->d_name;
+    /**
+     * Build the listing for a client that has seen the journal up to `since`.
+     * The journal mutex must be held.
+     *
+     * @param since
+     * @param checksum - algorithm of the crc fields
+     * @return the listing
+     */
+    std::shared_ptr<const FileListResponseType> BuildListing(std::int64_t since, dfs_service::ChecksumType checksum) {
+        auto response = std::make_shared<FileListResponseType>();
+        response->set_sequence(journal_sequence);
+        response->set_checksum(checksum);
+
+        // Send a full snapshot to new clients and to clients that fell off the journal
+        const std::int64_t first_sequence = journal.empty() ? journal_sequence + 1 : journal.front().sequence;
+        if (since <= 0 || since > journal_sequence || since + 1 < first_sequence) {
+            dfs_log(LL_DEBUG2) << "Building snapshot of " << journal_files.size() << " files";
+            response->set_snapshot(true);
+            for (const auto& entry : journal_files) {
+                SetListingFile(entry.second, checksum, response->add_file());
+            }
+            return response;
+        }
 
-            // Skip . and ..
-            if (filename == "." || filename == "..") continue;
+        // Otherwise only send the latest change of every file modified since then
+        std::map<std::string, const dfs_service::FileStatus*> changes;
+        for (auto it = journal.rbegin(); it != journal.rend() && it->sequence > since; ++it) {
+            changes.emplace(it->file.filename(), &it->file);
+        }
+        dfs_log(LL_DEBUG2) << "Building " << changes.size() << " changes since " << since;
+        for (const auto& change : changes) {
+            SetListingFile(*change.second, checksum, response->add_file());
+        }
+        return response;
+    }
 
-            // Get full path
-            std::string filepath = WrapPath(filename);
+    /**
+     * Copy a journal entry into a listing. The journal holds CRC-32C checksums,
+     * clients that only know the legacy checksum get it from the metadata index.
+     *
+     * @param journal_file
+     * @param checksum
+     * @param file
+     */
+    void SetListingFile(const dfs_service::FileStatus& journal_file, dfs_service::ChecksumType checksum,
+                        dfs_service::FileStatus* file) {
+        *file = journal_file;
+        FileMetadata file_metadata;
+        if (checksum != file->checksum() && !file->deleted() && !file->directory() &&
+            metadata.Get(file->filename(), &file_metadata, checksum)) {
+            file->set_crc(file_metadata.Crc(checksum));
+            file->set_checksum(checksum);
+        }
+    }
 
-            // Get file stats
-            struct stat file_stat;
-            if (stat(filepath.c_str(), &file_stat) == 0) {
-                // Skip directories, only include files
-                if (S_ISREG(file_stat.st_mode)) {
-                    // Add to files list
-                    dfs_service::FileStatus *file = response->add_file();
-                    file->set_crc(dfs_file_checksum(filepath, &crc_table));
-                    file->set_filename(filename);
-                    file->set_mtime(file_stat.st_mtime);
-                }
+    /**
+     * Compare the current file listing against the journal and record
+     * every file that was added, modified or deleted since the last update.
+     */
+    void UpdateJournal() {
+        std::vector<FileMetadata> files;
+        std::vector<std::string> directories;
+        if (!metadata.List(&files, &directories)) {
+            dfs_log(LL_ERROR) << "Unable to list mount path for the change journal";
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(journal_mutex);
+        std::map<std::string, dfs_service::FileStatus> current_files;
+        for (const FileMetadata& file_metadata : files) {
+            dfs_service::FileStatus& file = current_files[file_metadata.filename];
+            SetFileStatus(file_metadata, dfs_service::CHECKSUM_CRC32C, &file);
+
+            auto previous = journal_files.find(file_metadata.filename);
+            if (previous == journal_files.end() ||
+                previous->second.crc() != file.crc() ||
+                previous->second.mtime() != file.mtime() ||
+                previous->second.filesize() != file.filesize()) {
+                journal.push_back({++journal_sequence, file});
+            }
+        }
+        // Directories only change by appearing or disappearing
+        for (const std::string& directory : directories) {
+            dfs_service::FileStatus& file = current_files[directory];
+            file.set_filename(directory);
+            file.set_directory(true);
+
+            auto previous = journal_files.find(directory);
+            if (previous == journal_files.end() || !previous->second.directory()) {
+                journal.push_back({++journal_sequence, file});
+            }
+        }
+        for (const auto& previous : journal_files) {
+            if (!current_files.count(previous.first)) {
+                dfs_service::FileStatus file;
+                file.set_filename(previous.first);
+                file.set_directory(previous.second.directory());
+                file.set_deleted(true);
+                journal.push_back({++journal_sequence, file});
             }
         }
-        closedir(dir);
+        journal_files.swap(current_files);
+        round_listings.clear();
+
+        while (journal.size() > DFS_JOURNAL_CAPACITY) {
+            journal.pop_front();
+        }
+    }
+
+    /**
+     * Fill a FileStatus message from a metadata entry
+     *
+     * @param file_metadata - must hold the checksum of the given type
+     * @param checksum
+     * @param file
+     */
+    static void SetFileStatus(const FileMetadata& file_metadata, dfs_service::ChecksumType checksum,
+                              dfs_service::FileStatus* file) {
+        file->set_filename(file_metadata.filename);
+        file->set_filesize(file_metadata.size);
+        file->set_mtime(file_metadata.mtime);
+        file->set_crc(file_metadata.Crc(checksum));
+        file->set_checksum(checksum);
     }
 
     /**
@@ -229,14 +832,26 @@ public:
             // may add any additional code you feel is necessary.
             //
             {
-                // Check for synchronization flag for every loop, only enter critical section when needed (synchronization_flag)
-                std::lock_guard<std::mutex> lock(synchronization_flag_mutex);
-                if (!synchronization_flag) {
-                    continue;
+                // Sleep until a modification raises the synchronization flag
+                std::unique_lock<std::mutex> lock(synchronization_flag_mutex);
+                synchronization_cv.wait(lock, [this]{ return synchronization_flag; });
+
+                // Coalesce bursts of modifications into a single broadcast: wait for a
+                // quiet period, but never longer than the maximum delay
+                const auto round_start = std::chrono::steady_clock::now();
+                while (true) {
+                    const auto deadline = std::min(last_modification + DFS_SYNC_QUIET_PERIOD,
+                                                   round_start + DFS_SYNC_MAX_DELAY);
+                    if (std::chrono::steady_clock::now() >= deadline) break;
+                    synchronization_cv.wait_until(lock, deadline);
                 }
                 synchronization_flag = false;
             }
 
+            // Record this round's changes and persist the metadata index
+            this->UpdateJournal();
+            this->metadata.Save();
+
             // Guarded section for queue
             {
                 dfs_log(LL_DEBUG2) << "Waiting for queue guard";
@@ -273,142 +888,1377 @@ public:
         std::cout << "-----------------------------------------------------------" << std::endl;
         std::cout << "Receiving request to acquire write lock for file: " << filename << std::endl;
 
-        std::lock_guard<std::mutex> lock(lock_mutex);
+        Status valid = ValidatePath(filename);
+        if (!valid.ok()) {
+            return valid;
+        }
 
-        if (file_locks.count(filename) && file_locks[filename] != client_id) {
+        if (!file_locks.Acquire(filename, client_id)) {
             // Locked by different client
             return Status(StatusCode::RESOURCE_EXHAUSTED, "Lock held by another client.");
         }
 
-        file_locks[filename] = client_id;  // Grant lock
+        response->set_lease_ms(DFS_LOCK_LEASE.count());
+        response->set_compression(compression);
+        response->set_ranged_stores(true);
         std::cout << "Successfully acquired write lock for: " << filename << std::endl;
         return Status::OK;
     }
 
-    Status StoreFile(::grpc::ServerContext* context, ::grpc::ServerReader< ::dfs_service::StoreChunk>* reader, ::dfs_service::StoreResponse* response) override{
-        std::cout << "-----------------------------------------------------------" << std::endl;
-        std::cout << "Receiving request to store file." << std::endl;
+    /**
+     * Asynchronous state machine for the FetchFile rpc.
+     *
+     * Each completed write reads the next chunk of the file, or the next
+     * delta operation, so a transfer only occupies an async thread while
+     * there is data to send.
+     */
+    class FetchFileCallData : public DFSCallDataBase {
 
-        // Read first chunk to retrieve file info
-        dfs_service::StoreChunk chunk;
-        if (!reader->Read(&chunk)) {
-            std::cerr << "Failed to read first file chunk" << std::endl;
-            return Status(StatusCode::CANCELLED, "Failed to read first file chunk");
-        }
-        const std::string filename = chunk.filename();
-        const std::string filepath = WrapPath(filename);
+    private:
 
-        // Set up RAII write lock auto releaser
-        auto lock_releaser = std::unique_ptr<std::string, std::function<void(std::string*)>>(
-            new std::string(filename),
-            [this](std::string* fname) {
-                std::lock_guard<std::mutex> lock(this->lock_mutex);
-                this->file_locks.erase(*fname);
-                delete fname;
-            }
-        );
+        DFSServiceImpl* service;
 
-        // Compare client and server file, reject unnecessary store operation
-        struct stat file_stat;
-        if (lstat(filepath.c_str(), &file_stat) == 0) {
-            // File exists
-            if (dfs_file_checksum(filepath, &crc_table) == chunk.crc()) {
-                // Files are identical in content
-                return Status(StatusCode::ALREADY_EXISTS, "Exact same file exists on server.");
-            }
-            if (file_stat.st_mtime >= chunk.mtime()) {
-                // Newer file exists on server -> Triggers a dfs synchronization
-                {
-                    std::lock_guard<std::mutex> lock(synchronization_flag_mutex);
-                    synchronization_flag = true;
-                }
-                return Status(StatusCode::ALREADY_EXISTS, "Newer file exists on server.");
-            }
-        }
+        grpc::ServerCompletionQueue* cq;
 
-        // Start to store file
-        std::cout << "Storing file at: " << filepath << std::endl;
-        std::fstream file(filepath, std::ios::out | std::ios::trunc | std::ios::binary);
-        if (!file.is_open()) {
-            std::cerr << "Failed to initiate local fd." << std::endl;
-            return Status(StatusCode::CANCELLED, "Can't open file");
-        }
+        ServerContext ctx;
+
+        dfs_service::FetchRequest request;
+
+        grpc::ServerAsyncWriter<dfs_service::FetchChunk> writer;
+
+        /** Chunk message reused for every write **/
+        dfs_service::FetchChunk chunk;
+
+        /** Source of a full transfer, checksummed as it is read, up to end for ranged fetches **/
+        int fd = -1;
+        off_t offset = 0;
+        std::int64_t end = std::numeric_limits<std::int64_t>::max();
+        DFSStreamingCrc crc;
+
+        /** Reads ahead of the transfer when the io_uring backend is enabled **/
+        std::unique_ptr<DFSUringReader> uring_reader;
+
+        /** Size of the next full transfer chunk **/
+        DFSChunkSizer sizer;
 
-        // Store data in first chunk
-        if (!file.write(chunk.data().data(), chunk.data().size())) {
-            std::cerr << "Failed to write file" << std::endl;
-            return Status(StatusCode::CANCELLED, "Can't write file");
+        /** Set if both sides support the compression **/
+        std::unique_ptr<DFSChunkCompressor> compressor;
+
+        /** Source of a delta transfer **/
+        std::unique_ptr<DFSDeltaEncoder> encoder;
+
+        size_t chunks_sent = 0;
+        bool last_chunk = false;
+
+        enum CallStatus { CREATE, PROCESS, WRITE, FINISH };
+        CallStatus status;
+
+    public:
+
+        FetchFileCallData(DFSServiceImpl* service, grpc::ServerCompletionQueue* cq) :
+            service(service), cq(cq), writer(&ctx), status(CREATE) {
+            Proceed(true);
         }
 
-        // Repeatedly receive and write chunks if necessary
-        while (reader->Read(&chunk)) {
-            if (!file.write(chunk.data().data(), chunk.data().size())) {
-                std::cerr << "Failed to write file" << std::endl;
-                return Status(StatusCode::CANCELLED, "Can't write file");
+        ~FetchFileCallData() {
+            uring_reader.reset();
+            if (fd >= 0) {
+                close(fd);
             }
         }
 
-        std::cout << "Successfully stored file at: " << filepath << std::endl;
-        {
-            // Triggers a dfs synchronization
-            std::lock_guard<std::mutex> lock(synchronization_flag_mutex);
-            synchronization_flag = true;
+        void Proceed(bool ok) override {
+            switch (status) {
+                case CREATE:
+                    status = PROCESS;
+                    service->RequestFetchFile(&ctx, &request, &writer, cq, cq, this);
+                    break;
+                case PROCESS:
+                    if (!ok) {
+                        delete this;
+                        return;
+                    }
+                    new FetchFileCallData(service, cq);
+                    Start();
+                    break;
+                case WRITE:
+                    if (!ok) {
+                        std::cerr << "Write error." << std::endl;
+                        Finish(Status(StatusCode::CANCELLED, "Write error."));
+                        return;
+                    }
+                    sizer.Sent(chunk.data().size());
+                    WriteNext();
+                    break;
+                case FINISH:
+                    delete this;
+                    break;
+            }
         }
-        return Status::OK;
-    }
 
-    Status FetchFile(::grpc::ServerContext* context, const ::dfs_service::FetchRequest* request, ::grpc::ServerWriter< ::dfs_service::FetchChunk>* writer) override {
-        std::cout << "-----------------------------------------------------------" << std::endl;
-        std::cout << "Receiving request to fetch file: " << request->filename() << std::endl;
+    private:
 
-        // Try to open file
-        const std::string filename = request->filename();
-        const std::string filepath = WrapPath(filename);
+        /**
+         * Validate the request and open the source of the transfer
+         */
+        void Start() {
+            std::cout << "-----------------------------------------------------------" << std::endl;
+            std::cout << "Receiving request to fetch file: " << request.filename() << std::endl;
 
-        struct stat file_stat;
-        if (lstat(filepath.c_str(), &file_stat) != 0) {
+            // Try to open file
+            const std::string filename = request.filename();
+            const std::string filepath = service->WrapPath(filename);
+
+            FileMetadata server_file;
+            Status validation = service->ValidateFetch(request, &server_file);
+            if (!validation.ok()) {
+                Finish(validation);
+                return;
+            }
+
+            chunk.set_mtime(server_file.mtime);
+            if (request.compression() != dfs_service::COMPRESSION_NONE && request.compression() == service->compression) {
+                compressor.reset(new DFSChunkCompressor(request.compression()));
+            }
+
+            // A ranged fetch is one of several streams of the same file
+            if (request.length() > 0) {
+                if (request.offset() < 0 || request.offset() >= server_file.size) {
+                    Finish(Status(StatusCode::OUT_OF_RANGE, "Range outside of the file."));
+                    return;
+                }
+                offset = request.offset();
+                end = std::min(request.offset() + request.length(), server_file.size);
+                dfs_log(LL_DEBUG2) << "Sending range " << offset << "-" << end << " of " << filename;
+            }
+
+            // Send only the differences if the client sent the signatures of its copy
+            if (request.length() == 0 && request.signature().block_size() > 0 && server_file.size >= DFS_DELTA_MIN_SIZE) {
+                std::cout << "Sending delta against " << request.signature().blocks_size() << " client blocks." << std::endl;
+                chunk.set_delta(true);
+                chunk.set_crc(server_file.Crc(request.checksum()));
+                chunk.set_checksum(request.checksum());
+                encoder.reset(new DFSDeltaEncoder(filepath, request.signature()));
+                if (!encoder->Good()) {
+                    std::cerr << "File read error." << std::endl;
+                    Finish(Status(StatusCode::CANCELLED, "File read error."));
+                    return;
+                }
+            } else {
+                // File data is read straight into the chunk message
+                crc = DFSStreamingCrc(request.checksum());
+                sizer = DFSChunkSizer(dfs_max_chunk_size(request.max_chunk_size(), service->max_chunk_size));
+                fd = open(filepath.c_str(), O_RDONLY);
+                if (fd < 0) {
+                    std::cerr << "File read error." << std::endl;
+                    Finish(Status(StatusCode::CANCELLED, "File read error."));
+                    return;
+                }
+                struct stat st;
+                DFSUring* ring = DFSUring::ForThread();
+                if (ring != nullptr && fstat(fd, &st) == 0) {
+                    uring_reader.reset(new DFSUringReader(ring, fd, offset, std::min<std::int64_t>(end, st.st_size)));
+                } else {
+                    posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+                }
+            }
+
+            WriteNext();
+        }
+
+        /**
+         * Send the next chunk, or finish the call once everything was sent.
+         * At least one chunk is sent so empty files and empty deltas are transferred too.
+         */
+        void WriteNext() {
+            if (last_chunk) {
+                std::cout << "Successfully fetched file." << std::endl;
+                Finish(Status::OK);
+                return;
+            }
+
+            if (encoder) {
+                DeltaOp op;
+                if (encoder->Next(&op)) {
+                    chunk.set_block_index(op.block_index);
+                    chunk.set_block_count(op.block_count);
+                    chunk.mutable_data()->swap(op.literal);
+                } else if (!encoder->Good()) {
+                    std::cerr << "File read error." << std::endl;
+                    Finish(Status(StatusCode::CANCELLED, "File read error."));
+                    return;
+                } else if (chunks_sent > 0) {
+                    std::cout << "Successfully fetched file." << std::endl;
+                    Finish(Status::OK);
+                    return;
+                } else {
+                    chunk.set_block_count(0);
+                    chunk.clear_data();
+                    last_chunk = true;
+                }
+            } else {
+                const size_t chunk_size = std::min<std::int64_t>(sizer.Size(), end - offset);
+                chunk.set_offset(offset);
+                ssize_t bytesRead = uring_reader ? uring_reader->Read(chunk.mutable_data(), chunk_size) :
+                    dfs_read_chunk(fd, offset, chunk_size, chunk.mutable_data());
+                if (bytesRead < 0) {
+                    std::cerr << "File read error." << std::endl;
+                    Finish(Status(StatusCode::CANCELLED, "File read error."));
+                    return;
+                }
+                offset += bytesRead;
+                crc.Update(chunk.data().data(), bytesRead);
+                last_chunk = bytesRead < static_cast<ssize_t>(chunk_size) || offset >= end;
+
+                // The last chunk carries the checksum of the data actually sent
+                if (last_chunk) {
+                    chunk.set_crc(crc.Value());
+                    chunk.set_checksum(request.checksum());
+                    chunk.set_crc_trailer(true);
+                }
+            }
+
+            if (compressor) {
+                std::uint32_t raw_size = 0;
+                chunk.set_compression(compressor->Compress(chunk.mutable_data(), &raw_size));
+                chunk.set_raw_size(raw_size);
+            }
+
+            // Send out current chunk
+            chunks_sent++;
+            status = WRITE;
+            writer.Write(chunk, this);
+        }
+
+        void Finish(const Status& call_status) {
+            uring_reader.reset();
+            if (fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+            status = FINISH;
+            writer.Finish(call_status, this);
+        }
+    };
+
+    /**
+     * Asynchronous state machine for the StoreFile rpc.
+     *
+     * Each completed read writes the received chunk to disk and requests the
+     * next one. Transfers are assembled in a hidden temporary file that only
+     * replaces the current copy once its checksum matches the one sent by the
+     * client. A range of a ranged store writes into the temporary file shared
+     * by all ranges of the transfer, and keeps what arrived if its stream ends
+     * early so that the client can resume it.
+     */
+    class StoreFileCallData : public DFSCallDataBase {
+
+    private:
+
+        DFSServiceImpl* service;
+
+        grpc::ServerCompletionQueue* cq;
+
+        ServerContext ctx;
+
+        grpc::ServerAsyncReader<dfs_service::StoreResponse, dfs_service::StoreChunk> reader;
+
+        /** Chunk message reused for every read **/
+        dfs_service::StoreChunk chunk;
+
+        dfs_service::StoreResponse response;
+
+        std::string filename;
+
+        /** Client holding the write lock of filename **/
+        std::string client_id;
+
+        /** Whether the write lock of filename is released once the call finishes **/
+        bool release_lock = false;
+
+        std::ofstream file;
+
+        /** Destination of a full transfer when the io_uring backend is enabled **/
+        int fd = -1;
+        std::unique_ptr<DFSUringWriter> uring_writer;
+
+        /** Checksum of the written data, verified against the client's once the stream ends **/
+        DFSStreamingCrc crc;
+        std::uint32_t expected_crc = 0;
+        dfs_service::ChecksumType checksum = dfs_service::CHECKSUM_CRC32C;
+        bool crc_trailer = false;
+
+        /** Data is written to a temporary file, which replaces the file once complete **/
+        std::string temppath;
+
+        /** Delta transfer state, taken from the first chunk **/
+        bool delta = false;
+        std::ifstream basis;
+        std::uint32_t block_size = 0;
+
+        /** Ranged store state: the range spans range_length bytes at range_offset, range_written so far **/
+        std::shared_ptr<DFSRangedStore> ranged;
+        std::int64_t range_offset = 0;
+        std::int64_t range_length = 0;
+        std::int64_t range_written = 0;
+        bool range_done = false;
+
+        enum CallStatus { CREATE, PROCESS, HEADER, DATA, FINISH };
+        CallStatus status;
+
+    public:
+
+        StoreFileCallData(DFSServiceImpl* service, grpc::ServerCompletionQueue* cq) :
+            service(service), cq(cq), reader(&ctx), status(CREATE) {
+            Proceed(true);
+        }
+
+        ~StoreFileCallData() {
+            if (release_lock) {
+                service->ReleaseWriteLock(filename, client_id);
+            }
+            if (ranged && !range_done) {
+                service->DropRangedStore(ranged);
+            }
+            uring_writer.reset();
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (!temppath.empty()) {
+                std::remove(temppath.c_str());
+            }
+        }
+
+        void Proceed(bool ok) override {
+            switch (status) {
+                case CREATE:
+                    status = PROCESS;
+                    service->RequestStoreFile(&ctx, &reader, cq, cq, this);
+                    break;
+                case PROCESS:
+                    if (!ok) {
+                        delete this;
+                        return;
+                    }
+                    new StoreFileCallData(service, cq);
+                    std::cout << "-----------------------------------------------------------" << std::endl;
+                    std::cout << "Receiving request to store file." << std::endl;
+
+                    // Read first chunk to retrieve file info
+                    status = HEADER;
+                    reader.Read(&chunk, this);
+                    break;
+                case HEADER:
+                    if (!ok) {
+                        std::cerr << "Failed to read first file chunk" << std::endl;
+                        Finish(Status(StatusCode::CANCELLED, "Failed to read first file chunk"));
+                        return;
+                    }
+                    Start();
+                    break;
+                case DATA:
+                    // A failed read marks the end of the client's stream
+                    if (!ok) {
+                        Complete();
+                        return;
+                    }
+                    if (WriteChunk()) {
+                        // Keep the write lock while the transfer makes progress
+                        service->file_locks.Extend(filename, client_id);
+                        reader.Read(&chunk, this);
+                    }
+                    break;
+                case FINISH:
+                    delete this;
+                    break;
+            }
+        }
+
+    private:
+
+        /**
+         * Validate the first chunk and open the destination of the transfer
+         */
+        void Start() {
+            filename = chunk.filename();
+            client_id = chunk.client_id();
+            const std::string filepath = service->WrapPath(filename);
+
+            // A client whose lease expired must not overwrite the file, nor release a lease another client took
+            Status validation = service->ValidateLease(filename, client_id);
+            if (!validation.ok()) {
+                Finish(validation);
+                return;
+            }
+
+            // The write lock is released once the call finishes, whatever the outcome
+            release_lock = true;
+
+            validation = service->ValidateStore(chunk);
+            if (!validation.ok()) {
+                Finish(validation);
+                return;
+            }
+
+            expected_crc = chunk.crc();
+            checksum = chunk.checksum();
+            crc_trailer = chunk.crc_trailer();
+            crc = DFSStreamingCrc(checksum);
+
+            if (chunk.ranges() > 0) {
+                StartRange();
+                return;
+            }
+
+            // Delta stores are assembled against the current copy
+            delta = chunk.delta();
+            if (delta) {
+                block_size = chunk.block_size();
+
+                std::cout << "Storing delta of file at: " << filepath << std::endl;
+                basis.open(filepath, std::ifstream::in | std::ifstream::binary);
+                if (!basis.is_open() || block_size == 0) {
+                    std::cerr << "No copy to apply the delta to." << std::endl;
+                    Finish(Status(StatusCode::DATA_LOSS, "No copy to apply the delta to."));
+                    return;
+                }
+            } else {
+                std::cout << "Storing file at: " << filepath << std::endl;
+            }
+
+            // Readers keep seeing the previous copy until the new one is complete
+            temppath = service->TempPath(filename);
+            DFSUring* ring = delta ? nullptr : DFSUring::ForThread();
+            if (ring != nullptr) {
+                fd = open(temppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd >= 0) {
+                    uring_writer.reset(new DFSUringWriter(ring, fd));
+                }
+            } else {
+                file.open(temppath, std::ios::out | std::ios::trunc | std::ios::binary);
+            }
+            if (!file.is_open() && !uring_writer) {
+                std::cerr << "Failed to initiate local fd." << std::endl;
+                Finish(Status(StatusCode::CANCELLED, "Can't open file"));
+                return;
+            }
+
+            // Store data in first chunk, then receive the remaining chunks
+            status = DATA;
+            if (WriteChunk()) {
+                reader.Read(&chunk, this);
+            }
+        }
+
+        /**
+         * Join the ranged store of the first chunk, whose ranges share a temporary file
+         */
+        void StartRange() {
+            // Range checksums can only be combined into the file's checksum with CRC-32C
+            if (checksum != dfs_service::CHECKSUM_CRC32C || !crc_trailer || chunk.ranges() > DFS_MAX_RANGES ||
+                chunk.transfer_id().empty() || chunk.offset() < 0 || chunk.length() <= 0 ||
+                chunk.offset() + chunk.length() > chunk.file_size()) {
+                std::cerr << "Invalid ranged store." << std::endl;
+                Finish(Status(StatusCode::INVALID_ARGUMENT, "Invalid ranged store."));
+                return;
+            }
+
+            ranged = service->JoinRangedStore(chunk);
+            if (!ranged) {
+                std::cerr << "Can't join the ranged store." << std::endl;
+                Finish(Status(StatusCode::FAILED_PRECONDITION, "Can't join the ranged store."));
+                return;
+            }
+            range_offset = chunk.offset();
+            range_length = chunk.length();
+            std::cout << "Storing range at " << range_offset << " of file at: " << service->WrapPath(filename) << std::endl;
+
+            status = DATA;
+            if (WriteChunk()) {
+                reader.Read(&chunk, this);
+            }
+        }
+
+        /**
+         * Write the current chunk at its offset of the ranged store, finishing the call on errors
+         *
+         * @return false if the call was finished
+         */
+        bool WriteRange() {
+            const std::int64_t position = range_offset + range_written;
+            const std::int64_t size = static_cast<std::int64_t>(chunk.data().size());
+            if (chunk.offset() != position || position + size > range_offset + range_length) {
+                std::cerr << "Chunk outside of the range" << std::endl;
+                Finish(Status(StatusCode::OUT_OF_RANGE, "Chunk outside of the range"));
+                return false;
+            }
+            if (!dfs_write_chunk(ranged->fd, position, chunk.data())) {
+                std::cerr << "Failed to write file" << std::endl;
+                Finish(Status(StatusCode::CANCELLED, "Can't write file"));
+                return false;
+            }
+            crc.Update(chunk.data().data(), chunk.data().size());
+            range_written += size;
+
+            std::lock_guard<std::mutex> lock(ranged->mutex);
+            ranged->updated = std::chrono::steady_clock::now();
+            return true;
+        }
+
+        /**
+         * Record the piece of the range that arrived, committing the file once it is complete
+         */
+        void CompleteRange() {
+            // A stream ending before its range did was interrupted, what arrived is kept for resuming
+            const bool interrupted = range_written < range_length;
+            if (!interrupted && crc.Value() != expected_crc) {
+                std::cerr << "Stored range does not match the client's checksum." << std::endl;
+                Finish(Status(StatusCode::DATA_LOSS, "Stored range does not match the checksum."));
+                return;
+            }
+
+            bool failed, last = false;
+            std::uint32_t file_crc = 0;
+            {
+                std::lock_guard<std::mutex> lock(ranged->mutex);
+                failed = ranged->failed;
+                if (!failed) {
+                    ranged->active--;
+                    if (range_written > 0) {
+                        ranged->range_crcs[range_offset] = std::make_pair(crc.Value(), range_written);
+                    }
+                    ranged->updated = std::chrono::steady_clock::now();
+                    range_done = true;
+                    last = !ranged->committing && dfs_ranges_crc(ranged->range_crcs, ranged->file_size, &file_crc);
+                    if (last) {
+                        ranged->committing = true;
+                    }
+                }
+            }
+
+            if (failed) {
+                std::cerr << "Another range of the store failed." << std::endl;
+                Finish(Status(StatusCode::ABORTED, "Another range of the store failed."));
+                return;
+            }
+            if (interrupted) {
+                // The write lock is kept for the client to resume the store
+                release_lock = false;
+                std::cout << "Kept " << range_written << " bytes of interrupted range at " << range_offset
+                          << " of " << filename << std::endl;
+                Finish(Status(StatusCode::ABORTED, "Range interrupted, kept for resuming."));
+                return;
+            }
+            if (!last) {
+                // The write lock is kept for the ranges still running
+                release_lock = false;
+                std::cout << "Successfully stored range at " << range_offset << " of " << filename << std::endl;
+                Finish(Status::OK);
+                return;
+            }
+
+            service->DropRangedStore(ranged);
+            close(ranged->fd);
+            ranged->fd = -1;
+            expected_crc = file_crc;
+            service->CommitFile(ranged->temppath, service->WrapPath(filename), [this](bool ok){
+                ranged->committed = ok;
+                Committed(ok);
+            });
+        }
+
+        /**
+         * Write the current chunk, finishing the call on errors
+         *
+         * @return false if the call was finished
+         */
+        bool WriteChunk() {
+            if (crc_trailer) {
+                expected_crc = chunk.crc();
+            }
+            if (!dfs_decompress_chunk(chunk.compression(), chunk.raw_size(), chunk.mutable_data())) {
+                std::cerr << "Failed to decompress chunk" << std::endl;
+                Finish(Status(StatusCode::DATA_LOSS, "Can't decompress chunk"));
+                return false;
+            }
+            if (ranged) {
+                return WriteRange();
+            }
+            if (delta && chunk.block_count() > 0 &&
+                !dfs_delta_copy_blocks(basis, block_size, chunk.block_index(), chunk.block_count(), file, &crc)) {
+                std::cerr << "Failed to copy blocks" << std::endl;
+                Finish(Status(StatusCode::CANCELLED, "Can't copy blocks"));
+                return false;
+            }
+            const bool written = uring_writer ? uring_writer->Write(chunk.data().data(), chunk.data().size()) :
+                static_cast<bool>(file.write(chunk.data().data(), chunk.data().size()));
+            if (!written) {
+                std::cerr << "Failed to write file" << std::endl;
+                Finish(Status(StatusCode::CANCELLED, "Can't write file"));
+                return false;
+            }
+            crc.Update(chunk.data().data(), chunk.data().size());
+            return true;
+        }
+
+        /**
+         * Commit the stored file once the client finished streaming
+         */
+        void Complete() {
+            if (ranged) {
+                CompleteRange();
+                return;
+            }
+
+            bool written;
+            if (uring_writer) {
+                written = uring_writer->Flush();
+                uring_writer.reset();
+                written = close(fd) == 0 && written;
+                fd = -1;
+            } else {
+                file.close();
+                written = static_cast<bool>(file);
+            }
+
+            // Only replace the current copy if the result matches the client's file,
+            // otherwise it changed while it was sent or the data was damaged
+            if (!written || crc.Value() != expected_crc) {
+                std::cerr << "Stored file does not match the client's checksum." << std::endl;
+                Finish(Status(StatusCode::DATA_LOSS, "Stored file does not match the checksum."));
+                return;
+            }
+
+            service->CommitFile(temppath, service->WrapPath(filename), [this](bool ok){ Committed(ok); });
+        }
+
+        /**
+         * Finish the call once the stored file was moved into place
+         *
+         * @param ok
+         */
+        void Committed(bool ok) {
+            const std::string filepath = service->WrapPath(filename);
+            if (!ok) {
+                std::cerr << "Failed to replace file" << std::endl;
+                Finish(Status(StatusCode::CANCELLED, "Can't replace file"));
+                return;
+            }
+            temppath.clear();
+
+            // The checksum was computed while writing, no need to read the file again
+            if (checksum == dfs_service::CHECKSUM_CRC32C) {
+                service->metadata.Update(filename, expected_crc);
+            } else {
+                service->metadata.Refresh(filename);
+            }
+
+            std::cout << "Successfully stored file at: " << filepath << std::endl;
+            // Triggers a dfs synchronization
+            service->RequestSynchronization();
+            Finish(Status::OK);
+        }
+
+        void Finish(const Status& call_status) {
+            // Release the write lock before the client learns the outcome
+            if (release_lock) {
+                service->ReleaseWriteLock(filename, client_id);
+                release_lock = false;
+            }
+            status = FINISH;
+            if (call_status.ok()) {
+                reader.Finish(response, call_status, this);
+            } else {
+                reader.FinishWithError(call_status, this);
+            }
+        }
+    };
+
+    /**
+     * Asynchronous state machine for the SyncBatch rpc.
+     *
+     * Requests are handled one at a time as they arrive. Fetches are answered
+     * right away, while stores are answered once their commit finishes, so the
+     * stores of a batch are committed together with DFS_FSYNC_GROUP instead of
+     * one group each. Responses name their file and may arrive out of order.
+     * Clients keep the stream busy by writing their requests from a separate thread.
+     */
+    class SyncBatchCallData : public DFSCallDataBase {
+
+    private:
+
+        DFSServiceImpl* service;
+
+        grpc::ServerCompletionQueue* cq;
+
+        ServerContext ctx;
+
+        grpc::ServerAsyncReaderWriter<dfs_service::BatchResponse, dfs_service::BatchRequest> stream;
+
+        dfs_service::BatchRequest request;
+
+        size_t files_handled = 0;
+
+        /** Guards the state shared with the commits finishing on the group committer's thread **/
+        std::mutex mutex;
+
+        /** Responses waiting to be written, the front one is being written in WRITE **/
+        std::deque<dfs_service::BatchResponse> outgoing;
+
+        /** Stores whose commit hasn't finished yet **/
+        size_t commits_pending = 0;
+
+        /** Whether any file was stored, which triggers a synchronization once the batch ends **/
+        bool stored = false;
+
+        /** Whether the client's stream ended, or a write failed and the call is wound down **/
+        bool reads_done = false;
+        bool failed = false;
+
+        /** Whether the stream is idle until a pending commit finishes **/
+        bool waiting = false;
+
+        enum CallStatus { CREATE, PROCESS, READ, WRITE, FINISH };
+        CallStatus status;
+
+    public:
+
+        SyncBatchCallData(DFSServiceImpl* service, grpc::ServerCompletionQueue* cq) :
+            service(service), cq(cq), stream(&ctx), status(CREATE) {
+            Proceed(true);
+        }
+
+        void Proceed(bool ok) override {
+            switch (status) {
+                case CREATE:
+                    status = PROCESS;
+                    service->RequestSyncBatch(&ctx, &stream, cq, cq, this);
+                    break;
+                case PROCESS:
+                    if (!ok) {
+                        delete this;
+                        return;
+                    }
+                    new SyncBatchCallData(service, cq);
+                    std::cout << "-----------------------------------------------------------" << std::endl;
+                    std::cout << "Receiving batch of file operations." << std::endl;
+                    status = READ;
+                    stream.Read(&request, this);
+                    break;
+                case READ:
+                    // A failed read marks the end of the client's stream
+                    if (!ok) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        reads_done = true;
+                    } else {
+                        Handle();
+                    }
+                    Next();
+                    break;
+                case WRITE: {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!ok) {
+                        std::cerr << "Write error." << std::endl;
+                        failed = true;
+                    } else {
+                        outgoing.pop_front();
+                    }
+                }
+                    Next();
+                    break;
+                case FINISH:
+                    delete this;
+                    break;
+            }
+        }
+
+    private:
+
+        /**
+         * Start the next operation on the stream, which is idle: write a response,
+         * read the next request, or finish once every commit is done
+         */
+        void Next() {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!failed && !outgoing.empty()) {
+                status = WRITE;
+                stream.Write(outgoing.front(), this);
+                return;
+            }
+            if (!failed && !reads_done) {
+                status = READ;
+                stream.Read(&request, this);
+                return;
+            }
+            // Commits still reference the call, the last one resumes it
+            if (commits_pending > 0) {
+                waiting = true;
+                return;
+            }
+            lock.unlock();
+
+            status = FINISH;
+            if (failed) {
+                stream.Finish(Status(StatusCode::CANCELLED, "Write error."), this);
+                return;
+            }
+            if (stored) {
+                // Triggers a dfs synchronization
+                service->RequestSynchronization();
+            }
+            std::cout << "Successfully handled batch of " << files_handled << " files." << std::endl;
+            stream.Finish(Status::OK, this);
+        }
+
+        /**
+         * Perform the current request, queueing its response once it is done
+         */
+        void Handle() {
+            files_handled++;
+            if (request.has_store()) {
+                const std::string filename = request.store().filename();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    commits_pending++;
+                }
+                service->StoreBatchFile(request.client_id(), request.store(), [this, filename](const Status& result){
+                    Stored(filename, result);
+                });
+                return;
+            }
+
+            dfs_service::BatchResponse response;
+            Status result;
+            if (request.has_fetch()) {
+                response.set_filename(request.fetch().filename());
+                result = service->FetchBatchFile(request.fetch(), response.mutable_chunk());
+            } else {
+                result = Status(StatusCode::INVALID_ARGUMENT, "Empty batch request.");
+            }
+            response.set_code(result.error_code());
+            response.set_message(result.error_message());
+            std::lock_guard<std::mutex> lock(mutex);
+            outgoing.push_back(std::move(response));
+        }
+
+        /**
+         * Queue the response of a store once its commit finished, resuming an idle stream
+         *
+         * @param filename
+         * @param result
+         */
+        void Stored(const std::string& filename, const Status& result) {
+            bool resume;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                dfs_service::BatchResponse response;
+                response.set_filename(filename);
+                response.set_code(result.error_code());
+                response.set_message(result.error_message());
+                outgoing.push_back(std::move(response));
+                stored = stored || result.ok();
+                commits_pending--;
+                resume = waiting;
+                waiting = false;
+            }
+            if (resume) {
+                Next();
+            }
+        }
+    };
+
+    /**
+     * Path of a new temporary file for a store, hidden from listings, next to
+     * the file so it can be renamed into place. Missing directories are created.
+     *
+     * @param filename
+     * @return the path
+     */
+    std::string TempPath(const std::string& filename) {
+        dfs_make_directories(mount_path, dfs_parent_path(filename));
+        return WrapPath(dfs_hidden_path(filename, DFS_STORE_TEMP_SUFFIX + std::to_string(temp_sequence++)));
+    }
+
+    /**
+     * Join the ranged store the first chunk of a range belongs to, starting it for the first range
+     *
+     * @param chunk
+     * @return nullptr if the chunk doesn't match the transfer, resumes one that is gone or the file can't be created
+     */
+    std::shared_ptr<DFSRangedStore> JoinRangedStore(const dfs_service::StoreChunk& chunk) {
+        std::lock_guard<std::mutex> lock(ranged_mutex);
+        auto found = ranged_stores.find(chunk.transfer_id());
+        if (found != ranged_stores.end()) {
+            std::shared_ptr<DFSRangedStore> store = found->second;
+            std::lock_guard<std::mutex> store_lock(store->mutex);
+            if (store->failed || store->committing || store->filename != chunk.filename() ||
+                store->file_size != chunk.file_size() || store->mtime != chunk.mtime() ||
+                store->ranges != chunk.ranges()) {
+                return nullptr;
+            }
+            store->active++;
+            store->updated = std::chrono::steady_clock::now();
+            return store;
+        }
+        if (chunk.resume()) {
+            return nullptr;
+        }
+
+        std::shared_ptr<DFSRangedStore> store = std::make_shared<DFSRangedStore>();
+        store->transfer_id = chunk.transfer_id();
+        store->filename = chunk.filename();
+        store->temppath = TempPath(chunk.filename());
+        store->file_size = chunk.file_size();
+        store->mtime = chunk.mtime();
+        store->ranges = chunk.ranges();
+        store->active = 1;
+        store->updated = std::chrono::steady_clock::now();
+        store->fd = open(store->temppath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (store->fd < 0 || ftruncate(store->fd, store->file_size) != 0) {
+            return nullptr;
+        }
+        ranged_stores[store->transfer_id] = store;
+        return store;
+    }
+
+    /**
+     * Stop tracking a ranged store, failing the ranges still running unless it is being committed
+     *
+     * @param store
+     */
+    void DropRangedStore(const std::shared_ptr<DFSRangedStore>& store) {
+        std::lock_guard<std::mutex> lock(ranged_mutex);
+        {
+            std::lock_guard<std::mutex> store_lock(store->mutex);
+            if (!store->committing) {
+                store->failed = true;
+            }
+        }
+        auto found = ranged_stores.find(store->transfer_id);
+        if (found != ranged_stores.end() && found->second == store) {
+            ranged_stores.erase(found);
+        }
+    }
+
+    /**
+     * Drop ranged stores that made no progress for DFS_TRANSFER_TTL, along with the pieces kept for resuming
+     *
+     * @return number of stores dropped
+     */
+    size_t ReapRangedStores() {
+        const auto expired = std::chrono::steady_clock::now() - DFS_TRANSFER_TTL;
+        std::lock_guard<std::mutex> lock(ranged_mutex);
+        size_t reaped = 0;
+        for (auto it = ranged_stores.begin(); it != ranged_stores.end();) {
+            std::lock_guard<std::mutex> store_lock(it->second->mutex);
+            if (it->second->updated < expired) {
+                it->second->failed = true;
+                it = ranged_stores.erase(it);
+                reaped++;
+            } else {
+                ++it;
+            }
+        }
+        return reaped;
+    }
+
+    /**
+     * Remove temporary files left behind by stores that never completed
+     */
+    void RemoveTempFiles() {
+        std::vector<std::string> directories{""};
+        dfs_list_tree(mount_path, nullptr, &directories);
+        for (const std::string& directory : directories) {
+            const std::string prefix = directory.empty() ? "" : directory + "/";
+            DIR* dir = opendir(WrapPath(prefix).c_str());
+            if (dir == nullptr) {
+                continue;
+            }
+            struct dirent* entry;
+            while ((entry = readdir(dir)) != nullptr) {
+                const std::string name = entry->d_name;
+                if (name[0] == '.' && name.find(DFS_STORE_TEMP_SUFFIX) != std::string::npos) {
+                    dfs_log(LL_DEBUG) << "Removing stale temporary file " << prefix + name;
+                    unlink(WrapPath(prefix + name).c_str());
+                }
+            }
+            closedir(dir);
+        }
+    }
+
+    /**
+     * Move a completely written temporary file into place, durably as
+     * far as the fsync policy asks for.
+     *
+     * @param temppath
+     * @param filepath
+     * @param done - called with the outcome, from the group committer's thread with DFS_FSYNC_GROUP
+     */
+    void CommitFile(const std::string& temppath, const std::string& filepath, std::function<void(bool)> done) {
+        switch (fsync_policy) {
+            case DFS_FSYNC_GROUP:
+                sync_group->Submit([temppath, filepath]{
+                    return std::rename(temppath.c_str(), filepath.c_str()) == 0;
+                }, std::move(done));
+                return;
+            case DFS_FSYNC_FILE: {
+                const FileDescriptor fd = open(temppath.c_str(), O_RDONLY);
+                bool durable = fd >= 0 && fsync(fd) == 0;
+                if (fd >= 0) close(fd);
+                durable = durable && std::rename(temppath.c_str(), filepath.c_str()) == 0;
+                const FileDescriptor dir_fd = open(filepath.substr(0, filepath.find_last_of('/') + 1).c_str(),
+                                                   O_RDONLY | O_DIRECTORY);
+                durable = durable && dir_fd >= 0 && fsync(dir_fd) == 0;
+                if (dir_fd >= 0) close(dir_fd);
+                done(durable);
+                return;
+            }
+            default:
+                done(std::rename(temppath.c_str(), filepath.c_str()) == 0);
+                return;
+        }
+    }
+
+    /**
+     * Reject names that don't refer to a path inside the mount, or refer to the server's own files
+     *
+     * @param filename
+     * @return Status
+     */
+    static Status ValidatePath(const std::string& filename) {
+        if (!dfs_valid_path(filename)) {
+            std::cerr << "Invalid path: " << filename << std::endl;
+            return Status(StatusCode::INVALID_ARGUMENT, "Invalid path.");
+        }
+        return Status::OK;
+    }
+
+    /**
+     * Check that a client holds the unexpired write lock of a file before it changes the file
+     *
+     * @param filename
+     * @param client_id
+     * @return Status
+     */
+    Status ValidateLease(const std::string& filename, const std::string& client_id) {
+        Status valid = ValidatePath(filename);
+        if (!valid.ok()) {
+            return valid;
+        }
+        if (!file_locks.Holds(filename, client_id)) {
+            std::cerr << "Write lock not held by client " << client_id << std::endl;
+            return Status(StatusCode::FAILED_PRECONDITION, "Write lock not held.");
+        }
+        return Status::OK;
+    }
+
+    /**
+     * Compare a stored file against the server copy, rejecting unnecessary stores
+     *
+     * @param chunk - the first chunk of the store
+     * @return Status
+     */
+    Status ValidateStore(const dfs_service::StoreChunk& chunk) {
+        Status valid = ValidatePath(chunk.filename());
+        if (!valid.ok()) {
+            return valid;
+        }
+        FileMetadata server_file;
+        if (metadata.Get(chunk.filename(), &server_file, chunk.checksum())) {
+            // File exists, its content can only be compared if the checksum came up front
+            if (!chunk.crc_trailer() && server_file.Crc(chunk.checksum()) == chunk.crc()) {
+                // Files are identical in content
+                return Status(StatusCode::ALREADY_EXISTS, "Exact same file exists on server.");
+            }
+            if (server_file.mtime >= chunk.mtime()) {
+                // Newer file exists on server -> Triggers a dfs synchronization
+                RequestSynchronization();
+                return Status(StatusCode::ALREADY_EXISTS, "Newer file exists on server.");
+            }
+        }
+        return Status::OK;
+    }
+
+    /**
+     * Compare a fetched file against the client copy, rejecting unnecessary fetches
+     *
+     * @param request
+     * @param server_file - set to the metadata of the server copy
+     * @return Status
+     */
+    Status ValidateFetch(const dfs_service::FetchRequest& request, FileMetadata* server_file) {
+        Status valid = ValidatePath(request.filename());
+        if (!valid.ok()) {
+            return valid;
+        }
+        if (!metadata.Get(request.filename(), server_file, request.checksum())) {
             // File does not exist
             std::cerr << "File does not exist." << std::endl;
             return Status(StatusCode::NOT_FOUND, "File does not exist.");
         }
 
         // Compare client and server file, reject unnecessary fetch operation
-        if (dfs_file_checksum(filepath, &crc_table) == request->crc()) {
+        if (server_file->Crc(request.checksum()) == request.crc()) {
             // Files are identical in content
             return Status(StatusCode::ALREADY_EXISTS, "Exact same file exists on client.");
         }
-        if (file_stat.st_mtime <= request->mtime()) {
+        if (server_file->mtime <= request.mtime()) {
             // Newer file exists on client
             return Status(StatusCode::ALREADY_EXISTS, "Newer file exists on client.");
         }
+        return Status::OK;
+    }
 
-        // Start to fetch file
-        // Initiate file buffer and chunk message
-        char buffer[CHUNK_SIZE]; // 64 KB chunks
-        dfs_service::FetchChunk chunk;
-        chunk.set_mtime(file_stat.st_mtime);
-        std::ifstream file(filepath, std::ifstream::in | std::ifstream::binary);
+    /**
+     * Store a whole file of a batch, holding its write lock until the file is committed
+     *
+     * @param client_id
+     * @param chunk
+     * @param done - called with the outcome, from the group committer's thread with DFS_FSYNC_GROUP
+     */
+    void StoreBatchFile(const std::string& client_id, const dfs_service::StoreChunk& chunk,
+                        std::function<void(const Status&)> done) {
+        const std::string filename = chunk.filename();
+        const std::string filepath = WrapPath(filename);
+        if (!file_locks.Acquire(filename, client_id)) {
+            done(Status(StatusCode::RESOURCE_EXHAUSTED, "Lock held by another client."));
+            return;
+        }
+
+        Status result = ValidateStore(chunk);
+
+        // Only store the data as sent by the client, like every other store
+        DFSStreamingCrc streaming_crc(chunk.checksum());
+        streaming_crc.Update(chunk.data().data(), chunk.data().size());
+        const std::uint32_t crc = streaming_crc.Value();
+        if (result.ok() && crc != chunk.crc()) {
+            std::cerr << "Stored file does not match the client's checksum." << std::endl;
+            result = Status(StatusCode::DATA_LOSS, "Stored file does not match the checksum.");
+        }
+        const std::string temppath = result.ok() ? TempPath(filename) : "";
+        if (result.ok()) {
+            std::ofstream file(temppath, std::ios::out | std::ios::trunc | std::ios::binary);
+            file.write(chunk.data().data(), chunk.data().size());
+            file.close();
+            if (!file) {
+                std::remove(temppath.c_str());
+                result = Status(StatusCode::CANCELLED, "Can't write file");
+            }
+        }
+        if (!result.ok()) {
+            ReleaseWriteLock(filename, client_id);
+            done(result);
+            return;
+        }
 
-        // Repeatedly read the file and copy into stream message
-        while (!file.eof()) {
-            file.read(buffer, CHUNK_SIZE);
-            size_t bytesRead = file.gcount();
-            if (bytesRead == 0) {
-                std::cerr << "File read error." << std::endl;
-                return Status(StatusCode::CANCELLED, "File read error.");
+        const dfs_service::ChecksumType checksum = chunk.checksum();
+        CommitFile(temppath, filepath, [this, filename, filepath, temppath, client_id, checksum, crc, done](bool ok){
+            Status committed;
+            if (!ok) {
+                std::cerr << "Failed to write file" << std::endl;
+                std::remove(temppath.c_str());
+                committed = Status(StatusCode::CANCELLED, "Can't write file");
+            } else {
+                // The checksum was verified, no need to read the file again
+                if (checksum == dfs_service::CHECKSUM_CRC32C) {
+                    metadata.Update(filename, crc);
+                } else {
+                    metadata.Refresh(filename);
+                }
+                std::cout << "Stored file at: " << filepath << std::endl;
             }
+            ReleaseWriteLock(filename, client_id);
+            done(committed);
+        });
+    }
 
-            // Copy read file into chunk message
-            chunk.set_data(buffer, bytesRead);
+    /**
+     * Fetch a whole file of a batch
+     *
+     * @param request
+     * @param chunk - filled with the file data and mtime
+     * @return Status, OUT_OF_RANGE if the file is too large for a batch
+     */
+    Status FetchBatchFile(const dfs_service::FetchRequest& request, dfs_service::FetchChunk* chunk) {
+        FileMetadata server_file;
+        Status result = ValidateFetch(request, &server_file);
+        if (!result.ok()) {
+            return result;
+        }
+        if (server_file.size > DFS_BATCH_MAX_FILE_SIZE) {
+            return Status(StatusCode::OUT_OF_RANGE, "File too large for a batch.");
+        }
 
-            // Send out current chunk
-            if (!writer->Write(chunk)) {
-                std::cerr << "Write error." << std::endl;
-                return Status(StatusCode::CANCELLED, "Write error.");
+        int fd = open(WrapPath(request.filename()).c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "File read error." << std::endl;
+            return Status(StatusCode::CANCELLED, "File read error.");
+        }
+        ssize_t bytesRead = dfs_read_chunk(fd, 0, DFS_BATCH_MAX_FILE_SIZE + 1, chunk->mutable_data());
+        close(fd);
+        if (bytesRead < 0) {
+            std::cerr << "File read error." << std::endl;
+            return Status(StatusCode::CANCELLED, "File read error.");
+        }
+        if (bytesRead > DFS_BATCH_MAX_FILE_SIZE) {
+            // The file grew since its metadata was read, leave it to a single file fetch
+            chunk->clear_data();
+            return Status(StatusCode::OUT_OF_RANGE, "File too large for a batch.");
+        }
+        chunk->set_mtime(server_file.mtime);
+        chunk->set_checksum(request.checksum());
+        chunk->set_crc(server_file.Crc(request.checksum()));
+        std::cout << "Fetched file: " << request.filename() << std::endl;
+        return Status::OK;
+    }
+
+    /**
+     * Spawn the call data of every asynchronous method other than
+     * CallbackList on a completion queue
+     *
+     * @param cq
+     */
+    void RequestAsyncCalls(grpc::ServerCompletionQueue* cq) {
+        new StoreFileCallData(this, cq);
+        new FetchFileCallData(this, cq);
+        new SyncBatchCallData(this, cq);
+        new UnaryCallData<dfs_service::ListFilesRequest, dfs_service::FilesList>(
+            this, &DFSServiceImpl::RequestListFiles, &DFSServiceImpl::ListFiles, cq);
+        new UnaryCallData<dfs_service::GetFileStatusRequest, dfs_service::FileStatus>(
+            this, &DFSServiceImpl::RequestGetFileStatus, &DFSServiceImpl::GetFileStatus, cq, &handler_pool);
+        new UnaryCallData<dfs_service::WriteLockRequest, dfs_service::WriteLockResponse>(
+            this, &DFSServiceImpl::RequestRequestWriteLock, &DFSServiceImpl::RequestWriteLock, cq);
+        new UnaryCallData<dfs_service::DeleteRequest, dfs_service::DeleteResponse>(
+            this, &DFSServiceImpl::RequestDeleteFile, &DFSServiceImpl::DeleteFile, cq);
+        new UnaryCallData<dfs_service::SignatureRequest, dfs_service::FileSignature>(
+            this, &DFSServiceImpl::RequestGetFileSignature, &DFSServiceImpl::GetFileSignature, cq, &handler_pool);
+        new UnaryCallData<dfs_service::FileTreeRequest, dfs_service::FileTree>(
+            this, &DFSServiceImpl::RequestGetFileTree, &DFSServiceImpl::GetFileTree, cq, &handler_pool);
+        new UnaryCallData<dfs_service::TransferRequest, dfs_service::TransferStatus>(
+            this, &DFSServiceImpl::RequestGetTransfer, &DFSServiceImpl::GetTransfer, cq, &handler_pool);
+        new UnaryCallData<dfs_service::DirectoryRequest, dfs_service::DirectoryResponse>(
+            this, &DFSServiceImpl::RequestMakeDirectory, &DFSServiceImpl::MakeDirectory, cq);
+        new UnaryCallData<dfs_service::DirectoryRequest, dfs_service::DirectoryResponse>(
+            this, &DFSServiceImpl::RequestRemoveDirectory, &DFSServiceImpl::RemoveDirectory, cq);
+    }
+
+    /**
+     * Release the write lock held on a file
+     *
+     * @param filename
+     * @param client_id - the lock is only released if this client holds it
+     */
+    void ReleaseWriteLock(const std::string& filename, const std::string& client_id) {
+        file_locks.Release(filename, client_id);
+    }
+
+    /**
+     * Periodically drop expired write lock leases in the reaper thread
+     */
+    void ReapWriteLocks() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(shutdown_mutex);
+                if (shutdown_cv.wait_for(lock, DFS_LOCK_LEASE, [this]{ return shutting_down; })) {
+                    return;
+                }
+            }
+            size_t reaped = file_locks.Reap();
+            if (reaped > 0) {
+                dfs_log(LL_DEBUG2) << "Reaped " << reaped << " expired write locks";
+            }
+            reaped = ReapRangedStores();
+            if (reaped > 0) {
+                dfs_log(LL_DEBUG2) << "Dropped " << reaped << " expired ranged stores";
+            }
+        }
+    }
+
+    Status GetFileSignature(::grpc::ServerContext* context, const ::dfs_service::SignatureRequest* request, ::dfs_service::FileSignature* response) override {
+        std::cout << "-----------------------------------------------------------" << std::endl;
+        std::cout << "Receiving request to get signature of file: " << request->filename() << std::endl;
+
+        Status valid = ValidatePath(request->filename());
+        if (!valid.ok()) {
+            return valid;
+        }
+        if (request->block_size() < 512 || request->block_size() > (1 << 20)) {
+            std::cerr << "Invalid block size." << std::endl;
+            return Status(StatusCode::INVALID_ARGUMENT, "Invalid block size.");
+        }
+
+        const std::string filepath = WrapPath(request->filename());
+        if (!dfs_file_signature(filepath, request->block_size(), request->checksum(), response)) {
+            std::cerr << "File does not exist." << std::endl;
+            return Status(StatusCode::NOT_FOUND, "File does not exist.");
+        }
+
+        std::cout << "Successfully computed signature of " << response->blocks_size() << " blocks." << std::endl;
+        return Status::OK;
+    }
+
+    Status GetFileTree(::grpc::ServerContext* context, const ::dfs_service::FileTreeRequest* request, ::dfs_service::FileTree* response) override {
+        dfs_log(LL_DEBUG2) << "Receiving request for level " << request->level() << " of the tree of " << request->filename();
+
+        Status valid = ValidatePath(request->filename());
+        if (!valid.ok()) {
+            return valid;
+        }
+
+        DFSMerkleTree tree;
+        if (!metadata.GetTree(request->filename(), &tree)) {
+            std::cerr << "File does not exist." << std::endl;
+            return Status(StatusCode::NOT_FOUND, "File does not exist.");
+        }
+        response->set_file_size(tree.FileSize());
+        response->set_block_size(DFS_TREE_BLOCK_SIZE);
+        response->set_fanout(DFS_TREE_FANOUT);
+        response->set_depth(tree.Depth());
+
+        if (request->nodes_size() == 0) {
+            response->add_hashes(tree.Level(tree.Depth() - 1)[0]);
+            response->set_crc(tree.Crc());
+            return Status::OK;
+        }
+        if (request->level() >= tree.Depth() || static_cast<size_t>(request->nodes_size()) > DFS_TREE_MAX_NODES) {
+            return Status(StatusCode::INVALID_ARGUMENT, "Invalid tree level or too many nodes.");
+        }
+        const std::vector<std::uint32_t>& level = tree.Level(request->level());
+        for (std::int64_t node : request->nodes()) {
+            if (node < 0 || node >= static_cast<std::int64_t>(level.size())) {
+                return Status(StatusCode::OUT_OF_RANGE, "Tree node out of range.");
             }
+            response->add_hashes(level[node]);
         }
+        return Status::OK;
+    }
+
+    Status GetTransfer(::grpc::ServerContext* context, const ::dfs_service::TransferRequest* request, ::dfs_service::TransferStatus* response) override {
+        dfs_log(LL_DEBUG2) << "Receiving request for the progress of transfer " << request->transfer_id();
 
-        std::cout << "Successfully fetched file." << std::endl;
+        std::shared_ptr<DFSRangedStore> store;
+        {
+            std::lock_guard<std::mutex> lock(ranged_mutex);
+            auto found = ranged_stores.find(request->transfer_id());
+            if (found != ranged_stores.end()) {
+                store = found->second;
+            }
+        }
+        if (!store) {
+            return Status(StatusCode::NOT_FOUND, "Transfer does not exist.");
+        }
+
+        std::lock_guard<std::mutex> store_lock(store->mutex);
+        if (store->failed || store->committing) {
+            return Status(StatusCode::NOT_FOUND, "Transfer does not exist.");
+        }
+        for (const auto& piece : store->range_crcs) {
+            dfs_service::TransferPiece* transfer_piece = response->add_pieces();
+            transfer_piece->set_offset(piece.first);
+            transfer_piece->set_length(piece.second.second);
+            transfer_piece->set_crc(piece.second.first);
+        }
+        response->set_active_ranges(store->active);
         return Status::OK;
     }
 
@@ -416,19 +2266,22 @@ public:
         std::cout << "-----------------------------------------------------------" << std::endl;
         std::cout << "Receiving request to get status of file: " << request->filename() << std::endl;
 
+        Status valid = ValidatePath(request->filename());
+        if (!valid.ok()) {
+            return valid;
+        }
+
         // Check if file exists
         const std::string filename = request->filename();
         const std::string filepath = WrapPath(filename);
-        struct stat f_stat;
-        if (stat(filepath.c_str(), &f_stat) != 0) {
+        FileMetadata file_metadata;
+        if (!metadata.Get(filename, &file_metadata, request->checksum())) {
             std::cerr << "File does not exist." << std::endl;
             return Status(StatusCode::NOT_FOUND, "File does not exist.");
         }
 
         // Acquire stats
-        response->set_filename(filename);
-        response->set_filesize(f_stat.st_size);
-        response->set_mtime(f_stat.st_mtime);
+        SetFileStatus(file_metadata, request->checksum(), response);
 
         // Return OK response
         std::cout << "Successfully retrieved file status." << std::endl;
@@ -439,36 +2292,21 @@ public:
         std::cout << "-----------------------------------------------------------" << std::endl;
         std::cout << "Receiving request to list all files on server." << std::endl;
 
-        // Invoke dirent.h to list all files on mount_path
-        DIR* dir = opendir(mount_path.c_str());
-        if (!dir) {
+        // List all files on mount_path from the metadata index
+        std::vector<FileMetadata> files;
+        if (!metadata.List(&files)) {
             std::cerr << "Directory does not exist." << std::endl;
             return Status(StatusCode::CANCELLED, "Directory does not exist.");
         }
-
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != nullptr) {
-            std::string filename = entry->d_name;
-
-            // Skip . and ..
-            if (filename == "." || filename == "..") continue;
-
-            // Get full path
-            std::string filepath = WrapPath(filename);
-
-            // Get file stats
-            struct stat file_stat;
-            if (stat(filepath.c_str(), &file_stat) == 0) {
-                // Skip directories, only include files
-                if (S_ISREG(file_stat.st_mode)) {
-                    // Add to files list
-                    dfs_service::FileStatus *file = files_list->add_file();
-                    file->set_filename(filename);
-                    file->set_mtime(file_stat.st_mtime);
-                }
+        files_list->set_checksum(request->checksum());
+        for (FileMetadata& file_metadata : files) {
+            // The legacy checksum is only computed on demand
+            if (request->checksum() != dfs_service::CHECKSUM_CRC32C &&
+                !metadata.Get(file_metadata.filename, &file_metadata, request->checksum())) {
+                continue;
             }
+            SetFileStatus(file_metadata, request->checksum(), files_list->add_file());
         }
-        closedir(dir);
 
         std::cout << "Successfully retrieved list files." << std::endl;
         return Status::OK;
@@ -478,22 +2316,29 @@ public:
         std::cout << "-----------------------------------------------------------" << std::endl;
         std::cout << "Receiving request to delete file: " << request->filename() << std::endl;
 
+        // A client whose lease expired must not delete the file, nor release a lease another client took
+        Status valid = ValidateLease(request->filename(), request->client_id());
+        if (!valid.ok()) {
+            return valid;
+        }
+
         // Check if file exists
         const std::string filename = request->filename();
         const std::string filepath = WrapPath(filename);
 
         // Set up RAII write lock auto releaser
+        const std::string client_id = request->client_id();
         auto lock_releaser = std::unique_ptr<std::string, std::function<void(std::string*)>>(
             new std::string(filename),
-            [this](std::string* fname) {
-                std::lock_guard<std::mutex> lock(this->lock_mutex);
-                this->file_locks.erase(*fname);
+            [this, client_id](std::string* fname) {
+                this->ReleaseWriteLock(*fname, client_id);
                 delete fname;
             }
         );
 
+        // Directories are removed by RemoveDirectory
         struct stat buffer;
-        if (stat(filepath.c_str(), &buffer) != 0) {
+        if (stat(filepath.c_str(), &buffer) != 0 || S_ISDIR(buffer.st_mode)) {
             std::cerr << "File does not exist." << std::endl;
             return Status(StatusCode::NOT_FOUND, "File does not exist.");
         }
@@ -504,14 +2349,75 @@ public:
             std::cerr << "Deletion failed." << std::endl;
             return Status(StatusCode::CANCELLED, "Deletion failed.");
         }
+        metadata.Erase(filename);
 
         // Return OK response
         std::cout << "Successfully deleted file." << std::endl;
-        {
-            // Triggers a dfs synchronization
-            std::lock_guard<std::mutex> lock(synchronization_flag_mutex);
-            synchronization_flag = true;
+        // Triggers a dfs synchronization
+        RequestSynchronization();
+        return Status::OK;
+    }
+
+    Status MakeDirectory(::grpc::ServerContext* context, const ::dfs_service::DirectoryRequest* request, ::dfs_service::DirectoryResponse* response) override {
+        std::cout << "-----------------------------------------------------------" << std::endl;
+        std::cout << "Receiving request to make directory: " << request->path() << std::endl;
+
+        Status valid = ValidatePath(request->path());
+        if (!valid.ok()) {
+            return valid;
+        }
+
+        struct stat buffer;
+        if (stat(WrapPath(request->path()).c_str(), &buffer) == 0) {
+            if (!S_ISDIR(buffer.st_mode)) {
+                return Status(StatusCode::ALREADY_EXISTS, "A file exists at the path.");
+            }
+            return Status::OK;
+        }
+        if (!dfs_make_directories(mount_path, request->path())) {
+            std::cerr << "Failed to make directory." << std::endl;
+            return Status(StatusCode::CANCELLED, "Failed to make directory.");
+        }
+
+        std::cout << "Successfully made directory." << std::endl;
+        RequestSynchronization();
+        return Status::OK;
+    }
+
+    Status RemoveDirectory(::grpc::ServerContext* context, const ::dfs_service::DirectoryRequest* request, ::dfs_service::DirectoryResponse* response) override {
+        std::cout << "-----------------------------------------------------------" << std::endl;
+        std::cout << "Receiving request to remove directory: " << request->path() << std::endl;
+
+        Status valid = ValidatePath(request->path());
+        if (!valid.ok()) {
+            return valid;
+        }
+
+        const std::string dirpath = WrapPath(request->path());
+        struct stat buffer;
+        if (stat(dirpath.c_str(), &buffer) != 0 || !S_ISDIR(buffer.st_mode)) {
+            return Status(StatusCode::NOT_FOUND, "Directory does not exist.");
+        }
+
+        // Subdirectories are listed before their children, so removing them in
+        // reverse order empties each one first. Files, including those of stores
+        // still running, make the removal fail.
+        std::vector<std::string> directories;
+        dfs_list_tree(dirpath + "/", nullptr, &directories);
+        for (auto it = directories.rbegin(); it != directories.rend(); ++it) {
+            rmdir((dirpath + "/" + *it).c_str());
+        }
+        if (rmdir(dirpath.c_str()) != 0) {
+            const bool not_empty = errno == ENOTEMPTY || errno == EEXIST;
+            std::cerr << "Failed to remove directory." << std::endl;
+            // Empty subdirectories may have been removed
+            RequestSynchronization();
+            return not_empty ? Status(StatusCode::FAILED_PRECONDITION, "Directory is not empty.")
+                             : Status(StatusCode::CANCELLED, "Failed to remove directory.");
         }
+
+        std::cout << "Successfully removed directory." << std::endl;
+        RequestSynchronization();
         return Status::OK;
     }
 };
@@ -545,11 +2451,55 @@ DFSServerNode::~DFSServerNode() noexcept {
     dfs_log(LL_SYSINFO) << "DFSServerNode shutting down";
 }
 
+/**
+ * Set the number of call data instances posted per method on each completion queue
+ *
+ * @param num_preposted_calls
+ */
+void DFSServerNode::SetNumPrepostedCalls(int num_preposted_calls) {
+    this->num_preposted_calls = num_preposted_calls;
+}
+
+void DFSServerNode::SetFsyncPolicy(DFSFsyncPolicy fsync_policy) {
+    this->fsync_policy = fsync_policy;
+}
+
+/**
+ * Set the largest chunk sent to clients
+ *
+ * @param max_chunk_size
+ */
+void DFSServerNode::SetMaxChunkSize(size_t max_chunk_size) {
+    this->max_chunk_size = max_chunk_size;
+}
+
+/**
+ * Set the compression offered for transfer chunks
+ *
+ * @param compression
+ */
+void DFSServerNode::SetCompression(dfs_service::CompressionType compression) {
+    this->compression = compression;
+}
+
+/**
+ * Select the disk I/O backend of file transfers
+ *
+ * @param io_backend
+ * @param io_depth - chunks kept in flight per transfer with DFS_IO_URING
+ */
+void DFSServerNode::SetIoBackend(DFSIoBackend io_backend, int io_depth) {
+    this->io_backend = io_backend;
+    this->io_depth = io_depth;
+}
+
 /**
  * Start the DFSServerNode server
  */
 void DFSServerNode::Start() {
-    DFSServiceImpl service(this->mount_path, this->server_address, this->num_async_threads);
+    DFSServiceImpl service(this->mount_path, this->server_address, this->num_async_threads,
+                           this->num_preposted_calls, this->fsync_policy, this->io_backend, this->io_depth,
+                           this->max_chunk_size, this->compression);
 
 
     dfs_log(LL_SYSINFO) << "DFSServerNode server listening on " << this->server_address;
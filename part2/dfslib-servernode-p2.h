@@ -6,6 +6,26 @@
 #include <thread>
 #include <grpcpp/grpcpp.h>
 
+#include "dfslib-shared-p2.h"
+
+/** Durability of stored files **/
+enum DFSFsyncPolicy {
+    /** Leave flushing to the operating system **/
+    DFS_FSYNC_NONE,
+    /** Sync every stored file and the mount directory before answering **/
+    DFS_FSYNC_FILE,
+    /** Sync concurrent stores together, with one sync per group **/
+    DFS_FSYNC_GROUP
+};
+
+/** Disk I/O of file transfers **/
+enum DFSIoBackend {
+    /** Blocking reads and writes **/
+    DFS_IO_SYNC,
+    /** Queued reads and writes through io_uring, falling back to DFS_IO_SYNC if unsupported **/
+    DFS_IO_URING
+};
+
 /**
  * DFSService is used to start up and run your DFSServiceImpl
  * based on the protobuf service you created in `proto-service.proto`.
@@ -25,6 +45,22 @@ private:
     /** Number of asynchronous threads to use **/
     int num_async_threads;
 
+    /** Number of call data instances posted per method on each completion queue **/
+    int num_preposted_calls = 1;
+
+    /** Durability of stored files **/
+    DFSFsyncPolicy fsync_policy = DFS_FSYNC_NONE;
+
+    /** Disk I/O of file transfers **/
+    DFSIoBackend io_backend = DFS_IO_SYNC;
+    int io_depth = 4;
+
+    /** Largest chunk sent to clients **/
+    size_t max_chunk_size = DFS_MAX_CHUNK_SIZE;
+
+    /** Compression offered for transfer chunks **/
+    dfs_service::CompressionType compression = dfs_service::COMPRESSION_DEFLATE;
+
     /** Server callback **/
     std::function<void()> grader_callback;
 
@@ -34,6 +70,11 @@ public:
         int num_async_threads,
         std::function<void()> callback);
     ~DFSServerNode();
+    void SetNumPrepostedCalls(int num_preposted_calls);
+    void SetFsyncPolicy(DFSFsyncPolicy fsync_policy);
+    void SetIoBackend(DFSIoBackend io_backend, int io_depth);
+    void SetMaxChunkSize(size_t max_chunk_size);
+    void SetCompression(dfs_service::CompressionType compression);
     void Shutdown();
     void Start();
 };
@@ -2,7 +2,27 @@
 #include <iostream>
 #include <fstream>
 #include <cstddef>
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <unordered_map>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #include "dfslib-shared-p2.h"
 #include "proto-src/dfs-service.grpc.pb.h"
@@ -23,3 +43,1317 @@ dfs_log_level_e DFS_LOG_LEVEL = LL_ERROR;
 // Just be aware they are always submitted, so they should
 // be compilable.
 //
+
+/**
+ * Fill the stat tuple of a metadata entry
+ *
+ * @param filename
+ * @param file_stat
+ * @param metadata
+ */
+static void dfs_fill_metadata(const std::string& filename, const struct stat& file_stat, FileMetadata* metadata) {
+    metadata->filename = filename;
+    metadata->size = file_stat.st_size;
+    metadata->mtime = file_stat.st_mtime;
+    metadata->mtime_ns = static_cast<std::int64_t>(file_stat.st_mtim.tv_sec) * 1000000000 + file_stat.st_mtim.tv_nsec;
+    metadata->ctime_ns = static_cast<std::int64_t>(file_stat.st_ctim.tv_sec) * 1000000000 + file_stat.st_ctim.tv_nsec;
+    metadata->inode = file_stat.st_ino;
+}
+
+/**
+ * Check whether a cached entry still describes the file on disk
+ *
+ * @param cached
+ * @param current
+ * @return bool
+ */
+static bool dfs_metadata_matches(const FileMetadata& cached, const FileMetadata& current) {
+    return cached.size == current.size &&
+           cached.mtime_ns == current.mtime_ns &&
+           cached.ctime_ns == current.ctime_ns &&
+           cached.inode == current.inode;
+}
+
+/**
+ * Slicing-by-8 lookup tables for a reflected CRC polynomial
+ */
+struct DFSCrcTables {
+    std::uint32_t polynomial;
+    std::uint32_t table[8][256];
+    /** x^(2^n) modulo the polynomial, used to combine checksums **/
+    std::uint32_t x2n[32];
+
+    explicit DFSCrcTables(std::uint32_t polynomial) : polynomial(polynomial) {
+        for (std::uint32_t i = 0; i < 256; i++) {
+            std::uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
+            }
+            table[0][i] = crc;
+        }
+        for (std::uint32_t i = 0; i < 256; i++) {
+            for (int slice = 1; slice < 8; slice++) {
+                table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xff];
+            }
+        }
+        x2n[0] = 1u << 30;
+        for (int n = 1; n < 32; n++) {
+            x2n[n] = MultModP(x2n[n - 1], x2n[n - 1]);
+        }
+    }
+
+    /**
+     * Multiply two polynomials modulo the CRC polynomial (reflected bit order)
+     */
+    std::uint32_t MultModP(std::uint32_t a, std::uint32_t b) const {
+        std::uint32_t product = 0;
+        for (std::uint32_t m = 1u << 31; m != 0; m >>= 1) {
+            if (a & m) {
+                product ^= b;
+                if ((a & (m - 1)) == 0) break;
+            }
+            b = (b & 1) ? (b >> 1) ^ polynomial : b >> 1;
+        }
+        return product;
+    }
+
+    /**
+     * Checksum of A followed by B, given the checksums of A and B and the length of B
+     */
+    std::uint32_t Combine(std::uint32_t crc1, std::uint32_t crc2, std::uint64_t size2) const {
+        // x^(8 * size2) modulo the polynomial, by squaring
+        std::uint32_t shift = 1u << 31;
+        for (int n = 3; size2 != 0; size2 >>= 1, n++) {
+            if (size2 & 1) {
+                shift = MultModP(x2n[n & 31], shift);
+            }
+        }
+        return MultModP(shift, crc1) ^ crc2;
+    }
+
+    /**
+     * Update a (pre-inverted) crc register with a buffer, 8 bytes at a time
+     */
+    std::uint32_t Update(std::uint32_t crc, const std::uint8_t* data, size_t size) const {
+        while (size > 0 && (reinterpret_cast<std::uintptr_t>(data) & 7) != 0) {
+            crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xff];
+            size--;
+        }
+        while (size >= 8) {
+            std::uint32_t low;
+            std::uint32_t high;
+            std::memcpy(&low, data, 4);
+            std::memcpy(&high, data + 4, 4);
+            low ^= crc;
+            crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+                  table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+                  table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+                  table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+            data += 8;
+            size -= 8;
+        }
+        while (size > 0) {
+            crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xff];
+            size--;
+        }
+        return crc;
+    }
+};
+
+static const DFSCrcTables& dfs_crc32_tables() {
+    static const DFSCrcTables tables(0xedb88320);
+    return tables;
+}
+
+static const DFSCrcTables& dfs_crc32c_tables() {
+    static const DFSCrcTables tables(0x82f63b78);
+    return tables;
+}
+
+static std::uint32_t dfs_crc32c_portable(std::uint32_t crc, const std::uint8_t* data, size_t size) {
+    return dfs_crc32c_tables().Update(crc, data, size);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static std::uint32_t dfs_crc32c_sse42(std::uint32_t crc, const std::uint8_t* data, size_t size) {
+    while (size > 0 && (reinterpret_cast<std::uintptr_t>(data) & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+        size--;
+    }
+    std::uint64_t crc64 = crc;
+    while (size >= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<std::uint32_t>(crc64);
+    while (size > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+        size--;
+    }
+    return crc;
+}
+#endif
+
+/**
+ * Pick the CRC-32C implementation for the CPU we run on
+ */
+static std::uint32_t (*dfs_crc32c_select())(std::uint32_t, const std::uint8_t*, size_t) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        dfs_log(LL_DEBUG) << "Using SSE4.2 CRC-32C";
+        return dfs_crc32c_sse42;
+    }
+#endif
+    dfs_log(LL_DEBUG) << "Using portable CRC-32C";
+    return dfs_crc32c_portable;
+}
+
+std::uint32_t dfs_crc(dfs_service::ChecksumType type, const void* data, size_t size, std::uint32_t crc) {
+    static std::uint32_t (*const crc32c_update)(std::uint32_t, const std::uint8_t*, size_t) = dfs_crc32c_select();
+    const std::uint8_t* bytes = static_cast<const std::uint8_t*>(data);
+    if (type == dfs_service::CHECKSUM_CRC32) {
+        return ~dfs_crc32_tables().Update(~crc, bytes, size);
+    }
+    return ~crc32c_update(~crc, bytes, size);
+}
+
+std::uint32_t dfs_crc_combine(dfs_service::ChecksumType type, std::uint32_t crc1, std::uint32_t crc2,
+                              std::int64_t size2) {
+    const DFSCrcTables& tables = type == dfs_service::CHECKSUM_CRC32 ? dfs_crc32_tables() : dfs_crc32c_tables();
+    return tables.Combine(crc1, crc2, static_cast<std::uint64_t>(size2));
+}
+
+/**
+ * Allocate a read buffer of DFS_CHECKSUM_BLOCK_SIZE bytes, aligned for direct disk reads
+ */
+static std::unique_ptr<char, decltype(&free)> dfs_checksum_buffer() {
+    void* memory = nullptr;
+    if (posix_memalign(&memory, 4096, DFS_CHECKSUM_BLOCK_SIZE) != 0) {
+        memory = nullptr;
+    }
+    return std::unique_ptr<char, decltype(&free)>(static_cast<char*>(memory), &free);
+}
+
+/**
+ * Checksum a range of an open file
+ *
+ * @param fd
+ * @param type
+ * @param offset
+ * @param size
+ * @param buffer - DFS_CHECKSUM_BLOCK_SIZE bytes
+ * @param crc
+ * @return false if the range can't be read completely
+ */
+static bool dfs_range_crc(int fd, dfs_service::ChecksumType type, std::int64_t offset, std::int64_t size,
+                          char* buffer, std::uint32_t* crc) {
+    *crc = 0;
+    while (size > 0) {
+        ssize_t count = pread(fd, buffer, std::min<std::int64_t>(size, DFS_CHECKSUM_BLOCK_SIZE), offset);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        *crc = dfs_crc(type, buffer, count, *crc);
+        offset += count;
+        size -= count;
+    }
+    return true;
+}
+
+/**
+ * Process-wide pool of threads helping to checksum segments of large files.
+ *
+ * The pool is started on first use with one thread less than the number of
+ * cores, since the thread asking for a checksum works on it as well. All
+ * callers share it, so concurrent checksums never add up to more threads.
+ */
+class DFSChecksumPool {
+
+private:
+
+    std::mutex mutex;
+    std::condition_variable jobs_cv;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    void Run() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                jobs_cv.wait(lock, [this]{ return stopping || !jobs.empty(); });
+                if (stopping) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    DFSChecksumPool() {
+        const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 1; i < cores; i++) {
+            workers.emplace_back(&DFSChecksumPool::Run, this);
+        }
+    }
+
+public:
+
+    ~DFSChecksumPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        jobs_cv.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    static DFSChecksumPool& Instance() {
+        static DFSChecksumPool pool;
+        return pool;
+    }
+
+    /** Number of pool threads **/
+    size_t Size() const {
+        return workers.size();
+    }
+
+    /**
+     * Queue a job for the next idle pool thread
+     *
+     * @param job
+     */
+    void Submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        jobs_cv.notify_one();
+    }
+};
+
+/**
+ * Checksum an open file in segments, helped by the checksum pool
+ *
+ * @param fd
+ * @param file_size
+ * @param type
+ * @param segment_size
+ * @param segments
+ * @return false if the file can't be read completely
+ */
+static bool dfs_segment_crcs(int fd, std::int64_t file_size, dfs_service::ChecksumType type,
+                             std::int64_t segment_size, std::vector<std::uint32_t>* segments) {
+    const size_t count = static_cast<size_t>((file_size + segment_size - 1) / segment_size);
+    segments->resize(count);
+
+    // Workers take the next unclaimed segment until none are left
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    auto work = [&]() {
+        auto buffer = dfs_checksum_buffer();
+        if (!buffer) {
+            failed = true;
+            return;
+        }
+        for (size_t index = next++; index < count && !failed; index = next++) {
+            const std::int64_t offset = static_cast<std::int64_t>(index) * segment_size;
+            const std::int64_t size = std::min(segment_size, file_size - offset);
+            if (!dfs_range_crc(fd, type, offset, size, buffer.get(), &(*segments)[index])) {
+                failed = true;
+            }
+        }
+    };
+
+    DFSChecksumPool& pool = DFSChecksumPool::Instance();
+    const size_t num_helpers = std::min<size_t>(count - 1, pool.Size());
+    if (count <= 1 || num_helpers == 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        work();
+    } else {
+        // Helpers that only get a pool thread once every segment is claimed skip the
+        // checksum, the caller just waits for those that started working on it
+        struct Helpers {
+            std::mutex mutex;
+            std::condition_variable done_cv;
+            bool closed = false;
+            size_t active = 0;
+        };
+        auto helpers = std::make_shared<Helpers>();
+        for (size_t i = 0; i < num_helpers; i++) {
+            pool.Submit([helpers, &work]() {
+                {
+                    std::lock_guard<std::mutex> lock(helpers->mutex);
+                    if (helpers->closed) {
+                        return;
+                    }
+                    helpers->active++;
+                }
+                work();
+                std::lock_guard<std::mutex> lock(helpers->mutex);
+                helpers->active--;
+                helpers->done_cv.notify_all();
+            });
+        }
+        work();
+
+        std::unique_lock<std::mutex> lock(helpers->mutex);
+        helpers->closed = true;
+        helpers->done_cv.wait(lock, [&helpers]{ return helpers->active == 0; });
+    }
+
+    if (failed) {
+        segments->clear();
+        return false;
+    }
+    return true;
+}
+
+bool dfs_file_segment_crcs(const std::string& filepath, dfs_service::ChecksumType type,
+                           std::int64_t segment_size, std::vector<std::uint32_t>* segments) {
+    segments->clear();
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    bool success = fstat(fd, &file_stat) == 0 &&
+                   dfs_segment_crcs(fd, file_stat.st_size, type, segment_size, segments);
+    close(fd);
+    return success;
+}
+
+/**
+ * The legacy checksum covers a file in chunks of buffer_size bytes, where the
+ * last, partial chunk is padded with the tail of the chunk before it
+ *
+ * @param file_size
+ * @param offset - of the padding
+ * @return length of the padding
+ */
+static std::int64_t dfs_legacy_padding(std::int64_t file_size, std::int64_t* offset) {
+    std::int64_t buffer_size = DFS_BUFFERSIZE;
+    if (file_size < DFS_BUFFERSIZE) {
+        buffer_size = std::max<std::int64_t>(file_size / 2, 1);
+    }
+    const std::int64_t remainder = file_size % buffer_size;
+    if (remainder == 0) {
+        return 0;
+    }
+    *offset = file_size - buffer_size;
+    return buffer_size - remainder;
+}
+
+std::uint32_t dfs_file_crc(const std::string& filepath, dfs_service::ChecksumType type) {
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat file_stat;
+    std::vector<std::uint32_t> segments;
+    if (fstat(fd, &file_stat) != 0 ||
+        !dfs_segment_crcs(fd, file_stat.st_size, type, DFS_CHECKSUM_SEGMENT_SIZE, &segments)) {
+        close(fd);
+        return 0;
+    }
+    const std::int64_t file_size = file_stat.st_size;
+
+    std::uint32_t crc = 0;
+    for (size_t index = 0; index < segments.size(); index++) {
+        const std::int64_t offset = static_cast<std::int64_t>(index) * DFS_CHECKSUM_SEGMENT_SIZE;
+        crc = dfs_crc_combine(type, crc, segments[index], std::min(DFS_CHECKSUM_SEGMENT_SIZE, file_size - offset));
+    }
+
+    std::int64_t padding_offset = 0;
+    const std::int64_t padding = dfs_legacy_padding(file_size, &padding_offset);
+    if (type == dfs_service::CHECKSUM_CRC32 && padding > 0) {
+        char tail[DFS_BUFFERSIZE];
+        if (pread(fd, tail, padding, padding_offset) == padding) {
+            crc = dfs_crc(type, tail, padding, crc);
+        }
+    }
+    close(fd);
+    return crc;
+}
+
+void DFSStreamingCrc::Update(const void* data, size_t data_size) {
+    crc = dfs_crc(type, data, data_size, crc);
+    size += data_size;
+
+    // The padding lies within the last two legacy chunks
+    if (type == dfs_service::CHECKSUM_CRC32) {
+        const size_t keep = 2 * DFS_BUFFERSIZE;
+        const char* bytes = static_cast<const char*>(data);
+        if (data_size >= keep) {
+            tail.assign(bytes + data_size - keep, keep);
+        } else {
+            tail.append(bytes, data_size);
+            if (tail.size() > keep) {
+                tail.erase(0, tail.size() - keep);
+            }
+        }
+    }
+}
+
+std::uint32_t DFSStreamingCrc::Value() const {
+    std::int64_t padding_offset = 0;
+    const std::int64_t padding = dfs_legacy_padding(size, &padding_offset);
+    if (type != dfs_service::CHECKSUM_CRC32 || padding == 0) {
+        return crc;
+    }
+    const std::int64_t tail_offset = size - static_cast<std::int64_t>(tail.size());
+    return dfs_crc(type, tail.data() + (padding_offset - tail_offset), padding, crc);
+}
+
+bool DFSMerkleTree::Build(const std::string& filepath) {
+    struct stat file_stat;
+    levels.assign(1, std::vector<std::uint32_t>());
+    if (stat(filepath.c_str(), &file_stat) != 0 ||
+        !dfs_file_segment_crcs(filepath, dfs_service::CHECKSUM_CRC32C, DFS_TREE_BLOCK_SIZE, &levels[0])) {
+        return false;
+    }
+
+    // The file changed size while it was read
+    file_size = file_stat.st_size;
+    if (static_cast<std::int64_t>(levels[0].size()) != (file_size + DFS_TREE_BLOCK_SIZE - 1) / DFS_TREE_BLOCK_SIZE) {
+        return false;
+    }
+    BuildLevels();
+    return true;
+}
+
+void DFSMerkleTree::BuildLevels() {
+    levels.resize(1);
+    if (levels[0].empty()) {
+        levels[0].push_back(0);
+    }
+    while (levels.back().size() > 1) {
+        const std::vector<std::uint32_t>& children = levels.back();
+        std::vector<std::uint32_t> parents;
+        for (size_t first = 0; first < children.size(); first += DFS_TREE_FANOUT) {
+            const size_t count = std::min<size_t>(DFS_TREE_FANOUT, children.size() - first);
+            parents.push_back(dfs_crc(dfs_service::CHECKSUM_CRC32C, &children[first],
+                                      count * sizeof(std::uint32_t)));
+        }
+        levels.push_back(std::move(parents));
+    }
+}
+
+std::uint32_t DFSMerkleTree::Crc() const {
+    std::uint32_t crc = 0;
+    const std::vector<std::uint32_t>& leaves = levels[0];
+    for (size_t index = 0; index < leaves.size() && file_size > 0; index++) {
+        const std::int64_t offset = static_cast<std::int64_t>(index) * DFS_TREE_BLOCK_SIZE;
+        crc = dfs_crc_combine(dfs_service::CHECKSUM_CRC32C, crc, leaves[index],
+                              std::min<std::int64_t>(DFS_TREE_BLOCK_SIZE, file_size - offset));
+    }
+    return crc;
+}
+
+bool DFSMerkleTree::Load(const std::string& treepath, const FileMetadata& metadata) {
+    std::ifstream file(treepath, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    // Format: version line, then "inode size mtime_ns ctime_ns crc leaf_count" and the raw leaves
+    std::string line;
+    if (!std::getline(file, line) || line != DFS_TREE_VERSION || !std::getline(file, line)) {
+        return false;
+    }
+    std::istringstream fields(line);
+    FileMetadata saved;
+    size_t leaf_count;
+    if (!(fields >> saved.inode >> saved.size >> saved.mtime_ns >> saved.ctime_ns >> saved.crc >> leaf_count) ||
+        saved.inode != metadata.inode || saved.size != metadata.size || saved.mtime_ns != metadata.mtime_ns ||
+        saved.ctime_ns != metadata.ctime_ns || saved.crc != metadata.crc) {
+        return false;
+    }
+
+    // Reject a corrupt leaf count before allocating for it; an empty file keeps a single zero leaf
+    const std::int64_t blocks = (saved.size + DFS_TREE_BLOCK_SIZE - 1) / DFS_TREE_BLOCK_SIZE;
+    if (static_cast<std::int64_t>(leaf_count) != std::max<std::int64_t>(blocks, 1)) {
+        return false;
+    }
+
+    levels.assign(1, std::vector<std::uint32_t>(leaf_count));
+    if (!file.read(reinterpret_cast<char*>(levels[0].data()), leaf_count * sizeof(std::uint32_t))) {
+        return false;
+    }
+    file_size = saved.size;
+    BuildLevels();
+    return true;
+}
+
+bool DFSMerkleTree::Save(const std::string& treepath, const FileMetadata& metadata) const {
+    // Concurrent savers each write their own temporary file
+    std::ostringstream temp_path;
+    temp_path << treepath << ".tmp" << std::this_thread::get_id();
+
+    std::ofstream file(temp_path.str(), std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        return false;
+    }
+    const std::vector<std::uint32_t>& leaves = levels[0];
+    file << DFS_TREE_VERSION << '\n'
+         << metadata.inode << ' ' << metadata.size << ' ' << metadata.mtime_ns << ' '
+         << metadata.ctime_ns << ' ' << metadata.crc << ' ' << leaves.size() << '\n';
+    file.write(reinterpret_cast<const char*>(leaves.data()), leaves.size() * sizeof(std::uint32_t));
+    file.close();
+
+    if (!file || std::rename(temp_path.str().c_str(), treepath.c_str()) != 0) {
+        std::remove(temp_path.str().c_str());
+        return false;
+    }
+    return true;
+}
+
+bool dfs_valid_path(const std::string& filename) {
+    if (filename.empty()) {
+        return false;
+    }
+    size_t begin = 0;
+    while (true) {
+        size_t end = filename.find('/', begin);
+        if (end == std::string::npos) end = filename.size();
+        // Empty components also rule out absolute paths, hidden ones "." and ".."
+        if (end == begin || filename[begin] == '.') {
+            return false;
+        }
+        if (end == filename.size()) {
+            return true;
+        }
+        begin = end + 1;
+    }
+}
+
+std::string dfs_parent_path(const std::string& filename) {
+    size_t slash = filename.find_last_of('/');
+    return slash == std::string::npos ? "" : filename.substr(0, slash);
+}
+
+std::string dfs_hidden_path(const std::string& filename, const std::string& suffix) {
+    size_t slash = filename.find_last_of('/');
+    size_t base = slash == std::string::npos ? 0 : slash + 1;
+    return filename.substr(0, base) + "." + filename.substr(base) + suffix;
+}
+
+bool dfs_make_directories(const std::string& root, const std::string& directory) {
+    if (directory.empty()) {
+        return true;
+    }
+    // Create each component in turn, most of them usually exist already
+    for (size_t end = directory.find('/'); ; end = directory.find('/', end + 1)) {
+        const std::string path = root + directory.substr(0, end);
+        if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+        if (end == std::string::npos) {
+            return true;
+        }
+    }
+}
+
+bool dfs_list_tree(const std::string& root, std::vector<std::string>* files,
+                   std::vector<std::string>* directories) {
+    // Directories still to read, relative to the root with a trailing '/'
+    std::vector<std::string> pending{""};
+    bool first = true;
+    while (!pending.empty()) {
+        const std::string prefix = pending.back();
+        pending.pop_back();
+
+        DIR* dir = opendir((root + prefix).c_str());
+        if (!dir) {
+            if (first) return false;
+            continue;
+        }
+        first = false;
+
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            // Skip . and .. as well as hidden and temporary files
+            if (entry->d_name[0] == '.') continue;
+            const std::string name = prefix + entry->d_name;
+
+            // Links to regular files are listed, links to directories are not followed
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN || type == DT_LNK) {
+                struct stat entry_stat;
+                if (lstat((root + name).c_str(), &entry_stat) != 0) continue;
+                if (S_ISLNK(entry_stat.st_mode)) {
+                    type = stat((root + name).c_str(), &entry_stat) == 0 && S_ISREG(entry_stat.st_mode) ? DT_REG : DT_LNK;
+                } else {
+                    type = S_ISDIR(entry_stat.st_mode) ? DT_DIR : S_ISREG(entry_stat.st_mode) ? DT_REG : DT_UNKNOWN;
+                }
+            }
+            if (type == DT_DIR) {
+                if (directories) directories->push_back(name);
+                pending.push_back(name + "/");
+            } else if (type == DT_REG && files) {
+                files->push_back(name);
+            }
+        }
+        closedir(dir);
+    }
+    return true;
+}
+
+DFSMetadataIndex::DFSMetadataIndex(const std::string& mount_path) :
+    mount_path(mount_path), dirty(false) {}
+
+bool DFSMetadataIndex::Get(const std::string& filename, FileMetadata* metadata,
+                           dfs_service::ChecksumType type) {
+    const std::string filepath = mount_path + filename;
+
+    struct stat file_stat;
+    if (stat(filepath.c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        Erase(filename);
+        return false;
+    }
+
+    FileMetadata current;
+    dfs_fill_metadata(filename, file_stat, &current);
+
+    bool cached = false;
+    {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        auto it = entries.find(filename);
+        if (it != entries.end() && dfs_metadata_matches(it->second, current)) {
+            if (type != dfs_service::CHECKSUM_CRC32 || it->second.has_legacy_crc) {
+                *metadata = it->second;
+                return true;
+            }
+            current = it->second;
+            cached = true;
+        }
+    }
+
+    // Stale or unknown entry, checksum outside of the lock
+    if (!cached) {
+        dfs_log(LL_DEBUG2) << "Recomputing checksum for " << filename;
+        current.crc = dfs_file_crc(filepath, dfs_service::CHECKSUM_CRC32C);
+    }
+
+    // The legacy checksum is only computed once a peer asks for it
+    if (type == dfs_service::CHECKSUM_CRC32) {
+        dfs_log(LL_DEBUG2) << "Computing legacy checksum for " << filename;
+        current.legacy_crc = dfs_file_crc(filepath, dfs_service::CHECKSUM_CRC32);
+        current.has_legacy_crc = true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        entries[filename] = current;
+        dirty = true;
+    }
+    *metadata = current;
+    return true;
+}
+
+bool DFSMetadataIndex::GetTree(const std::string& filename, DFSMerkleTree* tree) {
+    FileMetadata metadata;
+    if (!Get(filename, &metadata)) {
+        return false;
+    }
+
+    const std::string treepath = mount_path + DFS_TREE_DIRECTORY + filename;
+    if (tree->Load(treepath, metadata)) {
+        return true;
+    }
+
+    dfs_log(LL_DEBUG2) << "Building tree for " << filename;
+    if (!tree->Build(mount_path + filename)) {
+        return false;
+    }
+    dfs_make_directories(mount_path + DFS_TREE_DIRECTORY, dfs_parent_path(filename));
+    if (!tree->Save(treepath, metadata)) {
+        dfs_log(LL_ERROR) << "Failed to save tree of " << filename;
+    }
+    return true;
+}
+
+void DFSMetadataIndex::Update(const std::string& filename, std::uint32_t crc) {
+    struct stat file_stat;
+    if (stat((mount_path + filename).c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        Erase(filename);
+        return;
+    }
+
+    FileMetadata current;
+    dfs_fill_metadata(filename, file_stat, &current);
+    current.crc = crc;
+
+    std::lock_guard<std::mutex> lock(index_mutex);
+    entries[filename] = current;
+    dirty = true;
+}
+
+void DFSMetadataIndex::Refresh(const std::string& filename) {
+    FileMetadata metadata;
+    Get(filename, &metadata);
+}
+
+void DFSMetadataIndex::Erase(const std::string& filename) {
+    std::unique_lock<std::mutex> lock(index_mutex);
+    if (entries.erase(filename) > 0) {
+        dirty = true;
+        lock.unlock();
+        unlink((mount_path + DFS_TREE_DIRECTORY + filename).c_str());
+    }
+}
+
+bool DFSMetadataIndex::List(std::vector<FileMetadata>* files, std::vector<std::string>* directories) {
+    // Hidden and temporary files are skipped
+    std::vector<std::string> filenames;
+    if (!dfs_list_tree(mount_path, &filenames, directories)) {
+        return false;
+    }
+    std::sort(filenames.begin(), filenames.end());
+
+    for (const std::string& filename : filenames) {
+        FileMetadata metadata;
+        if (Get(filename, &metadata)) {
+            files->push_back(metadata);
+        }
+    }
+
+    // Drop entries of files that disappeared behind our back
+    std::lock_guard<std::mutex> lock(index_mutex);
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (!std::binary_search(filenames.begin(), filenames.end(), it->first)) {
+            it = entries.erase(it);
+            dirty = true;
+        } else {
+            ++it;
+        }
+    }
+    return true;
+}
+
+std::vector<std::string> DFSMetadataIndex::Entries(const std::string& directory) {
+    const std::string prefix = directory + "/";
+    std::vector<std::string> filenames;
+    std::lock_guard<std::mutex> lock(index_mutex);
+    for (auto it = entries.lower_bound(prefix); it != entries.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+        filenames.push_back(it->first);
+    }
+    return filenames;
+}
+
+bool DFSMetadataIndex::Load() {
+    std::ifstream file(mount_path + DFS_METADATA_INDEX_FILE);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    // Indexes of older versions hold different checksums and are rebuilt
+    std::string line;
+    if (!std::getline(file, line) || line != DFS_METADATA_INDEX_VERSION) {
+        dfs_log(LL_DEBUG) << "Ignoring metadata index of another version";
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(index_mutex);
+    while (std::getline(file, line)) {
+        // Format: inode size mtime mtime_ns ctime_ns crc legacy_crc filename,
+        // where legacy_crc is -1 if unknown
+        std::istringstream fields(line);
+        FileMetadata metadata;
+        std::int64_t legacy_crc;
+        if (!(fields >> metadata.inode >> metadata.size >> metadata.mtime
+                     >> metadata.mtime_ns >> metadata.ctime_ns >> metadata.crc >> legacy_crc)) {
+            continue;
+        }
+        metadata.has_legacy_crc = legacy_crc >= 0;
+        metadata.legacy_crc = metadata.has_legacy_crc ? static_cast<std::uint32_t>(legacy_crc) : 0;
+        fields.get();
+        std::getline(fields, metadata.filename);
+        if (metadata.filename.empty()) continue;
+        entries[metadata.filename] = metadata;
+    }
+    dirty = false;
+    dfs_log(LL_DEBUG) << "Loaded " << entries.size() << " metadata entries";
+    return true;
+}
+
+bool DFSMetadataIndex::Save() {
+    const std::string index_path = mount_path + DFS_METADATA_INDEX_FILE;
+    const std::string temp_path = index_path + ".tmp";
+
+    std::lock_guard<std::mutex> lock(index_mutex);
+    if (!dirty) {
+        return true;
+    }
+
+    std::ofstream file(temp_path, std::ios::out | std::ios::trunc);
+    if (!file.is_open()) {
+        dfs_log(LL_ERROR) << "Failed to save metadata index to " << index_path;
+        return false;
+    }
+    file << DFS_METADATA_INDEX_VERSION << '\n';
+    for (const auto& entry : entries) {
+        const FileMetadata& metadata = entry.second;
+        if (metadata.filename.find('\n') != std::string::npos) continue;
+        file << metadata.inode << ' ' << metadata.size << ' ' << metadata.mtime << ' '
+             << metadata.mtime_ns << ' ' << metadata.ctime_ns << ' ' << metadata.crc << ' '
+             << (metadata.has_legacy_crc ? static_cast<std::int64_t>(metadata.legacy_crc) : -1) << ' '
+             << metadata.filename << '\n';
+    }
+    file.close();
+
+    if (!file || std::rename(temp_path.c_str(), index_path.c_str()) != 0) {
+        dfs_log(LL_ERROR) << "Failed to save metadata index to " << index_path;
+        return false;
+    }
+    dirty = false;
+    return true;
+}
+
+/**
+ * The rsync style weak checksum, which can be rolled over a file one byte at a time
+ */
+void DFSRollingChecksum::Reset(const char* data, std::uint32_t size) {
+    a = 0;
+    b = 0;
+    length = size;
+    for (std::uint32_t i = 0; i < size; i++) {
+        std::uint8_t byte = static_cast<std::uint8_t>(data[i]);
+        a += byte;
+        b += (size - i) * byte;
+    }
+}
+
+std::uint32_t dfs_delta_block_size(std::int64_t file_size) {
+    // Roughly the square root of the file size, as rsync does
+    std::uint32_t block_size = static_cast<std::uint32_t>(std::sqrt(static_cast<double>(file_size)));
+    block_size = (block_size + 1023) & ~1023u;
+    return std::max<std::uint32_t>(2048, std::min<std::uint32_t>(block_size, 131072));
+}
+
+bool dfs_file_signature(const std::string& filepath, std::uint32_t block_size,
+                        dfs_service::ChecksumType type, dfs_service::FileSignature* signature) {
+    std::ifstream file(filepath, std::ifstream::in | std::ifstream::binary);
+    if (!file.is_open() || block_size == 0) {
+        return false;
+    }
+
+    signature->set_block_size(block_size);
+    signature->set_checksum(type);
+    std::vector<char> buffer(block_size);
+    DFSRollingChecksum weak;
+    std::int64_t file_size = 0;
+    while (file.read(buffer.data(), block_size) || file.gcount() > 0) {
+        std::uint32_t size = static_cast<std::uint32_t>(file.gcount());
+        weak.Reset(buffer.data(), size);
+        dfs_service::BlockSignature* block = signature->add_blocks();
+        block->set_weak(weak.Value());
+        block->set_strong(dfs_crc(type, buffer.data(), size));
+        file_size += size;
+    }
+    signature->set_file_size(file_size);
+    return !file.bad();
+}
+
+DFSDeltaEncoder::DFSDeltaEncoder(const std::string& filepath, const dfs_service::FileSignature& signature) :
+    signature(signature),
+    file(filepath, std::ifstream::in | std::ifstream::binary),
+    block_size(signature.block_size()), block_total(signature.blocks_size()) {
+
+    last_block_size = (block_size == 0 || signature.file_size() % block_size == 0) ?
+        block_size : static_cast<std::uint32_t>(signature.file_size() % block_size);
+    blocks.reserve(block_total);
+    for (std::int64_t i = 0; i < block_total; i++) {
+        blocks.emplace(signature.blocks(i).weak(), i);
+    }
+    finished = !Good();
+}
+
+bool DFSDeltaEncoder::Good() const {
+    return file.is_open() && block_size > 0 && !file.bad();
+}
+
+bool DFSDeltaEncoder::Next(DeltaOp* op) {
+    while (ready.empty() && !finished) {
+        Step();
+    }
+    if (ready.empty() || !Good()) {
+        return false;
+    }
+    *op = std::move(ready.front());
+    ready.pop_front();
+    return true;
+}
+
+void DFSDeltaEncoder::Flush() {
+    if (pending.block_count == 0 && pending.literal.empty()) return;
+    ready.push_back(std::move(pending));
+    pending = DeltaOp();
+}
+
+void DFSDeltaEncoder::Fill() {
+    if (literal_start > 0) {
+        window.erase(window.begin(), window.begin() + literal_start);
+        position -= literal_start;
+        literal_start = 0;
+    }
+    size_t old_size = window.size();
+    window.resize(old_size + CHUNK_SIZE + block_size);
+    file.read(window.data() + old_size, CHUNK_SIZE + block_size);
+    window.resize(old_size + file.gcount());
+    eof = file.eof() || file.gcount() == 0;
+}
+
+void DFSDeltaEncoder::EmitLiteral(size_t end) {
+    while (literal_start < end) {
+        if (pending.block_count > 0) Flush();
+        size_t size = std::min(end - literal_start, CHUNK_SIZE - pending.literal.size());
+        pending.literal.append(window.data() + literal_start, size);
+        literal_start += size;
+        if (pending.literal.size() >= CHUNK_SIZE) Flush();
+    }
+}
+
+void DFSDeltaEncoder::AddReference(std::int64_t index) {
+    EmitLiteral(position);
+    if (pending.block_count > 0 && pending.block_index + pending.block_count == index) {
+        pending.block_count++;
+        return;
+    }
+    Flush();
+    pending.block_index = index;
+    pending.block_count = 1;
+}
+
+std::int64_t DFSDeltaEncoder::FindBlock(std::uint32_t weak_value, const char* data, std::uint32_t size) {
+    auto range = blocks.equal_range(weak_value);
+    if (range.first == range.second) return -1;
+    std::uint32_t strong = dfs_crc(signature.checksum(), data, size);
+    for (auto it = range.first; it != range.second; ++it) {
+        std::int64_t index = it->second;
+        std::uint32_t indexed_size = (index == block_total - 1) ? last_block_size : block_size;
+        if (indexed_size == size && signature.blocks(index).strong() == strong) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+void DFSDeltaEncoder::Step() {
+    if (!eof && window.size() - position <= block_size) {
+        Fill();
+    }
+    size_t available = window.size() - position;
+
+    if (available > 0 && available < block_size) {
+        // Tail of the file, can only match the receiver's last block
+        std::uint32_t size = static_cast<std::uint32_t>(available);
+        weak.Reset(window.data() + position, size);
+        std::int64_t index = size == last_block_size ? FindBlock(weak.Value(), window.data() + position, size) : -1;
+        if (index >= 0) {
+            AddReference(index);
+            literal_start = position = window.size();
+        } else {
+            position = window.size();
+        }
+        available = 0;
+    }
+
+    if (available == 0) {
+        EmitLiteral(position);
+        Flush();
+        finished = true;
+        return;
+    }
+
+    if (!rolling) {
+        weak.Reset(window.data() + position, block_size);
+        rolling = true;
+    }
+
+    std::int64_t index = FindBlock(weak.Value(), window.data() + position, block_size);
+    if (index >= 0) {
+        AddReference(index);
+        position += block_size;
+        literal_start = position;
+        rolling = false;
+        return;
+    }
+
+    // No match, slide the window by one byte
+    if (position + block_size < window.size()) {
+        weak.Roll(window[position], window[position + block_size]);
+    } else {
+        rolling = false;
+    }
+    position++;
+    if (position - literal_start >= CHUNK_SIZE) EmitLiteral(position);
+}
+
+bool dfs_delta_encode(const std::string& filepath, const dfs_service::FileSignature& signature,
+                      const std::function<bool(DeltaOp&)>& emit) {
+    DFSDeltaEncoder encoder(filepath, signature);
+    DeltaOp op;
+    while (encoder.Next(&op)) {
+        if (!emit(op)) return false;
+    }
+    return encoder.Good();
+}
+
+bool dfs_tree_delta_encode(const std::string& filepath, std::uint32_t block_size,
+                           const std::vector<std::int64_t>& changed_blocks,
+                           const std::function<bool(DeltaOp&)>& emit) {
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        return false;
+    }
+    const std::int64_t block_total = (file_stat.st_size + block_size - 1) / block_size;
+
+    // Reference the unchanged run before each changed block, then send the block itself
+    DeltaOp op;
+    std::int64_t next = 0;
+    bool success = true;
+    for (size_t i = 0; success && i <= changed_blocks.size(); i++) {
+        const std::int64_t changed = i < changed_blocks.size() ? changed_blocks[i] : block_total;
+        while (success && next < changed) {
+            op.block_index = next;
+            op.block_count = static_cast<std::uint32_t>(std::min<std::int64_t>(changed - next, UINT32_MAX));
+            op.literal.clear();
+            next += op.block_count;
+            success = emit(op);
+        }
+        if (success && changed < block_total) {
+            op.block_index = 0;
+            op.block_count = 0;
+            success = dfs_read_chunk(fd, changed * block_size, block_size, &op.literal) >= 0 && emit(op);
+            next = changed + 1;
+        }
+    }
+    close(fd);
+    return success;
+}
+
+bool dfs_delta_copy_blocks(std::ifstream& basis, std::uint32_t block_size,
+                           std::int64_t block_index, std::uint32_t block_count, std::ostream& output,
+                           DFSStreamingCrc* crc) {
+    char buffer[CHUNK_SIZE];
+    basis.clear();
+    basis.seekg(block_index * block_size, std::ios::beg);
+    std::int64_t remaining = static_cast<std::int64_t>(block_count) * block_size;
+    while (remaining > 0 && basis) {
+        basis.read(buffer, std::min<std::int64_t>(remaining, CHUNK_SIZE));
+        std::streamsize size = basis.gcount();
+        if (size <= 0) break;
+        if (!output.write(buffer, size)) return false;
+        if (crc != nullptr) crc->Update(buffer, size);
+        remaining -= size;
+    }
+    return !basis.bad();
+}
+
+ssize_t dfs_read_chunk(int fd, off_t offset, size_t size, std::string* data) {
+    // Resizing is a no-op for every full chunk after the first one
+    data->resize(size);
+    size_t total = 0;
+    while (total < size) {
+        ssize_t count = pread(fd, &(*data)[total], size - total, offset + total);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            data->clear();
+            return -1;
+        }
+        if (count == 0) break;
+        total += count;
+    }
+    data->resize(total);
+    return static_cast<ssize_t>(total);
+}
+
+bool dfs_write_chunk(int fd, off_t offset, const std::string& data) {
+    size_t total = 0;
+    while (total < data.size()) {
+        ssize_t count = pwrite(fd, data.data() + total, data.size() - total, offset + total);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        total += count;
+    }
+    return true;
+}
+
+DFSChunkSizer::DFSChunkSizer(size_t max_size) :
+    max_size(std::max<size_t>(max_size, 1)), sample_start(std::chrono::steady_clock::now()) {
+    min_size = std::min(DFS_MIN_CHUNK_SIZE, this->max_size);
+    size = std::min(CHUNK_SIZE, this->max_size);
+}
+
+void DFSChunkSizer::Sent(size_t bytes) {
+    sample_bytes += bytes;
+    if (++sample_chunks < DFS_CHUNK_SAMPLE_COUNT) {
+        return;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    const std::int64_t micros = std::max<std::int64_t>(1,
+        std::chrono::duration_cast<std::chrono::microseconds>(now - sample_start).count());
+    const double target = static_cast<double>(sample_bytes) * DFS_CHUNK_TARGET_MICROS / micros;
+    if (target >= 2.0 * size && size < max_size) {
+        size = std::min(size * 2, max_size);
+        dfs_log(LL_DEBUG3) << "Growing chunks to " << size << " bytes";
+    } else if (target < size / 2.0 && size > min_size) {
+        size = std::max(size / 2, min_size);
+        dfs_log(LL_DEBUG3) << "Shrinking chunks to " << size << " bytes";
+    }
+
+    sample_start = now;
+    sample_bytes = 0;
+    sample_chunks = 0;
+}
+
+size_t dfs_max_chunk_size(std::uint32_t requested, size_t configured) {
+    // Receivers without adaptive chunks only accept the original size
+    const size_t limit = requested == 0 ? CHUNK_SIZE : std::min<size_t>(requested, DFS_MAX_CHUNK_SIZE);
+    return std::min(limit, configured);
+}
+
+DFSChunkCompressor::DFSChunkCompressor(dfs_service::CompressionType type) : type(type) {
+    if (type == dfs_service::COMPRESSION_DEFLATE) {
+        std::memset(&stream, 0, sizeof(stream));
+        initialized = deflateInit(&stream, DFS_COMPRESSION_LEVEL) == Z_OK;
+    }
+}
+
+DFSChunkCompressor::~DFSChunkCompressor() {
+    if (initialized) {
+        deflateEnd(&stream);
+    }
+}
+
+size_t DFSChunkCompressor::Deflate(const char* data, size_t size) {
+    if (deflateReset(&stream) != Z_OK) {
+        return 0;
+    }
+    scratch.resize(deflateBound(&stream, size));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream.avail_in = static_cast<uInt>(size);
+    stream.next_out = reinterpret_cast<Bytef*>(&scratch[0]);
+    stream.avail_out = static_cast<uInt>(scratch.size());
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        return 0;
+    }
+    return stream.total_out;
+}
+
+dfs_service::CompressionType DFSChunkCompressor::Compress(std::string* data, std::uint32_t* raw_size) {
+    if (!initialized || data->size() < DFS_COMPRESSION_MIN_SIZE) {
+        return dfs_service::COMPRESSION_NONE;
+    }
+
+    // Skip incompressible chunks based on a sample, the start of a file is often a more compressible header
+    if (data->size() > 2 * DFS_COMPRESSION_SAMPLE_SIZE) {
+        const size_t offset = (data->size() - DFS_COMPRESSION_SAMPLE_SIZE) / 2;
+        const size_t sample = Deflate(data->data() + offset, DFS_COMPRESSION_SAMPLE_SIZE);
+        if (sample == 0 || sample > DFS_COMPRESSION_SAMPLE_SIZE * DFS_COMPRESSION_MAX_RATIO) {
+            return dfs_service::COMPRESSION_NONE;
+        }
+    }
+
+    const size_t compressed = Deflate(data->data(), data->size());
+    if (compressed == 0 || compressed > data->size() * DFS_COMPRESSION_MAX_RATIO) {
+        return dfs_service::COMPRESSION_NONE;
+    }
+    *raw_size = static_cast<std::uint32_t>(data->size());
+    scratch.resize(compressed);
+    data->swap(scratch);
+    return type;
+}
+
+bool dfs_decompress_chunk(dfs_service::CompressionType type, std::uint32_t raw_size, std::string* data) {
+    if (type == dfs_service::COMPRESSION_NONE) {
+        return true;
+    }
+    if (type != dfs_service::COMPRESSION_DEFLATE || raw_size > DFS_MAX_CHUNK_SIZE) {
+        return false;
+    }
+
+    std::string raw(raw_size, '\0');
+    uLongf size = raw_size;
+    if (uncompress(reinterpret_cast<Bytef*>(&raw[0]), &size,
+                   reinterpret_cast<const Bytef*>(data->data()), data->size()) != Z_OK || size != raw_size) {
+        return false;
+    }
+    data->swap(raw);
+    return true;
+}
+
+std::vector<std::pair<std::int64_t, std::int64_t>> dfs_file_ranges(std::int64_t file_size, int streams) {
+    std::vector<std::pair<std::int64_t, std::int64_t>> ranges;
+    const std::int64_t count = std::min<std::int64_t>(std::max(streams, 1), file_size / DFS_PARALLEL_MIN_RANGE);
+    if (count < 1) {
+        return ranges;
+    }
+
+    std::int64_t length = (file_size + count - 1) / count;
+    length = (length + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+    for (std::int64_t offset = 0; offset < file_size; offset += length) {
+        ranges.emplace_back(offset, std::min(length, file_size - offset));
+    }
+    return ranges;
+}
+
+bool dfs_ranges_crc(const DFSRangeCrcs& pieces, std::int64_t file_size, std::uint32_t* crc) {
+    std::int64_t covered = 0;
+    *crc = 0;
+    for (const auto& piece : pieces) {
+        if (piece.first != covered) {
+            return false;
+        }
+        *crc = dfs_crc_combine(dfs_service::CHECKSUM_CRC32C, *crc, piece.second.first, piece.second.second);
+        covered += piece.second.second;
+    }
+    return covered == file_size;
+}
+
+std::vector<std::pair<std::int64_t, std::int64_t>> dfs_missing_ranges(const DFSRangeCrcs& pieces,
+                                                                      std::int64_t file_size) {
+    std::vector<std::pair<std::int64_t, std::int64_t>> missing;
+    std::int64_t covered = 0;
+    for (const auto& piece : pieces) {
+        if (piece.first > covered) {
+            missing.emplace_back(covered, piece.first - covered);
+        }
+        covered = std::max(covered, piece.first + piece.second.second);
+    }
+    if (covered < file_size) {
+        missing.emplace_back(covered, file_size - covered);
+    }
+    return missing;
+}
+
+bool dfs_range_crc(int fd, std::int64_t offset, std::int64_t length, std::uint32_t* crc) {
+    DFSStreamingCrc range_crc(dfs_service::CHECKSUM_CRC32C);
+    std::string data;
+    while (length > 0) {
+        const ssize_t count = dfs_read_chunk(fd, offset, std::min<std::int64_t>(length, DFS_MAX_CHUNK_SIZE), &data);
+        if (count <= 0) {
+            return false;
+        }
+        range_crc.Update(data.data(), count);
+        offset += count;
+        length -= count;
+    }
+    *crc = range_crc.Value();
+    return true;
+}
@@ -10,7 +10,16 @@
 #include <fstream>
 #include <string>
 #include <thread>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <functional>
+#include <chrono>
 #include <sys/stat.h>
+#include <zlib.h>
 
 #include "src/dfs-utils.h"
 #include "proto-src/dfs-service.grpc.pb.h"
@@ -56,9 +65,719 @@ struct EventStruct {
 // Add any additional shared code here
 //
 
-// Chunk size for stream file transfer
+// Chunk size for stream file transfer, where adaptive transfers start
 constexpr size_t CHUNK_SIZE = 65536;
 
+// Bounds of adaptive chunk sizes
+constexpr size_t DFS_MIN_CHUNK_SIZE = 16384;
+constexpr size_t DFS_MAX_CHUNK_SIZE = 4 << 20;
+
+// Largest message on either side, a maximal chunk plus the other fields
+constexpr int DFS_MAX_MESSAGE_SIZE = DFS_MAX_CHUNK_SIZE + 65536;
+
+// HTTP/2 flow-control lookahead, enough to keep a few maximal chunks in flight
+constexpr int DFS_FLOW_CONTROL_WINDOW = 4 * DFS_MAX_CHUNK_SIZE;
+
+// Time a single chunk should take to send, trading per-message overhead against latency
+constexpr std::int64_t DFS_CHUNK_TARGET_MICROS = 10000;
+
+// Chunks sent between two chunk size adjustments
+constexpr int DFS_CHUNK_SAMPLE_COUNT = 4;
+
+// Name of the persisted metadata index inside a mount
+#define DFS_METADATA_INDEX_FILE ".dfs-metadata"
+
+// First line of the persisted metadata index, identifies its format
+#define DFS_METADATA_INDEX_VERSION "# dfs-metadata 2"
+
+// Read size of whole file checksums
+constexpr size_t DFS_CHECKSUM_BLOCK_SIZE = 1 << 20;
+
+/**
+ * Check that a name refers to a file or directory inside a mount: a relative
+ * path of '/' separated components, none of them empty, hidden, "." or ".."
+ *
+ * @param filename
+ * @return bool
+ */
+bool dfs_valid_path(const std::string& filename);
+
+/**
+ * @param filename - path within a mount
+ * @return the directory holding the path, "" at the top of the mount
+ */
+std::string dfs_parent_path(const std::string& filename);
+
+/**
+ * Name of a hidden file next to a file of a mount, e.g. "a/.b.txt.tmp" for "a/b.txt"
+ *
+ * @param filename - path within a mount
+ * @param suffix
+ * @return the path within the mount
+ */
+std::string dfs_hidden_path(const std::string& filename, const std::string& suffix);
+
+/**
+ * Create a directory below a root path along with its missing parents
+ *
+ * @param root - path ending in '/'
+ * @param directory - path within the root, "" for the root itself
+ * @return false if a directory could not be created
+ */
+bool dfs_make_directories(const std::string& root, const std::string& directory);
+
+/**
+ * List the regular files and directories below a root path, skipping hidden
+ * entries and without following symbolic links
+ *
+ * @param root - path ending in '/'
+ * @param files - paths within the root, may be nullptr
+ * @param directories - paths within the root, parents before their children, may be nullptr
+ * @return false if the root can't be read
+ */
+bool dfs_list_tree(const std::string& root, std::vector<std::string>* files,
+                   std::vector<std::string>* directories);
+
+/**
+ * Compute or continue a checksum over a buffer.
+ *
+ * CRC-32C uses the SSE4.2 crc32 instruction when the CPU supports it and
+ * slicing-by-8 tables otherwise. CRC-32 always uses slicing-by-8 tables.
+ *
+ * @param type
+ * @param data
+ * @param size
+ * @param crc - checksum of the preceding data, 0 to start a new checksum
+ * @return checksum
+ */
+std::uint32_t dfs_crc(dfs_service::ChecksumType type, const void* data, size_t size, std::uint32_t crc = 0);
+
+// Segment size of whole file checksums, segments are checksummed in parallel
+constexpr std::int64_t DFS_CHECKSUM_SEGMENT_SIZE = 64 << 20;
+
+/**
+ * Combine the checksums of two adjacent pieces of data.
+ *
+ * @param type
+ * @param crc1 - checksum of the first piece
+ * @param crc2 - checksum of the second piece
+ * @param size2 - length of the second piece
+ * @return checksum of both pieces
+ */
+std::uint32_t dfs_crc_combine(dfs_service::ChecksumType type, std::uint32_t crc1, std::uint32_t crc2,
+                              std::int64_t size2);
+
+/**
+ * Checksum a file in fixed size segments, spread over one thread per core.
+ *
+ * The segment checksums can be merged with `dfs_crc_combine` or compared
+ * one by one to find the changed parts of a file.
+ *
+ * @param filepath
+ * @param type
+ * @param segment_size
+ * @param segments - one checksum per segment, the last may be shorter
+ * @return false if the file can't be read
+ */
+bool dfs_file_segment_crcs(const std::string& filepath, dfs_service::ChecksumType type,
+                           std::int64_t segment_size, std::vector<std::uint32_t>* segments);
+
+/**
+ * Checksum a whole file, combined from its segment checksums.
+ *
+ * CHECKSUM_CRC32 yields the same value as `dfs_file_checksum`, including its
+ * handling of the last chunk, so it can be compared with older peers.
+ *
+ * @param filepath
+ * @param type
+ * @return checksum, 0 if the file can't be read
+ */
+std::uint32_t dfs_file_crc(const std::string& filepath, dfs_service::ChecksumType type);
+
+/**
+ * Checksum of a stream of data, computed as the data is read or written.
+ *
+ * Yields the same value as `dfs_file_crc` over the whole stream. The
+ * legacy CRC-32 keeps the last bytes of the stream for its padding.
+ */
+class DFSStreamingCrc {
+
+private:
+    dfs_service::ChecksumType type;
+    std::uint32_t crc = 0;
+    std::int64_t size = 0;
+
+    /** Last bytes of the stream, only kept for the legacy checksum **/
+    std::string tail;
+
+public:
+    explicit DFSStreamingCrc(dfs_service::ChecksumType type = dfs_service::CHECKSUM_CRC32C) : type(type) {}
+
+    /**
+     * Add the next piece of the stream
+     *
+     * @param data
+     * @param size
+     */
+    void Update(const void* data, size_t size);
+
+    /**
+     * @return checksum of the stream so far
+     */
+    std::uint32_t Value() const;
+};
+
+/**
+ * Cached metadata for a single file in a mount.
+ *
+ * The stat tuple (size, mtime_ns, ctime_ns, inode) is used to decide
+ * whether the cached checksums are still valid. The CRC-32C checksum is
+ * always known, the legacy CRC-32 only once a peer asked for it.
+ */
+struct FileMetadata {
+    std::string filename;
+    std::int64_t size = 0;
+    std::int64_t mtime = 0;
+    std::int64_t mtime_ns = 0;
+    std::int64_t ctime_ns = 0;
+    std::uint64_t inode = 0;
+    std::uint32_t crc = 0;
+    std::uint32_t legacy_crc = 0;
+    bool has_legacy_crc = false;
+
+    /**
+     * @param type
+     * @return the checksum of the given type
+     */
+    std::uint32_t Crc(dfs_service::ChecksumType type) const {
+        return type == dfs_service::CHECKSUM_CRC32 ? legacy_crc : crc;
+    }
+};
+
+// Directory of the persisted Merkle trees inside a mount
+#define DFS_TREE_DIRECTORY ".dfs-trees/"
+
+// First line of a persisted Merkle tree, identifies its format
+#define DFS_TREE_VERSION "# dfs-tree 1"
+
+// Bytes covered by each leaf of a Merkle tree
+constexpr std::uint32_t DFS_TREE_BLOCK_SIZE = CHUNK_SIZE;
+
+// Children per node of a Merkle tree
+constexpr std::uint32_t DFS_TREE_FANOUT = 16;
+
+// Most nodes compared per tree level before a diff gives up
+constexpr size_t DFS_TREE_MAX_NODES = 4096;
+
+/**
+ * Merkle tree of CRC-32C hashes over the blocks of a file.
+ *
+ * Level 0 holds one hash per block, each node of a higher level hashes
+ * the hashes of up to DFS_TREE_FANOUT children. Node `i` of level `l`
+ * covers blocks `i * fanout^l` up to `(i + 1) * fanout^l`, so two files
+ * of the same size have trees of the same shape which can be compared
+ * level by level, descending only into nodes that differ.
+ */
+class DFSMerkleTree {
+
+private:
+    std::int64_t file_size = 0;
+
+    /** Hashes per level, levels[0] are the leaves **/
+    std::vector<std::vector<std::uint32_t>> levels;
+
+    /** Compute the inner levels from the leaves **/
+    void BuildLevels();
+
+public:
+    /**
+     * Build the tree from the contents of a file.
+     *
+     * @param filepath
+     * @return false if the file can't be read
+     */
+    bool Build(const std::string& filepath);
+
+    /**
+     * Load a persisted tree, only if it was saved for the given file state.
+     *
+     * @param treepath
+     * @param metadata - current metadata of the file
+     * @return false if there is no matching tree
+     */
+    bool Load(const std::string& treepath, const FileMetadata& metadata);
+
+    /**
+     * Persist the tree along with the file state it belongs to.
+     *
+     * @param treepath
+     * @param metadata
+     * @return bool
+     */
+    bool Save(const std::string& treepath, const FileMetadata& metadata) const;
+
+    std::int64_t FileSize() const { return file_size; }
+
+    /** CRC-32C of the whole file, combined from the leaves **/
+    std::uint32_t Crc() const;
+
+    /** Number of levels, the root is the only node of level Depth() - 1 **/
+    std::uint32_t Depth() const { return static_cast<std::uint32_t>(levels.size()); }
+
+    const std::vector<std::uint32_t>& Level(std::uint32_t level) const { return levels[level]; }
+};
+
+/**
+ * Index of file metadata (size, mtime, inode, crc) for a mount path.
+ *
+ * Entries are validated against `stat` on every lookup and the checksum
+ * is only recomputed when the stat tuple changed, so listings and
+ * store/fetch comparisons don't have to re-read file contents.
+ */
+class DFSMetadataIndex {
+
+private:
+    /** The mount path the index describes **/
+    std::string mount_path;
+
+    /** Mutex guarding the entries **/
+    std::mutex index_mutex;
+
+    /** Cached entries: filename -> metadata **/
+    std::map<std::string, FileMetadata> entries;
+
+    /** Indicates the entries changed since the last save **/
+    bool dirty;
+
+public:
+    explicit DFSMetadataIndex(const std::string& mount_path);
+
+    /**
+     * Get the metadata for a file, recomputing the checksum only if
+     * the file changed since it was cached.
+     *
+     * @param filename
+     * @param metadata
+     * @param type - checksum that must be known, the legacy one is computed on demand
+     * @return false if the file does not exist
+     */
+    bool Get(const std::string& filename, FileMetadata* metadata,
+             dfs_service::ChecksumType type = dfs_service::CHECKSUM_CRC32C);
+
+    /**
+     * Get the Merkle tree of a file, rebuilding the persisted tree only if
+     * the file changed since it was saved.
+     *
+     * @param filename
+     * @param tree
+     * @return false if the file does not exist
+     */
+    bool GetTree(const std::string& filename, DFSMerkleTree* tree);
+
+    /**
+     * Set the entry for a file that was just written, with the CRC-32C
+     * computed while writing it, so the file isn't read again.
+     *
+     * @param filename
+     * @param crc
+     */
+    void Update(const std::string& filename, std::uint32_t crc);
+
+    /**
+     * Refresh the entry for a file after it was written locally.
+     *
+     * @param filename
+     */
+    void Refresh(const std::string& filename);
+
+    /**
+     * Remove the entry and persisted tree for a file.
+     *
+     * @param filename
+     */
+    void Erase(const std::string& filename);
+
+    /**
+     * List the regular (non-hidden) files below the mount path.
+     *
+     * @param files
+     * @param directories - set to the (non-hidden) directories below the mount path, may be nullptr
+     * @return false if the mount path can't be read
+     */
+    bool List(std::vector<FileMetadata>* files, std::vector<std::string>* directories = nullptr);
+
+    /**
+     * Filenames of the entries below a directory, e.g. to delete the files of a directory that was moved away
+     *
+     * @param directory
+     * @return std::vector<std::string>
+     */
+    std::vector<std::string> Entries(const std::string& directory);
+
+    /**
+     * Load the persisted index from the mount path.
+     *
+     * @return bool
+     */
+    bool Load();
+
+    /**
+     * Persist the index to the mount path if it changed.
+     *
+     * @return bool
+     */
+    bool Save();
+};
+
+// Files smaller than this are always transferred in full
+constexpr std::int64_t DFS_DELTA_MIN_SIZE = 65536;
+
+// Files up to this size are synchronized through batches, in a single message each
+constexpr std::int64_t DFS_BATCH_MAX_FILE_SIZE = CHUNK_SIZE;
+
+// Maximum number of files sent over a single batch stream
+constexpr size_t DFS_BATCH_MAX_FILES = 256;
+
+/**
+ * A single delta operation produced by the delta encoder.
+ *
+ * Either references `block_count` consecutive blocks of the receiver's
+ * copy starting at `block_index`, or carries `literal` data.
+ */
+struct DeltaOp {
+    std::int64_t block_index = 0;
+    std::uint32_t block_count = 0;
+    std::string literal;
+};
+
+/**
+ * Choose the delta block size for a file of the given size
+ *
+ * @param file_size
+ * @return block size in bytes
+ */
+std::uint32_t dfs_delta_block_size(std::int64_t file_size);
+
+/**
+ * Compute the block signatures of a file
+ *
+ * @param filepath
+ * @param block_size
+ * @param type - algorithm of the strong checksums
+ * @param signature
+ * @return false if the file can't be read
+ */
+bool dfs_file_signature(const std::string& filepath, std::uint32_t block_size,
+                        dfs_service::ChecksumType type, dfs_service::FileSignature* signature);
+
+/**
+ * Rolling weak checksum (rsync style) over a window of fixed length
+ */
+class DFSRollingChecksum {
+
+private:
+    std::uint32_t a = 0;
+    std::uint32_t b = 0;
+    std::uint32_t length = 0;
+
+public:
+    void Reset(const char* data, std::uint32_t size);
+
+    void Roll(char out, char in) {
+        a += static_cast<std::uint8_t>(in) - static_cast<std::uint8_t>(out);
+        b += a - length * static_cast<std::uint8_t>(out);
+    }
+
+    std::uint32_t Value() const {
+        return (a & 0xffff) | (b << 16);
+    }
+};
+
+/**
+ * Incremental delta encoder, producing the operations of a file
+ * against the signature of the receiver's copy one at a time.
+ *
+ * Literal runs are produced in pieces of at most CHUNK_SIZE bytes and consecutive
+ * matching blocks are merged into a single reference. Only a window of about
+ * two chunks of the file is held in memory, so callers may interleave
+ * producing operations with sending them.
+ */
+class DFSDeltaEncoder {
+
+private:
+    const dfs_service::FileSignature& signature;
+    std::ifstream file;
+    std::uint32_t block_size;
+    std::uint32_t last_block_size;
+    std::int64_t block_total;
+
+    /** Receiver's blocks indexed by weak checksum **/
+    std::unordered_multimap<std::uint32_t, std::int64_t> blocks;
+
+    /** Operations produced but not yet handed out **/
+    std::deque<DeltaOp> ready;
+
+    /** Pending operation, flushed whenever the kind of operation changes **/
+    DeltaOp pending;
+
+    /** The window holds the bytes from the start of the pending literal onwards **/
+    std::vector<char> window;
+    size_t literal_start = 0;
+    size_t position = 0;
+    bool eof = false;
+    bool rolling = false;
+    bool finished = false;
+    DFSRollingChecksum weak;
+
+    void Flush();
+    void Fill();
+    void EmitLiteral(size_t end);
+    void AddReference(std::int64_t index);
+    std::int64_t FindBlock(std::uint32_t weak_value, const char* data, std::uint32_t size);
+    void Step();
+
+public:
+    /**
+     * @param filepath
+     * @param signature - must outlive the encoder
+     */
+    DFSDeltaEncoder(const std::string& filepath, const dfs_service::FileSignature& signature);
+
+    /**
+     * Produce the next operation
+     *
+     * @param op
+     * @return false once the whole file has been encoded or on read errors
+     */
+    bool Next(DeltaOp* op);
+
+    /**
+     * @return false if the file can't be read
+     */
+    bool Good() const;
+};
+
+/**
+ * Encode a file as delta operations against the signature of the receiver's copy.
+ *
+ * @param filepath
+ * @param signature
+ * @param emit - called for each operation in order, returning false aborts encoding.
+ *               The operation's literal may be moved out by the callee.
+ * @return false if the file can't be read or emit aborted
+ */
+bool dfs_delta_encode(const std::string& filepath, const dfs_service::FileSignature& signature,
+                      const std::function<bool(DeltaOp&)>& emit);
+
+/**
+ * Encode a file as delta operations against a receiver's copy of the same
+ * size, referencing every block but the changed ones.
+ *
+ * @param filepath
+ * @param block_size
+ * @param changed_blocks - ascending indexes of the blocks to send as literals
+ * @param emit - as for dfs_delta_encode
+ * @return false if the file can't be read or emit aborted
+ */
+bool dfs_tree_delta_encode(const std::string& filepath, std::uint32_t block_size,
+                           const std::vector<std::int64_t>& changed_blocks,
+                           const std::function<bool(DeltaOp&)>& emit);
+
+/**
+ * Copy referenced blocks of a basis file to the output of a delta transfer
+ *
+ * @param basis
+ * @param block_size
+ * @param block_index
+ * @param block_count
+ * @param output
+ * @param crc - updated with the copied data, may be nullptr
+ * @return false on read or write errors
+ */
+bool dfs_delta_copy_blocks(std::ifstream& basis, std::uint32_t block_size,
+                           std::int64_t block_index, std::uint32_t block_count, std::ostream& output,
+                           DFSStreamingCrc* crc = nullptr);
+
+/**
+ * Read up to `size` bytes at `offset` of a file directly into a message buffer.
+ *
+ * The buffer is resized to the number of bytes read, so reusing the same
+ * buffer across chunks avoids both reallocation and intermediate copies.
+ *
+ * @param fd
+ * @param offset
+ * @param size
+ * @param data
+ * @return number of bytes read, or -1 on error
+ */
+ssize_t dfs_read_chunk(int fd, off_t offset, size_t size, std::string* data);
+
+/**
+ * Write a whole buffer at `offset` of a file
+ *
+ * @param fd
+ * @param offset
+ * @param data
+ * @return false on errors
+ */
+bool dfs_write_chunk(int fd, off_t offset, const std::string& data);
+
+/**
+ * Picks the chunk size of a transfer stream from its observed throughput.
+ *
+ * The size starts at CHUNK_SIZE and every few chunks is doubled or halved
+ * towards what the stream moves in DFS_CHUNK_TARGET_MICROS: slow or
+ * high latency links keep small chunks, fast links grow to large ones that
+ * amortize the per-message overhead.
+ */
+class DFSChunkSizer {
+
+private:
+    size_t size;
+    size_t min_size;
+    size_t max_size;
+
+    /** Current throughput sample **/
+    std::chrono::steady_clock::time_point sample_start;
+    size_t sample_bytes = 0;
+    int sample_chunks = 0;
+
+public:
+    /**
+     * @param max_size - largest chunk the receiving side accepts
+     */
+    explicit DFSChunkSizer(size_t max_size = DFS_MAX_CHUNK_SIZE);
+
+    /**
+     * @return size of the next chunk
+     */
+    size_t Size() const { return size; }
+
+    /**
+     * Record a chunk handed to the stream, adjusting the size once a sample is complete
+     *
+     * @param bytes
+     */
+    void Sent(size_t bytes);
+};
+
+/**
+ * Largest chunk a transfer may use given the receiver's limit
+ *
+ * @param requested - limit announced by the receiver, 0 if it predates adaptive chunks
+ * @param configured - local limit
+ * @return size_t
+ */
+size_t dfs_max_chunk_size(std::uint32_t requested, size_t configured);
+
+// Smallest range worth its own stream in ranged transfers, smaller files are sent in a single plain stream
+constexpr std::int64_t DFS_PARALLEL_MIN_RANGE = 16 << 20;
+
+/**
+ * Split a file into the ranges of a transfer over several streams
+ *
+ * @param file_size
+ * @param streams - most streams to use
+ * @return (offset, length) of each range, aligned to CHUNK_SIZE; none if the file is below DFS_PARALLEL_MIN_RANGE
+ */
+std::vector<std::pair<std::int64_t, std::int64_t>> dfs_file_ranges(std::int64_t file_size, int streams);
+
+/** Pieces of a ranged transfer received so far: offset -> (CRC-32C, length) **/
+typedef std::map<std::int64_t, std::pair<std::uint32_t, std::int64_t>> DFSRangeCrcs;
+
+/**
+ * Combine the checksums of the pieces of a ranged transfer into the file's CRC-32C
+ *
+ * @param pieces
+ * @param file_size
+ * @param crc
+ * @return false if the pieces don't cover the file exactly once
+ */
+bool dfs_ranges_crc(const DFSRangeCrcs& pieces, std::int64_t file_size, std::uint32_t* crc);
+
+/**
+ * Ranges of a file not covered by the pieces of a transfer yet
+ *
+ * @param pieces
+ * @param file_size
+ * @return (offset, length) of each gap
+ */
+std::vector<std::pair<std::int64_t, std::int64_t>> dfs_missing_ranges(const DFSRangeCrcs& pieces,
+                                                                      std::int64_t file_size);
+
+/**
+ * CRC-32C of `length` bytes at `offset` of a file
+ *
+ * @param fd
+ * @param offset
+ * @param length
+ * @param crc
+ * @return false if the range can't be read
+ */
+bool dfs_range_crc(int fd, std::int64_t offset, std::int64_t length, std::uint32_t* crc);
+
+// Chunks smaller than this are always sent raw
+constexpr size_t DFS_COMPRESSION_MIN_SIZE = 512;
+
+// Bytes from the middle of a chunk compressed on trial before the whole chunk
+constexpr size_t DFS_COMPRESSION_SAMPLE_SIZE = 4096;
+
+// A chunk is only compressed if its sample shrinks below this fraction
+constexpr double DFS_COMPRESSION_MAX_RATIO = 0.9;
+
+// zlib level, favoring speed since chunks are compressed on the fly
+constexpr int DFS_COMPRESSION_LEVEL = 1;
+
+/**
+ * Compresses transfer chunks in place, skipping those that don't shrink.
+ *
+ * Already compressed data like images is detected from a small sample, so
+ * it costs a trial on a few KiB per chunk rather than the whole chunk.
+ */
+class DFSChunkCompressor {
+
+private:
+    dfs_service::CompressionType type;
+    z_stream stream;
+    bool initialized = false;
+    std::string scratch;
+
+    /**
+     * Deflate a buffer into the scratch buffer
+     *
+     * @return compressed size, 0 on errors
+     */
+    size_t Deflate(const char* data, size_t size);
+
+public:
+    /**
+     * @param type - compression accepted by the receiver
+     */
+    explicit DFSChunkCompressor(dfs_service::CompressionType type = dfs_service::COMPRESSION_NONE);
+    ~DFSChunkCompressor();
+
+    DFSChunkCompressor(const DFSChunkCompressor&) = delete;
+    DFSChunkCompressor& operator=(const DFSChunkCompressor&) = delete;
+
+    /**
+     * Compress a chunk in place if that pays off
+     *
+     * @param data
+     * @param raw_size - set to the size before compression
+     * @return compression applied to data
+     */
+    dfs_service::CompressionType Compress(std::string* data, std::uint32_t* raw_size);
+};
+
+/**
+ * Restore the data of a compressed chunk in place
+ *
+ * @param type
+ * @param raw_size - size announced by the sender
+ * @param data
+ * @return false if the data is damaged or doesn't match raw_size
+ */
+bool dfs_decompress_chunk(dfs_service::CompressionType type, std::uint32_t raw_size, std::string* data);
 
 #endif
 
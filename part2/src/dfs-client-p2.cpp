@@ -1,5 +1,4 @@
 #include <map>
-#include <regex>
 #include <vector>
 #include <string>
 #include <thread>
@@ -52,6 +51,14 @@ void DFSClient::ProcessCommand(const std::string &command, const std::string &fi
 
         client_node.Stat(filename);
 
+    } else if (command == "mkdir") {
+
+        client_node.MakeDirectory(filename);
+
+    } else if (command == "rmdir") {
+
+        client_node.RemoveDirectory(filename);
+
     } else {
 
         dfs_log(LL_ERROR) << "Unknown command";
@@ -61,7 +68,13 @@ void DFSClient::ProcessCommand(const std::string &command, const std::string &fi
 }
 
 void DFSClient::InitializeClientNode(const std::string &server_address) {
-    this->client_node.CreateStub(grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials()));
+    // Leave room for the largest chunks and keep several of them in flight
+    grpc::ChannelArguments arguments;
+    arguments.SetMaxReceiveMessageSize(DFS_MAX_MESSAGE_SIZE);
+    arguments.SetMaxSendMessageSize(DFS_MAX_MESSAGE_SIZE);
+    arguments.SetInt(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES, DFS_FLOW_CONTROL_WINDOW);
+    arguments.SetInt(GRPC_ARG_HTTP2_BDP_PROBE, 1);
+    this->client_node.CreateStub(grpc::CreateCustomChannel(server_address, grpc::InsecureChannelCredentials(), arguments));
 }
 
 void DFSClient::SetMountPath(const std::string &path) {
@@ -69,6 +82,26 @@ void DFSClient::SetMountPath(const std::string &path) {
     this->client_node.SetMountPath(this->mount_path);
 }
 
+void DFSClient::SetMaxChunkSize(size_t max_chunk_size) {
+    this->client_node.SetMaxChunkSize(max_chunk_size);
+}
+
+void DFSClient::SetCompression(dfs_service::CompressionType compression) {
+    this->client_node.SetCompression(compression);
+}
+
+void DFSClient::SetParallelStreams(int streams) {
+    this->client_node.SetParallelStreams(streams);
+}
+
+void DFSClient::SetSyncWorkers(int workers) {
+    this->client_node.SetSyncWorkers(workers);
+}
+
+void DFSClient::SetFileFilter(const DFSFileFilter& file_filter) {
+    this->client_node.SetFileFilter(file_filter);
+}
+
 void DFSClient::SetDeadlineTimeout(int deadline) {
     this->deadline_timeout = deadline;
     this->client_node.SetDeadlineTimeout(deadline);
@@ -84,8 +117,7 @@ void DFSClient::Mount(const std::string &filepath) {
     dfs_log(LL_SYSINFO) << "Mounting on " << this->mount_path;
 
     std::vector <std::thread> threads;
-    //    uint event_flags = IN_CLOSE_WRITE | IN_OPEN;
-    uint event_flags = IN_CREATE | IN_MODIFY | IN_DELETE;
+    uint event_flags = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM;
 
     const FileDescriptor fd = inotify_init();
 
@@ -94,7 +126,8 @@ void DFSClient::Mount(const std::string &filepath) {
         exit(-1);
     }
 
-    const WatchDescriptor wd = inotify_add_watch(fd, filepath.c_str(), event_flags | IN_ONLYDIR);
+    // Every directory of the mount is watched, new ones as they appear
+    const WatchDescriptor wd = this->client_node.WatchMount(fd, event_flags);
 
     std::thread thread_watcher(DFSClient::InotifyWatcher, DFSClient::InotifyEventCallback, event_flags, fd, &this->client_node);
     NotifyStruct n_event = {fd, wd, event_flags, &thread_watcher, DFSClient::InotifyEventCallback};
@@ -104,6 +137,9 @@ void DFSClient::Mount(const std::string &filepath) {
     thread_async = std::thread(&DFSClientNodeP2::HandleCallbackList, &this->client_node);
     threads.push_back(std::move(thread_async));
 
+    // Local changes are stored once their files settle
+    threads.emplace_back(&DFSClientNodeP2::HandleChanges, &this->client_node);
+
     // Initialize the callback list
     this->client_node.InitCallbackList();
 
@@ -142,7 +178,7 @@ void DFSClient::Unmount() {
 void DFSClient::InotifyWatcher(InotifyCallback callback,
                                    uint event_type,
                                    FileDescriptor fd,
-                                   DFSClientNode *node) {
+                                   DFSClientNodeP2 *node) {
     int len;
     std::allocator<char> allocator;
     std::unique_ptr<char> handle(allocator.allocate(DFS_I_BUFFER_SIZE));
@@ -165,8 +201,14 @@ void DFSClient::InotifyWatcher(InotifyCallback callback,
                 event_data.event = event;
                 event_data.instance = node;
 
-                if ((event_type & event->mask) && event->name[0] != '.') {
-                    callback(event_type, std::string{node->MountPath() + event->name}, &event_data);
+                // The watch of a removed directory is gone
+                if (event->mask & IN_IGNORED) {
+                    node->Unwatch(event->wd);
+                } else if ((event_type & event->mask) && event->len > 0 && event->name[0] != '.') {
+                    const std::string path = node->WatchedPath(event->wd, event->name);
+                    if (!path.empty()) {
+                        callback(event_type, std::string{node->MountPath() + path}, &event_data);
+                    }
                 }
 
                 size_t used = DFS_I_EVENT_SIZE + event->len;
@@ -184,44 +226,56 @@ void DFSClient::InotifyWatcher(InotifyCallback callback,
 
 void DFSClient::InotifyEventCallback(uint event_type, const std::string &filename, void *data) {
 
-    // For the purposes of this assignment we will ignore files that do not
-    // match the following set of extensions (e.g. temporary files)
-    try {
-        if (!std::regex_match(filename, std::regex(".*\\.(jpg|png|gif|txt|xlsx|docx|md|psd)$"))) {
-            dfs_log(LL_ERROR) << "Ignored file type used for " << filename;
-            return;
+    auto event_data = reinterpret_cast<EventStruct *>(data);
+    inotify_event *event = reinterpret_cast<inotify_event *>(event_data->event);
+    DFSClientNodeP2 *node = reinterpret_cast<DFSClientNodeP2 *>(event_data->instance);
+
+    // Get the path of the file within the mount
+    std::string path = filename.substr(node->MountPath().size());
+
+    // Directories are created and removed as a whole, a directory moved
+    // in is watched and its contents stored like a new directory
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            dfs_log(LL_DEBUG2) << "inotify directory IN_CREATE or IN_MOVED_TO event occurred";
+            node->QueueChange(path, DFS_CHANGE_MKDIR);
+            node->WatchDirectory(path);
+        }
+        if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            dfs_log(LL_DEBUG2) << "inotify directory IN_DELETE or IN_MOVED_FROM event occurred";
+            node->QueueChange(path, DFS_CHANGE_RMDIR);
         }
-    }
-    catch (std::regex_error& ex) {
-        dfs_log(LL_ERROR) << ex.what();
         return;
     }
 
-    // Get the basename for the file
-    std::string basename = filename.substr(filename.find_last_of("/") + 1);
-
-    auto event_data = reinterpret_cast<EventStruct *>(data);
-    inotify_event *event = reinterpret_cast<inotify_event *>(event_data->event);
-    DFSClientNode *node = reinterpret_cast<DFSClientNode *>(event_data->instance);
+    // Ignore files the mount was not configured to synchronize (e.g. temporary files)
+    if (!node->FileFilter().Matches(path)) {
+        dfs_log(LL_DEBUG2) << "Ignored file type used for " << filename;
+        return;
+    }
 
-    // Handle a new file that was created by storing
-    // this file on the server
+    // Changes are queued and merged per file, so a save that writes
+    // many times is stored once, after the file is closed or goes quiet
     if (event->mask & IN_CREATE) {
         dfs_log(LL_DEBUG2) << "inotify IN_CREATE event occurred";
-        node->Store(basename);
+        node->QueueChange(path, DFS_CHANGE_CREATE);
     }
 
-    // Handle a new file that was modified by storing
-    // this file on the server
     if (event->mask & IN_MODIFY) {
         dfs_log(LL_DEBUG2) << "inotify IN_MODIFY event occurred";
-        node->Store(basename);
+        node->QueueChange(path, DFS_CHANGE_WRITE);
+    }
+
+    // A closed or moved in file is complete
+    if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        dfs_log(LL_DEBUG2) << "inotify IN_CLOSE_WRITE or IN_MOVED_TO event occurred";
+        node->QueueChange(path, DFS_CHANGE_CLOSE);
     }
 
-    // Handle a deleted file
-    if (event->mask & IN_DELETE) {
-        dfs_log(LL_DEBUG2) << "inotify IN_DELETE event occurred";
-        node->Delete(basename);
+    // Handle a deleted or moved out file
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        dfs_log(LL_DEBUG2) << "inotify IN_DELETE or IN_MOVED_FROM event occurred";
+        node->QueueChange(path, DFS_CHANGE_DELETE);
     }
 
 }
@@ -241,22 +295,36 @@ void Usage() {
         "-d, --debug_level <level>:  The debug level to use: 0, 1, 2, 3 (default: 0 = no debug, higher numbers increase verbosity)\n"
         "-m, --mount_path <path>:  The mount path this client attaches to\n"
         "-t, --deadline_timeout <int>:  The deadline timeout in milliseconds (default: 12000)\n"
+        "-c, --chunk_size <int>:  Largest transfer chunk in bytes, chunk sizes adapt below it (default: 4194304)\n"
+        "-z, --compression <type>:  Compression of transfer chunks if the server supports it: none or deflate (default: deflate)\n"
+        "-s, --streams <int>:  Concurrent streams used to transfer a large file (default: 4)\n"
+        "-w, --sync_workers <int>:  Files synchronized in parallel by a mount (default: 4)\n"
+        "-e, --extensions <list>:  Comma separated extensions a mount synchronizes, all if empty (default: " << DFS_DEFAULT_EXTENSIONS << ")\n"
+        "-i, --include <glob>:  Also synchronize files matching the glob, may be repeated\n"
+        "-x, --exclude <glob>:  Never synchronize files matching the glob, may be repeated\n"
         "-h, --help:               Show help\n"
         "\n"
-        "COMMAND is one of mount|fetch|store|delete|list|stat.\n"
-        "FILENAME is the filename to fetch, store, delete, or stat. The mount and list commands do not require a filename.\n\n";
+        "COMMAND is one of mount|fetch|store|delete|list|stat|mkdir|rmdir.\n"
+        "FILENAME is the filename to fetch, store, delete, or stat, or the directory to mkdir or rmdir. The mount and list commands do not require a filename.\n\n";
     exit(1);
 }
 
 int main(int argc, char** argv) {
 
-    const char* const short_opts = "a:d:m:r:t:h";
+    const char* const short_opts = "a:d:m:r:t:c:z:s:w:e:i:x:h";
 
     const option long_opts[] = {
         {"address", optional_argument, nullptr, 'a'},
         {"debug_level", optional_argument, nullptr, 'd'},
         {"mount_path", optional_argument, nullptr, 'm'},
         {"deadline_timeout", optional_argument, nullptr, 't'},
+        {"chunk_size", optional_argument, nullptr, 'c'},
+        {"compression", optional_argument, nullptr, 'z'},
+        {"streams", optional_argument, nullptr, 's'},
+        {"sync_workers", optional_argument, nullptr, 'w'},
+        {"extensions", optional_argument, nullptr, 'e'},
+        {"include", optional_argument, nullptr, 'i'},
+        {"exclude", optional_argument, nullptr, 'x'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, no_argument, nullptr, 0}
     };
@@ -268,6 +336,11 @@ int main(int argc, char** argv) {
     std::string command = "";
     std::string mount_path = "";
     int deadline_timeout = 12000;
+    size_t max_chunk_size = DFS_MAX_CHUNK_SIZE;
+    dfs_service::CompressionType compression = dfs_service::COMPRESSION_DEFLATE;
+    int parallel_streams = 4;
+    int sync_workers = 4;
+    DFSFileFilter file_filter;
 
     char cwd[PATH_MAX];
     if (getcwd(cwd, sizeof(cwd)) == NULL) {
@@ -290,6 +363,33 @@ int main(int argc, char** argv) {
             case 't':
                 deadline_timeout = std::stoi(optarg);
                 break;
+            case 'c':
+                max_chunk_size = std::stoul(optarg);
+                break;
+            case 'z':
+                if (std::string(optarg) == "none") {
+                    compression = dfs_service::COMPRESSION_NONE;
+                } else if (std::string(optarg) == "deflate") {
+                    compression = dfs_service::COMPRESSION_DEFLATE;
+                } else {
+                    Usage();
+                }
+                break;
+            case 's':
+                parallel_streams = std::stoi(optarg);
+                break;
+            case 'w':
+                sync_workers = std::stoi(optarg);
+                break;
+            case 'e':
+                file_filter.SetExtensions(optarg);
+                break;
+            case 'i':
+                file_filter.AddInclude(optarg);
+                break;
+            case 'x':
+                file_filter.AddExclude(optarg);
+                break;
             case 'h':
                 Usage();
                 break;
@@ -335,7 +435,7 @@ int main(int argc, char** argv) {
         return -1;
     }
 
-    std::string commands("fetch store delete list stat mount sync");
+    std::string commands("fetch store delete list stat mkdir rmdir mount sync");
     if (commands.find(command) == std::string::npos ) {
         std::cerr << "\nUnknown command!\n";
         Usage();
@@ -354,6 +454,11 @@ int main(int argc, char** argv) {
 
     client.SetMountPath(mount_path);
     client.SetDeadlineTimeout(deadline_timeout);
+    client.SetMaxChunkSize(max_chunk_size);
+    client.SetCompression(compression);
+    client.SetParallelStreams(parallel_streams);
+    client.SetSyncWorkers(sync_workers);
+    client.SetFileFilter(file_filter);
     client.InitializeClientNode(server_address);
     client.ProcessCommand(command, filename);
 
@@ -65,6 +65,41 @@ class DFSClient {
          */
         void SetDeadlineTimeout(int deadline);
 
+        /**
+         * Sets the largest transfer chunk, chunk sizes adapt below it
+         *
+         * @param max_chunk_size
+         */
+        void SetMaxChunkSize(size_t max_chunk_size);
+
+        /**
+         * Sets the compression of transfer chunks, used if the server supports it
+         *
+         * @param compression
+         */
+        void SetCompression(dfs_service::CompressionType compression);
+
+        /**
+         * Sets the number of concurrent streams used for a large file
+         *
+         * @param streams
+         */
+        void SetParallelStreams(int streams);
+
+        /**
+         * Sets the number of files a mount synchronizes in parallel
+         *
+         * @param workers
+         */
+        void SetSyncWorkers(int workers);
+
+        /**
+         * Sets the files the mount synchronizes
+         *
+         * @param file_filter
+         */
+        void SetFileFilter(const DFSFileFilter& file_filter);
+
         /**
          * Mounts the client to the specified file path.
          *
@@ -99,7 +134,7 @@ class DFSClient {
         static void InotifyWatcher(InotifyCallback callback,
                                    uint event_type,
                                    FileDescriptor fd,
-                                   DFSClientNode* node);
+                                   DFSClientNodeP2* node);
 
 };
 #endif
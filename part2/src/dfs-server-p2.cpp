@@ -18,19 +18,31 @@ void Usage() {
         "-d, --debug_level <level>:  The debug level to use: 0, 1, 2, 3 (default: 0 = no debug, higher numbers increase verbosity)\n"
         "-m, --mount_path <path>:       The mount storage path (default: mnt/server)\n"
         "-n, --num_async_threads <num>: The number of asynchronous threads to generate (default: 4)\n"
+        "-p, --preposted_calls <num>:   The number of calls posted per method on each async thread (default: 1)\n"
+        "-f, --fsync <policy>:          Durability of stored files: none, file or group (default: none)\n"
+        "-i, --io <backend>:            Disk I/O of file transfers: sync or uring (default: sync)\n"
+        "-q, --io_depth <num>:          Chunks kept in flight per transfer with uring (default: 4)\n"
+        "-c, --chunk_size <num>:        Largest transfer chunk in bytes, chunk sizes adapt below it (default: 4194304)\n"
+        "-z, --compression <type>:      Compression offered for transfer chunks: none or deflate (default: deflate)\n"
         "-h, --help:                    Show help\n\n";
     exit(1);
 }
 
 int main(int argc, char** argv) {
 
-    const char* const short_opts = "a:d:m:n:h";
+    const char* const short_opts = "a:d:m:n:p:f:i:q:c:z:h";
 
     const option long_opts[] = {
         {"address", optional_argument, nullptr, 'a'},
         {"debug_level", optional_argument, nullptr, 'd'},
         {"mount_path", optional_argument, nullptr, 'm'},
         {"num_async_threads", optional_argument, nullptr, 'n'},
+        {"preposted_calls", optional_argument, nullptr, 'p'},
+        {"fsync", optional_argument, nullptr, 'f'},
+        {"io", optional_argument, nullptr, 'i'},
+        {"io_depth", optional_argument, nullptr, 'q'},
+        {"chunk_size", optional_argument, nullptr, 'c'},
+        {"compression", optional_argument, nullptr, 'z'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, no_argument, nullptr, 0}
     };
@@ -38,6 +50,12 @@ int main(int argc, char** argv) {
     int option_char;
     std::string mount_path = "mnt/server/";
     long num_async_threads = 4;
+    int num_preposted_calls = 1;
+    DFSFsyncPolicy fsync_policy = DFS_FSYNC_NONE;
+    DFSIoBackend io_backend = DFS_IO_SYNC;
+    int io_depth = 4;
+    size_t max_chunk_size = DFS_MAX_CHUNK_SIZE;
+    dfs_service::CompressionType compression = dfs_service::COMPRESSION_DEFLATE;
     std::string server_address = "0.0.0.0:51189";
     int debug_level = static_cast<int>(LL_ERROR);
 
@@ -55,6 +73,44 @@ int main(int argc, char** argv) {
             case 'n':
                 num_async_threads = std::stoi(optarg);
                 break;
+            case 'p':
+                num_preposted_calls = std::stoi(optarg);
+                break;
+            case 'f':
+                if (std::string(optarg) == "none") {
+                    fsync_policy = DFS_FSYNC_NONE;
+                } else if (std::string(optarg) == "file") {
+                    fsync_policy = DFS_FSYNC_FILE;
+                } else if (std::string(optarg) == "group") {
+                    fsync_policy = DFS_FSYNC_GROUP;
+                } else {
+                    Usage();
+                }
+                break;
+            case 'i':
+                if (std::string(optarg) == "sync") {
+                    io_backend = DFS_IO_SYNC;
+                } else if (std::string(optarg) == "uring") {
+                    io_backend = DFS_IO_URING;
+                } else {
+                    Usage();
+                }
+                break;
+            case 'q':
+                io_depth = std::stoi(optarg);
+                break;
+            case 'c':
+                max_chunk_size = std::min<size_t>(std::stoul(optarg), DFS_MAX_CHUNK_SIZE);
+                break;
+            case 'z':
+                if (std::string(optarg) == "none") {
+                    compression = dfs_service::COMPRESSION_NONE;
+                } else if (std::string(optarg) == "deflate") {
+                    compression = dfs_service::COMPRESSION_DEFLATE;
+                } else {
+                    Usage();
+                }
+                break;
             case 'h':
             case '?':
             default:
@@ -71,6 +127,11 @@ int main(int argc, char** argv) {
     signal(SIGTERM, HandleSignal);
 
     DFSServerNode server_node(server_address, dfs_clean_path(mount_path), num_async_threads, [&]{ return; });
+    server_node.SetNumPrepostedCalls(num_preposted_calls);
+    server_node.SetFsyncPolicy(fsync_policy);
+    server_node.SetIoBackend(io_backend, io_depth);
+    server_node.SetMaxChunkSize(max_chunk_size);
+    server_node.SetCompression(compression);
     server_node.Start();
 
     return 0;
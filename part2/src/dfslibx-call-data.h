@@ -1,6 +1,13 @@
 #ifndef PR4_DFSCALLDATAMANAGER_H
 #define PR4_DFSCALLDATAMANAGER_H
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <grpcpp/grpcpp.h>
 #include "dfs-utils.h"
 #include "../proto-src/dfs-service.grpc.pb.h"
@@ -26,6 +33,24 @@ public:
 
 };
 
+/**
+ * Common base of the asynchronous call state machines.
+ *
+ * Every tag placed on a completion queue points to one of these, which lets
+ * different rpc methods share the same completion queues and async threads.
+ */
+class DFSCallDataBase {
+public:
+    virtual ~DFSCallDataBase() {}
+
+    /**
+     * Advance the state machine after a completion queue event
+     *
+     * @param ok - whether the operation completed successfully
+     */
+    virtual void Proceed(bool ok) = 0;
+};
+
 /**
  * This class handles asynchronous data calls between the client and the server.
  *
@@ -36,7 +61,7 @@ public:
  * @tparam ResponseT
  */
 template <typename RequestT, typename ResponseT>
-class DFSCallData {
+class DFSCallData : public DFSCallDataBase {
 
 private:
 
@@ -77,14 +102,16 @@ public:
 
         dfs_log(LL_DEBUG3) << "DFSCallDataManager[constructor]";
         // Invoke the serving logic right away.
-        Proceed();
+        Proceed(true);
 
     }
 
     /**
      * Proceed starts the asynchronous callback process
+     *
+     * @param ok
      */
-    void Proceed() {
+    void Proceed(bool ok) override {
         if (status == CREATE) {
             // Make this instance progress to the PROCESS state.
             status = PROCESS;
@@ -100,6 +127,11 @@ public:
 
         } else if (status == PROCESS) {
             dfs_log(LL_DEBUG3) << "Proceed[PROCESS]";
+            if (!ok) {
+                // The server is shutting down, no request was received
+                delete this;
+                return;
+            }
             // Spawn a new CallData instance to serve new clients while we process
             // the one for this CallData. The instance will deallocate itself as
             // part of its FINISH state.
@@ -124,4 +156,170 @@ public:
     }
 };
 
+/**
+ * Pool of threads running unary handlers too slow for a completion queue thread.
+ *
+ * Completion queue threads are pinned and serve every call on their queue, so
+ * a handler that reads a whole file there stalls the streams sharing it.
+ * Queued handlers still run when the pool stops, since the server waits for
+ * their calls to finish while it shuts down.
+ */
+class DFSHandlerPool {
+
+private:
+
+    std::mutex mutex;
+    std::condition_variable jobs_cv;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    void Run() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                jobs_cv.wait(lock, [this]{ return stopping || !jobs.empty(); });
+                if (jobs.empty()) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+public:
+
+    explicit DFSHandlerPool(unsigned num_threads) {
+        for (unsigned i = 0; i < std::max(1u, num_threads); i++) {
+            workers.emplace_back(&DFSHandlerPool::Run, this);
+        }
+    }
+
+    ~DFSHandlerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        jobs_cv.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    /**
+     * Queue a handler for the next idle pool thread
+     *
+     * @param job
+     */
+    void Submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        jobs_cv.notify_one();
+    }
+};
+
+/**
+ * Asynchronous state machine for a unary rpc method.
+ *
+ * The request and handler methods are members of the service, so the same
+ * handler implementations can be served from the completion queue threads.
+ * Handlers run on the completion queue thread and must not block there; a
+ * handler that may read or checksum a file is given a handler pool instead.
+ *
+ * @tparam ServiceT
+ * @tparam RequestT
+ * @tparam ResponseT
+ */
+template <typename ServiceT, typename RequestT, typename ResponseT>
+class DFSUnaryCallData : public DFSCallDataBase {
+
+public:
+
+    /** Service method requesting a new call of the rpc method **/
+    typedef void (ServiceT::*RequestMethod)(grpc::ServerContext*, RequestT*,
+        grpc::ServerAsyncResponseWriter<ResponseT>*, grpc::CompletionQueue*, grpc::ServerCompletionQueue*, void*);
+
+    /** Service method handling a call of the rpc method **/
+    typedef grpc::Status (ServiceT::*HandlerMethod)(grpc::ServerContext*, const RequestT*, ResponseT*);
+
+private:
+
+    ServiceT* service;
+
+    RequestMethod request_method;
+
+    HandlerMethod handler_method;
+
+    grpc::ServerCompletionQueue* cq;
+
+    /** Runs the handler off the completion queue thread, null to run it inline **/
+    DFSHandlerPool* pool;
+
+    grpc::ServerContext ctx_;
+
+    RequestT request_;
+
+    ResponseT reply_;
+
+    grpc::ServerAsyncResponseWriter<ResponseT> responder;
+
+    enum CallStatus { PROCESS, FINISH };
+    CallStatus status;
+
+public:
+
+    DFSUnaryCallData(ServiceT* service, RequestMethod request_method, HandlerMethod handler_method,
+                     grpc::ServerCompletionQueue* cq, DFSHandlerPool* pool = nullptr) :
+        service(service), request_method(request_method), handler_method(handler_method),
+        cq(cq), pool(pool), responder(&ctx_), status(PROCESS) {
+
+        (service->*request_method)(&ctx_, &request_, &responder, cq, cq, this);
+
+    }
+
+    /**
+     * Handle the received request, or clean up once the response was sent
+     *
+     * @param ok
+     */
+    void Proceed(bool ok) override {
+        if (status == PROCESS) {
+            if (!ok) {
+                // The server is shutting down, no request was received
+                delete this;
+                return;
+            }
+
+            // Serve the next call of this method while handling this one
+            new DFSUnaryCallData<ServiceT, RequestT, ResponseT>(service, request_method, handler_method, cq, pool);
+
+            status = FINISH;
+            if (pool) {
+                pool->Submit([this]{ Handle(); });
+            } else {
+                Handle();
+            }
+        } else {
+            delete this;
+        }
+    }
+
+private:
+
+    /** Run the handler and send its response, the completion comes back on the queue **/
+    void Handle() {
+        grpc::Status call_status = (service->*handler_method)(&ctx_, &request_, &reply_);
+        if (call_status.ok()) {
+            responder.Finish(reply_, call_status, this);
+        } else {
+            responder.FinishWithError(call_status, this);
+        }
+    }
+};
+
 #endif //PR4_DFSCALLDATAMANAGER_H
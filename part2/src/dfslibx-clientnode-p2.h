@@ -199,6 +199,15 @@ public:
         RequestT request;
         request.set_name("");
 
+        CallbackList<RequestT, ResponseT>(request);
+    }
+
+    /**
+     * Sends the given callback request payload to the server.
+     */
+    template<typename RequestT, typename ResponseT>
+    void CallbackList(const RequestT& request) {
+
         // Call object to store rpc data
         AsyncClientData<ResponseT>* call_data = new AsyncClientData<ResponseT>;
 
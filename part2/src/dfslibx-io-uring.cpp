@@ -0,0 +1,392 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "dfs-utils.h"
+#include "dfslibx-io-uring.h"
+
+/** Queue depth of the rings, 0 while io_uring is disabled **/
+static std::atomic<unsigned> dfs_uring_depth(0);
+
+/**
+ * Read up to `size` bytes at `offset` with blocking calls
+ *
+ * @return bytes read, -1 on errors
+ */
+static ssize_t dfs_uring_pread(int fd, char* data, size_t size, off_t offset) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t count = pread(fd, data + total, size - total, offset + total);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) return -1;
+        if (count == 0) break;
+        total += count;
+    }
+    return static_cast<ssize_t>(total);
+}
+
+/**
+ * Write `size` bytes at `offset` with blocking calls
+ *
+ * @return false on errors
+ */
+static bool dfs_uring_pwrite(int fd, const char* data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t count = pwrite(fd, data, size, offset);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        data += count;
+        offset += count;
+        size -= count;
+    }
+    return true;
+}
+
+DFSUring::DFSUring(unsigned depth) : depth(depth) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, DFS_URING_BUFFERS, &params));
+    if (ring_fd < 0) {
+        dfs_log(LL_ERROR) << "io_uring_setup failed: " << std::strerror(errno);
+        return;
+    }
+
+    // Map the submission and completion rings, which may share one mapping
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        close(ring_fd);
+        ring_fd = -1;
+        return;
+    }
+    cq_ring = single_mmap ? sq_ring :
+        mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes_memory = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (cq_ring == MAP_FAILED || sqes_memory == MAP_FAILED) {
+        if (cq_ring == MAP_FAILED) cq_ring = nullptr;
+        if (sqes_memory != MAP_FAILED) munmap(sqes_memory, sqes_size);
+        close(ring_fd);
+        ring_fd = -1;
+        return;
+    }
+
+    char* sq = static_cast<char*>(sq_ring);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sqes = static_cast<io_uring_sqe*>(sqes_memory);
+
+    char* cq = static_cast<char*>(cq_ring);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    // Register the buffer pool, falling back to plain reads and writes if that's refused
+    void* memory = nullptr;
+    if (posix_memalign(&memory, 4096, DFS_URING_BUFFERS * DFS_URING_BUFFER_SIZE) != 0) {
+        close(ring_fd);
+        ring_fd = -1;
+        return;
+    }
+    buffer_memory = static_cast<char*>(memory);
+    std::vector<iovec> iovecs(DFS_URING_BUFFERS);
+    for (unsigned i = 0; i < DFS_URING_BUFFERS; i++) {
+        iovecs[i].iov_base = Buffer(i);
+        iovecs[i].iov_len = DFS_URING_BUFFER_SIZE;
+        free_buffers.push_back(DFS_URING_BUFFERS - 1 - i);
+    }
+    fixed_buffers = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS,
+                            iovecs.data(), DFS_URING_BUFFERS) == 0;
+    if (!fixed_buffers) {
+        dfs_log(LL_DEBUG) << "Can't register io_uring buffers: " << std::strerror(errno);
+    }
+}
+
+DFSUring::~DFSUring() {
+    if (sqes != nullptr) munmap(sqes, sqes_size);
+    if (cq_ring != nullptr && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring != nullptr) munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0) close(ring_fd);
+    free(buffer_memory);
+}
+
+bool DFSUring::Enable(unsigned depth) {
+    depth = std::max(1u, std::min(depth, DFS_URING_BUFFERS));
+    DFSUring probe(depth);
+    if (!probe.Good()) {
+        return false;
+    }
+    dfs_uring_depth = depth;
+    return true;
+}
+
+DFSUring* DFSUring::ForThread() {
+    const unsigned depth = dfs_uring_depth;
+    if (depth == 0) {
+        return nullptr;
+    }
+    thread_local std::unique_ptr<DFSUring> ring;
+    if (!ring) {
+        ring.reset(new DFSUring(depth));
+    }
+    return ring->Good() ? ring.get() : nullptr;
+}
+
+int DFSUring::AcquireBuffer() {
+    if (free_buffers.empty()) {
+        return -1;
+    }
+    int buffer = free_buffers.back();
+    free_buffers.pop_back();
+    return buffer;
+}
+
+void DFSUring::ReleaseBuffer(int buffer) {
+    free_buffers.push_back(buffer);
+}
+
+bool DFSUring::Prepare(std::uint8_t opcode, int fd, int buffer, off_t offset, unsigned size,
+                       DFSUringRequest* request) {
+    const unsigned tail = *sq_tail;
+    const unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head > *sq_mask) {
+        return false;
+    }
+
+    const unsigned index = tail & *sq_mask;
+    io_uring_sqe* sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = static_cast<std::uint64_t>(offset);
+    sqe->addr = reinterpret_cast<std::uint64_t>(Buffer(buffer));
+    sqe->len = size;
+    if (fixed_buffers) {
+        sqe->buf_index = static_cast<std::uint16_t>(buffer);
+    }
+    sqe->user_data = reinterpret_cast<std::uint64_t>(request);
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted++;
+
+    request->done = false;
+    request->result = 0;
+    return Submit(0);
+}
+
+bool DFSUring::Read(int fd, int buffer, off_t offset, unsigned size, DFSUringRequest* request) {
+    return Prepare(fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ, fd, buffer, offset, size, request);
+}
+
+bool DFSUring::Write(int fd, int buffer, off_t offset, unsigned size, DFSUringRequest* request) {
+    return Prepare(fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fd, buffer, offset, size, request);
+}
+
+bool DFSUring::Submit(unsigned min_complete) {
+    while (true) {
+        long submitted = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, min_complete,
+                                 min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (submitted >= 0) {
+            unsubmitted -= static_cast<unsigned>(submitted);
+            return true;
+        }
+        if (errno != EINTR) {
+            dfs_log(LL_ERROR) << "io_uring_enter failed: " << std::strerror(errno);
+            return false;
+        }
+    }
+}
+
+void DFSUring::Reap() {
+    unsigned head = *cq_head;
+    const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        const io_uring_cqe& cqe = cqes[head & *cq_mask];
+        DFSUringRequest* request = reinterpret_cast<DFSUringRequest*>(cqe.user_data);
+        request->result = cqe.res;
+        request->done = true;
+        head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+bool DFSUring::Wait(DFSUringRequest* request) {
+    Reap();
+    while (!request->done) {
+        if (!Submit(1)) {
+            return false;
+        }
+        Reap();
+    }
+    return true;
+}
+
+DFSUringReader::DFSUringReader(DFSUring* ring, int fd, std::int64_t offset, std::int64_t end) :
+    ring(ring), fd(fd), end(end), next_offset(offset) {
+    posix_fadvise(fd, offset, end - offset, POSIX_FADV_SEQUENTIAL);
+    Fill();
+}
+
+DFSUringReader::~DFSUringReader() {
+    // The kernel may still write into the buffers
+    for (std::unique_ptr<Slot>& slot : inflight) {
+        ring->Wait(&slot->request);
+        ring->ReleaseBuffer(slot->buffer);
+    }
+}
+
+void DFSUringReader::Fill() {
+    while (!eof && inflight.size() < ring->Depth() && next_offset < end) {
+        const int buffer = ring->AcquireBuffer();
+        if (buffer < 0) {
+            return;
+        }
+        std::unique_ptr<Slot> slot(new Slot());
+        slot->buffer = buffer;
+        slot->offset = next_offset;
+        slot->consumed = 0;
+        slot->size = static_cast<unsigned>(std::min<std::int64_t>(DFS_URING_BUFFER_SIZE, end - next_offset));
+        if (!ring->Read(fd, buffer, slot->offset, slot->size, &slot->request)) {
+            ring->ReleaseBuffer(buffer);
+            return;
+        }
+        next_offset += slot->size;
+        inflight.push_back(std::move(slot));
+    }
+}
+
+ssize_t DFSUringReader::Read(std::string* data, size_t size) {
+    data->clear();
+    while (data->size() < size && !eof) {
+        Fill();
+
+        // Every buffer of the thread is taken by other transfers, read the rest directly
+        if (inflight.empty()) {
+            const size_t begin = data->size();
+            data->resize(size);
+            ssize_t count = dfs_uring_pread(fd, &(*data)[begin], size - begin, next_offset);
+            if (count < 0) {
+                return -1;
+            }
+            data->resize(begin + count);
+            next_offset += count;
+            eof = begin + count < size;
+            break;
+        }
+
+        Slot* slot = inflight.front().get();
+        if (slot->consumed == 0) {
+            if (!ring->Wait(&slot->request) || slot->request.result < 0) {
+                return -1;
+            }
+
+            // A short read inside the file is completed with a blocking read
+            const unsigned count = static_cast<unsigned>(slot->request.result);
+            if (count < slot->size) {
+                ssize_t rest = dfs_uring_pread(fd, ring->Buffer(slot->buffer) + count, slot->size - count, slot->offset + count);
+                if (rest < 0) {
+                    return -1;
+                }
+                slot->request.result = count + static_cast<int>(rest);
+            }
+        }
+
+        const size_t available = static_cast<size_t>(slot->request.result) - slot->consumed;
+        const size_t piece = std::min(available, size - data->size());
+        data->append(ring->Buffer(slot->buffer) + slot->consumed, piece);
+        slot->consumed += piece;
+
+        // The file ended early, the reads queued behind this one have nothing to return
+        if (slot->request.result < static_cast<int>(slot->size) && slot->consumed == static_cast<size_t>(slot->request.result)) {
+            eof = true;
+        }
+        if (slot->consumed == static_cast<size_t>(slot->request.result)) {
+            ring->ReleaseBuffer(slot->buffer);
+            inflight.pop_front();
+        }
+    }
+    if (data->size() < size) {
+        eof = true;
+    }
+    Fill();
+    return static_cast<ssize_t>(data->size());
+}
+
+DFSUringWriter::DFSUringWriter(DFSUring* ring, int fd) : ring(ring), fd(fd) {}
+
+DFSUringWriter::~DFSUringWriter() {
+    Flush();
+}
+
+void DFSUringWriter::Retire() {
+    std::unique_ptr<Slot> slot = std::move(inflight.front());
+    inflight.pop_front();
+    const bool completed = ring->Wait(&slot->request);
+    const int written = completed ? slot->request.result : -1;
+    if (written < 0) {
+        failed = true;
+    } else if (written < static_cast<int>(slot->size) &&
+               !dfs_uring_pwrite(fd, ring->Buffer(slot->buffer) + written, slot->size - written, slot->offset + written)) {
+        failed = true;
+    }
+    ring->ReleaseBuffer(slot->buffer);
+}
+
+bool DFSUringWriter::Write(const char* data, size_t size) {
+    while (size > 0 && !failed) {
+        if (inflight.size() >= ring->Depth()) {
+            Retire();
+            continue;
+        }
+        const size_t piece = std::min(size, DFS_URING_BUFFER_SIZE);
+        const int buffer = ring->AcquireBuffer();
+        if (buffer < 0) {
+            // Every buffer of the thread is taken, wait for one of ours or write directly
+            if (!inflight.empty()) {
+                Retire();
+                continue;
+            }
+            failed = !dfs_uring_pwrite(fd, data, piece, offset);
+        } else {
+            std::unique_ptr<Slot> slot(new Slot());
+            slot->buffer = buffer;
+            slot->offset = offset;
+            slot->size = static_cast<unsigned>(piece);
+            std::memcpy(ring->Buffer(buffer), data, piece);
+            if (ring->Write(fd, buffer, offset, slot->size, &slot->request)) {
+                inflight.push_back(std::move(slot));
+            } else {
+                ring->ReleaseBuffer(buffer);
+                failed = !dfs_uring_pwrite(fd, data, piece, offset);
+            }
+        }
+        data += piece;
+        offset += piece;
+        size -= piece;
+    }
+    return !failed;
+}
+
+bool DFSUringWriter::Flush() {
+    while (!inflight.empty()) {
+        Retire();
+    }
+    return !failed;
+}
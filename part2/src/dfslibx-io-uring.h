@@ -0,0 +1,223 @@
+#ifndef PR4_DFS_IO_URING_H
+#define PR4_DFS_IO_URING_H
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+// Size of each registered buffer, chunks larger than this span several
+constexpr size_t DFS_URING_BUFFER_SIZE = 65536;
+
+// Registered buffers per ring, shared by all transfers of a thread
+constexpr unsigned DFS_URING_BUFFERS = 64;
+
+/**
+ * Outcome of a single submitted operation
+ */
+struct DFSUringRequest {
+    bool done = false;
+    /** Bytes transferred, or -errno **/
+    int result = 0;
+};
+
+/**
+ * A minimal io_uring instance driven through the raw system calls.
+ *
+ * Each thread owns its ring (see `ForThread`), so no locking is needed as
+ * long as a transfer is only driven from the thread it started on, which
+ * holds for calls bound to a per-thread completion queue. Reads and writes
+ * go through a pool of registered buffers; if the kernel refuses to
+ * register them, the plain read and write operations are used instead.
+ */
+class DFSUring {
+
+private:
+    int ring_fd = -1;
+
+    /** Submission queue **/
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    io_uring_sqe* sqes = nullptr;
+
+    /** Completion queue **/
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    /** Mapped ring memory **/
+    void* sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    void* cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    size_t sqes_size = 0;
+
+    /** Entries prepared but not yet submitted **/
+    unsigned unsubmitted = 0;
+
+    /** Registered buffer pool **/
+    char* buffer_memory = nullptr;
+    std::vector<int> free_buffers;
+    bool fixed_buffers = false;
+
+    /** Queue depth of a single transfer **/
+    unsigned depth;
+
+    bool Prepare(std::uint8_t opcode, int fd, int buffer, off_t offset, unsigned size, DFSUringRequest* request);
+    bool Submit(unsigned min_complete);
+    void Reap();
+
+public:
+    /**
+     * @param depth - queue depth of a single transfer
+     */
+    explicit DFSUring(unsigned depth);
+    ~DFSUring();
+
+    DFSUring(const DFSUring&) = delete;
+    DFSUring& operator=(const DFSUring&) = delete;
+
+    /**
+     * Enable the rings of all threads, probing whether the kernel supports them
+     *
+     * @param depth - queue depth of a single transfer
+     * @return false if io_uring can't be used
+     */
+    static bool Enable(unsigned depth);
+
+    /**
+     * @return the ring of the calling thread, nullptr if io_uring isn't enabled
+     */
+    static DFSUring* ForThread();
+
+    bool Good() const { return ring_fd >= 0; }
+
+    unsigned Depth() const { return depth; }
+
+    /**
+     * @return index of a free registered buffer, -1 if all are in use
+     */
+    int AcquireBuffer();
+
+    void ReleaseBuffer(int buffer);
+
+    char* Buffer(int buffer) { return buffer_memory + static_cast<size_t>(buffer) * DFS_URING_BUFFER_SIZE; }
+
+    /**
+     * Submit a read into a registered buffer
+     */
+    bool Read(int fd, int buffer, off_t offset, unsigned size, DFSUringRequest* request);
+
+    /**
+     * Submit a write from a registered buffer
+     */
+    bool Write(int fd, int buffer, off_t offset, unsigned size, DFSUringRequest* request);
+
+    /**
+     * Wait until the request completed.
+     * Completions of other requests are recorded along the way.
+     *
+     * @param request
+     * @return false if the ring failed
+     */
+    bool Wait(DFSUringRequest* request);
+};
+
+/**
+ * Sequential reader keeping up to the ring's depth of buffers in flight ahead
+ * of the consumer, so the disk works while the previous chunk is sent.
+ */
+class DFSUringReader {
+
+private:
+    struct Slot {
+        int buffer;
+        off_t offset;
+        unsigned size;
+        /** Bytes already handed to the consumer **/
+        size_t consumed;
+        DFSUringRequest request;
+    };
+
+    DFSUring* ring;
+    int fd;
+    /** Offset the reads stop at **/
+    std::int64_t end;
+    off_t next_offset;
+    bool eof = false;
+    std::deque<std::unique_ptr<Slot>> inflight;
+
+    /** Queue reads until depth chunks are in flight or end is reached **/
+    void Fill();
+
+public:
+    /**
+     * @param ring
+     * @param fd
+     * @param offset - where the first chunk starts
+     * @param end - offset the reads stop at, usually the file size
+     */
+    DFSUringReader(DFSUring* ring, int fd, std::int64_t offset, std::int64_t end);
+    ~DFSUringReader();
+
+    /**
+     * Read the next chunk into a message buffer, gathered from as many buffers as needed
+     *
+     * @param data
+     * @param size
+     * @return bytes read, less than size at the end of the file, -1 on errors
+     */
+    ssize_t Read(std::string* data, size_t size);
+};
+
+/**
+ * Sequential writer keeping up to the ring's depth of chunks in flight,
+ * so the caller can receive the next chunk while the previous one is written.
+ */
+class DFSUringWriter {
+
+private:
+    struct Slot {
+        int buffer;
+        off_t offset;
+        unsigned size;
+        DFSUringRequest request;
+    };
+
+    DFSUring* ring;
+    int fd;
+    off_t offset = 0;
+    bool failed = false;
+    std::deque<std::unique_ptr<Slot>> inflight;
+
+    /** Wait for the oldest write in flight **/
+    void Retire();
+
+public:
+    DFSUringWriter(DFSUring* ring, int fd);
+    ~DFSUringWriter();
+
+    /**
+     * Queue data to be appended to the file
+     *
+     * @param data
+     * @param size
+     * @return false if a previous write failed
+     */
+    bool Write(const char* data, size_t size);
+
+    /**
+     * Wait for every queued write
+     *
+     * @return false if any write failed
+     */
+    bool Flush();
+};
+
+#endif
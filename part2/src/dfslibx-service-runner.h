@@ -2,12 +2,14 @@
 #define PR4_DFS_SERVICE_RUNNER_H
 
 #include <map>
+#include <algorithm>
 #include <mutex>
 #include <shared_mutex>
 #include <vector>
 #include <string>
 #include <thread>
 #include <cstdio>
+#include <cstring>
 #include <chrono>
 #include <errno.h>
 #include <csignal>
@@ -18,6 +20,8 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/inotify.h>
 #include <grpcpp/grpcpp.h>
 #include <utime.h>
@@ -53,14 +57,23 @@ struct QueueRequest {
  * @param service
  * @param manager
  * @param cq
+ * @param async_calls_callback - spawns the call data of the other asynchronous methods
+ * @param num_preposted_calls - number of call data instances posted per method
  */
 template <typename RequestT, typename ResponseT>
 static void HandleAsyncRPC(dfs_service::DFSService::AsyncService* service,
                            DFSCallDataManager<RequestT, ResponseT>* manager,
-                           std::shared_ptr<grpc::ServerCompletionQueue> cq) {
-
-    // Spawn a new CallData instance to serve new clients.
-    new DFSCallData<RequestT, ResponseT>(service, manager, cq.get());
+                           std::shared_ptr<grpc::ServerCompletionQueue> cq,
+                           std::function<void(grpc::ServerCompletionQueue*)> async_calls_callback,
+                           int num_preposted_calls) {
+
+    // Spawn new CallData instances up front so bursts of clients don't wait for one to be posted.
+    for (int i = 0; i < num_preposted_calls; i++) {
+        new DFSCallData<RequestT, ResponseT>(service, manager, cq.get());
+        if (async_calls_callback) {
+            async_calls_callback(cq.get());
+        }
+    }
 
     void* tag;  // uniquely identifies a request.
 
@@ -76,11 +89,44 @@ static void HandleAsyncRPC(dfs_service::DFSService::AsyncService* service,
         // GPR_ASSERT(cq->Next(&tag, &ok));
         // GPR_ASSERT(ok);
         dfs_log(LL_DEBUG3) << "HandleAsyncRPC[Next]";
-        if (!cq->Next(&tag, &ok) || !ok) {
-            dfs_log(LL_ERROR) << "HandleAsyncRPC failed to get an ok from completion queue. Did the client crash?";
-            continue;
+        if (!cq->Next(&tag, &ok)) {
+            dfs_log(LL_SYSINFO) << "HandleAsyncRPC completion queue shut down";
+            break;
+        }
+        if (!ok) {
+            dfs_log(LL_DEBUG2) << "HandleAsyncRPC failed to get an ok from completion queue. Did the client crash?";
         }
-        static_cast<DFSCallData<RequestT, ResponseT>*>(tag)->Proceed();
+        // The state machines handle failed events themselves, e.g. a finished read stream
+        static_cast<DFSCallDataBase*>(tag)->Proceed(ok);
+    }
+}
+
+/**
+ * Pin a thread to one of the CPUs this process may run on
+ *
+ * @param thread
+ * @param index - the CPUs are assigned round robin by index
+ */
+static void PinThread(std::thread& thread, int index) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return;
+    }
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+    }
+    if (cpus.size() < 2) {
+        return;
+    }
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpus[index % cpus.size()], &cpuset);
+    int result = pthread_setaffinity_np(thread.native_handle(), sizeof(cpuset), &cpuset);
+    if (result != 0) {
+        dfs_log(LL_ERROR) << "Failed to pin thread " << index << ": " << strerror(result);
     }
 }
 
@@ -118,20 +164,32 @@ protected:
     /** The number of asynchronous threads to use **/
     int num_async_threads;
 
+    /** The number of call data instances posted per method on each completion queue **/
+    int num_preposted_calls = 1;
+
+    /** Largest message in either direction, 0 for the grpc default **/
+    int max_message_size = 0;
+
+    /** HTTP/2 flow-control lookahead of each stream, 0 for the grpc default **/
+    int flow_control_window = 0;
+
     /** The grpc service object **/
     grpc::Service* service;
 
     /** The server instance **/
     std::shared_ptr<grpc::Server> server;
 
-    /** The completion queue for async calls **/
-    std::shared_ptr<grpc::ServerCompletionQueue> completion_queue;
+    /** The completion queues for async calls, one per async thread **/
+    std::vector<std::shared_ptr<grpc::ServerCompletionQueue>> completion_queues;
 
     /** The async service object **/
     dfs_service::DFSService::AsyncService async_service;
 
     /** Queued requests callback **/
     std::function<void()> queued_requests_callback;
+
+    /** Spawns the call data of the other asynchronous methods on a completion queue **/
+    std::function<void(grpc::ServerCompletionQueue*)> async_calls_callback;
 public:
 
     DFSServiceRunner() {}
@@ -144,6 +202,10 @@ public:
         this->queued_requests_callback = queued_requests_callback;
     }
 
+    void SetAsyncCallsCallback(std::function<void(grpc::ServerCompletionQueue*)> async_calls_callback) {
+        this->async_calls_callback = async_calls_callback;
+    }
+
     void SetAddress(const std::string& server_address) {
         this->server_address = server_address;
     }
@@ -152,8 +214,23 @@ public:
         this->num_async_threads = num_async_threads;
     }
 
+    void SetNumPrepostedCalls(int num_preposted_calls) {
+        this->num_preposted_calls = std::max(1, num_preposted_calls);
+    }
+
+    void SetMaxMessageSize(int max_message_size) {
+        this->max_message_size = max_message_size;
+    }
+
+    void SetFlowControlWindow(int flow_control_window) {
+        this->flow_control_window = flow_control_window;
+    }
+
     void Shutdown() noexcept {
         this->server->Shutdown();
+        for (auto& cq : this->completion_queues) {
+            cq->Shutdown();
+        }
     }
 
     /**
@@ -163,18 +240,31 @@ public:
         grpc::ServerBuilder builder;
         builder.AddListeningPort(this->server_address, grpc::InsecureServerCredentials());
         builder.RegisterService(this->service);
-        this->completion_queue = builder.AddCompletionQueue();
+        if (this->max_message_size > 0) {
+            builder.SetMaxReceiveMessageSize(this->max_message_size);
+            builder.SetMaxSendMessageSize(this->max_message_size);
+        }
+        if (this->flow_control_window > 0) {
+            builder.AddChannelArgument(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES, this->flow_control_window);
+            builder.AddChannelArgument(GRPC_ARG_HTTP2_BDP_PROBE, 1);
+        }
+        for (int i = 0; i < this->num_async_threads; i++) {
+            this->completion_queues.emplace_back(builder.AddCompletionQueue());
+        }
         this->server = builder.BuildAndStart();
         dfs_log(LL_SYSINFO) << "DFSServerNode server listening on " << this->server_address;
 
         std::vector <std::thread> threads;
 
-        // Send async methods to separate threads
-        for (int i = this->num_async_threads; i > 0; i--) {
+        // Send async methods to separate threads, each with its own completion queue and CPU
+        for (int i = 0; i < this->num_async_threads; i++) {
             std::thread thread_async(HandleAsyncRPC<RequestT, ResponseT>,
                                      &this->async_service,
                                      dynamic_cast<DFSCallDataManager<RequestT, ResponseT> *>(this->service),
-                                     this->completion_queue);
+                                     this->completion_queues[i],
+                                     this->async_calls_callback,
+                                     this->num_preposted_calls);
+            PinThread(thread_async, i);
             dfs_log(LL_SYSINFO) << "Async thread " << i << " started";
             threads.push_back(std::move(thread_async));
         }